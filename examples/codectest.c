@@ -0,0 +1,82 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libfreenect_codec.h"
+
+// Round-trips worst case frames through the depth codec with an output
+// buffer of exactly freenect_depth_compress_bound() bytes.
+
+static int round_trip(const char *name, const uint16_t *depth, int width, int height)
+{
+	size_t bound = freenect_depth_compress_bound(width, height);
+	uint8_t *packed = (uint8_t*)malloc(bound);
+	uint16_t *unpacked = (uint16_t*)malloc(width * height * sizeof(uint16_t));
+	int ok = 0;
+
+	int size = freenect_depth_compress(depth, width, height, packed, bound);
+	if (size < 0)
+		printf("%s: compression failed with a %u byte buffer\n", name, (unsigned int)bound);
+	else if (freenect_depth_decompress(packed, size, unpacked, width, height) < 0)
+		printf("%s: decompression failed\n", name);
+	else if (memcmp(depth, unpacked, width * height * sizeof(uint16_t)) != 0)
+		printf("%s: frame differs after round trip\n", name);
+	else
+		ok = 1;
+
+	free(packed);
+	free(unpacked);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	static const uint16_t single[1] = { 40000 };
+	static const uint16_t spikes[3] = { 0, 65535, 0 };
+	int width = 640, height = 480;
+	int x, y, failed = 0;
+
+	uint16_t *frame = (uint16_t*)malloc(width * height * sizeof(uint16_t));
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			frame[y * width + x] = ((x ^ y) & 1) ? 65535 : 0;
+
+	failed += !round_trip("1x1", single, 1, 1);
+	failed += !round_trip("3x1", spikes, 3, 1);
+	failed += !round_trip("checkerboard", frame, width, height);
+
+	// Small residuals that pair up, and long runs
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			frame[y * width + x] = y < height / 2 ? 1000 + ((x * 7 + y) & 7) : 2047;
+	failed += !round_trip("pairs and runs", frame, width, height);
+
+	free(frame);
+	if (!failed)
+		printf("All depth codec round trips passed\n");
+	return failed ? 1 : 0;
+}
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <assert.h>
 #include "libfreenect.h"
+#include "libfreenect_colorize.h"
 
 #ifdef _MSC_VER
 #define HAVE_STRUCT_TIMESPEC
@@ -290,55 +291,12 @@ void *gl_threadfunc(void *arg)
 	return NULL;
 }
 
-uint16_t t_gamma[2048];
+freenect_depth_palette depth_palette;
 
 void depth_cb(freenect_device *dev, void *v_depth, uint32_t timestamp)
 {
-	int i;
-	uint16_t *depth = (uint16_t*)v_depth;
-
 	pthread_mutex_lock(&depth_mutex);
-	for (i=0; i<640*480; i++) {
-		int pval = t_gamma[depth[i]];
-		int lb = pval & 0xff;
-		switch (pval>>8) {
-			case 0:
-				depth_mid[3*i+0] = 255;
-				depth_mid[3*i+1] = 255-lb;
-				depth_mid[3*i+2] = 255-lb;
-				break;
-			case 1:
-				depth_mid[3*i+0] = 255;
-				depth_mid[3*i+1] = lb;
-				depth_mid[3*i+2] = 0;
-				break;
-			case 2:
-				depth_mid[3*i+0] = 255-lb;
-				depth_mid[3*i+1] = 255;
-				depth_mid[3*i+2] = 0;
-				break;
-			case 3:
-				depth_mid[3*i+0] = 0;
-				depth_mid[3*i+1] = 255;
-				depth_mid[3*i+2] = lb;
-				break;
-			case 4:
-				depth_mid[3*i+0] = 0;
-				depth_mid[3*i+1] = 255-lb;
-				depth_mid[3*i+2] = 255;
-				break;
-			case 5:
-				depth_mid[3*i+0] = 0;
-				depth_mid[3*i+1] = 0;
-				depth_mid[3*i+2] = 255-lb;
-				break;
-			default:
-				depth_mid[3*i+0] = 0;
-				depth_mid[3*i+1] = 0;
-				depth_mid[3*i+2] = 0;
-				break;
-		}
-	}
+	freenect_colorize_depth(&depth_palette, v_depth, FREENECT_DEPTH_11BIT_PACKED, 640, 480, depth_mid, 3);
 	got_depth++;
 	pthread_mutex_unlock(&depth_mutex);
 }
@@ -363,7 +321,7 @@ void *freenect_threadfunc(void *arg)
 	freenect_set_depth_callback(f_dev, depth_cb);
 	freenect_set_video_callback(f_dev, video_cb);
 	freenect_set_video_mode(f_dev, freenect_find_video_mode(current_resolution, current_format));
-	freenect_set_depth_mode(f_dev, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT));
+	freenect_set_depth_mode(f_dev, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT_PACKED));
 	rgb_back = (uint8_t*)malloc(freenect_find_video_mode(current_resolution, current_format).bytes);
 	rgb_mid = (uint8_t*)malloc(freenect_find_video_mode(current_resolution, current_format).bytes);
 	rgb_front = (uint8_t*)malloc(freenect_find_video_mode(current_resolution, current_format).bytes);
@@ -419,12 +377,7 @@ int main(int argc, char **argv)
 
 	printf("Kinect camera test\n");
 
-	int i;
-	for (i=0; i<2048; i++) {
-		float v = i/2048.0;
-		v = powf(v, 3)* 6;
-		t_gamma[i] = v*6*256;
-	}
+	freenect_depth_palette_gamma(&depth_palette);
 
 	g_argc = argc;
 	g_argv = argv;
@@ -24,10 +24,12 @@
  */
 
 #include "libfreenect.h"
+#include "libfreenect_codec.h"
 #include "freenect_internal.h"
 #include "platform.h"
 #include "parson.h"
 #include "registration.h"
+#include "convert.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -36,62 +38,186 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #define GRAVITY 9.80665
 
-// The dev and ctx are just faked with these numbers
+// The ctx is just faked with this number
 
-static freenect_device fake_dev_singleton;
-static freenect_device *fake_dev = &fake_dev_singleton;
 static freenect_context *fake_ctx = (freenect_context *)5678;
-static freenect_depth_cb cur_depth_cb = NULL;
-static freenect_video_cb cur_video_cb = NULL;
-static char *input_path = NULL;
-static FILE *index_fp = NULL;
-static freenect_raw_tilt_state state = { 0 };
-static uint16_t ir_brightness = 25;
+static char *input_paths = NULL;
 static int already_warned = 0;
 static double playback_prev_time = 0.;
 static double record_prev_time = 0.;
-static void *user_depth_buf = NULL;
-static void *user_video_buf = NULL;
-static int depth_running = 0;
-static int rgb_running = 0;
-static void *user_ptr = NULL;
 static bool loop_playback = true;
 
-#define MAKE_RESERVED(res, fmt) (uint32_t)(((res & 0xff) << 8) | (((fmt & 0xff))))
-#define RESERVED_TO_RESOLUTION(reserved) (freenect_resolution)((reserved >> 8) & 0xff)
-#define RESERVED_TO_FORMAT(reserved) ((reserved) & 0xff)
+// The last frames handed to the application, see freenect_set_depth_history()
+typedef struct {
+	int len;          // Frames to keep, 0 when disabled
+	int frame_size;   // Bytes per frame, 0 until the first frame
+	uint8_t *buf;
+	uint32_t *timestamps;
+	int head;         // Slot the next frame goes to
+	int count;
+} fake_history;
+
+// Everything a virtual device keeps for itself. The freenect_device handed
+// to the application is the first member, so a handle can be cast back.
+typedef struct {
+	freenect_device dev;
+	freenect_depth_cb depth_cb;
+	freenect_video_cb video_cb;
+	freenect_raw_tilt_state state;
+	uint16_t ir_brightness;
+	void *user_depth_buf;
+	void *user_video_buf;
+	void *default_depth_back;
+	void *default_video_back;
+	int depth_running;
+	int rgb_running;
+	void *user_ptr;
+	freenect_frame_mode video_mode;
+	freenect_frame_mode depth_mode;
+	fake_history depth_hist;
+	fake_history video_hist;
+} fake_device;
+
+#define FAKENECT_MAX_DEVICES 8
+
+static fake_device fake_devs[FAKENECT_MAX_DEVICES];
+static int num_fake_devs = 1;
+
+static fake_device *to_fake(freenect_device *dev)
+{
+	return (fake_device *)dev;
+}
+
+static void free_history(fake_history *hist)
+{
+	free(hist->buf);
+	free(hist->timestamps);
+	hist->buf = NULL;
+	hist->timestamps = NULL;
+	hist->frame_size = 0;
+	hist->head = 0;
+	hist->count = 0;
+}
+
+static void push_history(fake_history *hist, const void *frame, int size, uint32_t timestamp)
+{
+	if (!hist->len)
+		return;
+	if (hist->frame_size != size) {
+		free_history(hist);
+		hist->buf = malloc((size_t)hist->len * size);
+		hist->timestamps = malloc(hist->len * sizeof(uint32_t));
+		if (!hist->buf || !hist->timestamps) {
+			printf("Error: Cannot allocate a history of %d frames\n", hist->len);
+			free_history(hist);
+			return;
+		}
+		hist->frame_size = size;
+	}
+	memcpy(hist->buf + (size_t)hist->head * size, frame, size);
+	hist->timestamps[hist->head] = timestamp;
+	hist->head = (hist->head + 1) % hist->len;
+	if (hist->count < hist->len)
+		hist->count++;
+}
+
+static int get_history(fake_history *hist, int age, const void **frame, uint32_t *timestamp)
+{
+	if (age < 0 || age >= hist->count)
+		return -1;
+	int slot = (hist->head + hist->len - 1 - age) % hist->len;
+	*frame = hist->buf + (size_t)slot * hist->frame_size;
+	if (timestamp)
+		*timestamp = hist->timestamps[slot];
+	return 0;
+}
 
-static freenect_frame_mode rgb_video_mode =
-	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB),
-	    FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_RGB},
-	    640*480*3, 640,  480, 24, 0, 30, 1 };
-static freenect_frame_mode yuv_video_mode =
-	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_YUV_RAW),
-	    FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_YUV_RAW},
-	    640*480*2, 640, 480, 16, 0, 15, 1 };
+static int set_history(fake_history *hist, int running, int length)
+{
+	if (length < 0 || running)
+		return -1;
+	free_history(hist);
+	hist->len = length;
+	return 0;
+}
 
-static freenect_frame_mode video_mode;
+// FAKENECT_PATH may list several recording directories. Each one is a
+// source providing one or more consecutive virtual devices, and all sources
+// are played back side by side, each relative to its own first record.
+#ifdef _WIN32
+#define FAKENECT_PATH_SEPARATOR ";"
+#else
+#define FAKENECT_PATH_SEPARATOR ":"
+#endif
+
+typedef struct {
+	char *path;
+	FILE *index_fp;
+	int first_device;
+	int num_devices;
+	double first_time;
+	bool exhausted;
+	// The next record, read ahead so sources can be interleaved in time
+	bool have_pending;
+	char type;
+	double cur_time;
+	unsigned int timestamp;
+	int device;
+	unsigned int data_size;
+	char *data;
+} fake_source;
 
-static freenect_frame_mode depth_11_mode =
-	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT),
-	    FREENECT_RESOLUTION_MEDIUM, {FREENECT_DEPTH_11BIT},
-	    640*480*2, 640, 480, 11, 5, 30, 1};
-static freenect_frame_mode depth_registered_mode =
-	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_REGISTERED),
-	    FREENECT_RESOLUTION_MEDIUM, {FREENECT_DEPTH_REGISTERED},
-	    640*480*2, 640, 480, 16, 0, 30, 1};
-static freenect_frame_mode depth_mm_mode =
-	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_MM),
-	    FREENECT_RESOLUTION_MEDIUM, {FREENECT_DEPTH_MM},
-	    640*480*2, 640, 480, 16, 0, 30, 1};
+static fake_source fake_sources[FAKENECT_MAX_DEVICES];
+static int num_fake_sources = 0;
 
-static freenect_frame_mode depth_mode;
+#define MAKE_RESERVED(res, fmt) (uint32_t)(((res & 0xff) << 8) | (((fmt & 0xff))))
+#define RESERVED_TO_RESOLUTION(reserved) (freenect_resolution)((reserved >> 8) & 0xff)
+#define RESERVED_TO_FORMAT(reserved) ((reserved) & 0xff)
 
-static void *default_video_back;
-static void *default_depth_back;
+// Recordings hold medium resolution 11 bit depth and RGB or 10 bit IR
+// video; every other format is derived from those on playback.
+#define video_mode_count 7
+static freenect_frame_mode supported_video_modes[video_mode_count] = {
+	// reserved, resolution, format, bytes, width, height, data_bits_per_pixel, padding_bits_per_pixel, framerate, is_valid
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_RGB}, 640*480*3, 640,  480, 24, 0, 30, 1 },
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_BAYER), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_BAYER}, 640*480, 640, 480, 8, 0, 30, 1 },
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_IR_8BIT), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_IR_8BIT}, 640*488, 640, 488, 8, 0, 30, 1 },
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_IR_10BIT), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_IR_10BIT}, 640*488*2, 640, 488, 10, 6, 30, 1 },
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_IR_10BIT_PACKED), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_IR_10BIT_PACKED}, 640*488*10/8, 640, 488, 10, 0, 30, 1 },
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_YUV_RGB), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_YUV_RGB}, 640*480*3, 640, 480, 24, 0, 15, 1 },
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_YUV_RAW), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_YUV_RAW}, 640*480*2, 640, 480, 16, 0, 15, 1 },
+};
+
+#define depth_mode_count 12
+static freenect_frame_mode supported_depth_modes[depth_mode_count] = {
+	// reserved, resolution, format, bytes, width, height, data_bits_per_pixel, padding_bits_per_pixel, framerate, is_valid
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT), FREENECT_RESOLUTION_MEDIUM, {FREENECT_DEPTH_11BIT}, 640*480*2, 640, 480, 11, 5, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_10BIT), FREENECT_RESOLUTION_MEDIUM, {FREENECT_DEPTH_10BIT}, 640*480*2, 640, 480, 10, 6, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT_PACKED), FREENECT_RESOLUTION_MEDIUM, {FREENECT_DEPTH_11BIT_PACKED}, 640*480*11/8, 640, 480, 11, 0, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_10BIT_PACKED), FREENECT_RESOLUTION_MEDIUM, {FREENECT_DEPTH_10BIT_PACKED}, 640*480*10/8, 640, 480, 10, 0, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_REGISTERED), FREENECT_RESOLUTION_MEDIUM, {FREENECT_DEPTH_REGISTERED}, 640*480*2, 640, 480, 16, 0, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_MM), FREENECT_RESOLUTION_MEDIUM, {FREENECT_DEPTH_MM}, 640*480*2, 640, 480, 16, 0, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_LOW, FREENECT_DEPTH_11BIT), FREENECT_RESOLUTION_LOW, {FREENECT_DEPTH_11BIT}, 320*240*2, 320, 240, 11, 5, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_LOW, FREENECT_DEPTH_10BIT), FREENECT_RESOLUTION_LOW, {FREENECT_DEPTH_10BIT}, 320*240*2, 320, 240, 10, 6, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_LOW, FREENECT_DEPTH_MM), FREENECT_RESOLUTION_LOW, {FREENECT_DEPTH_MM}, 320*240*2, 320, 240, 16, 0, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_QUARTER, FREENECT_DEPTH_11BIT), FREENECT_RESOLUTION_QUARTER, {FREENECT_DEPTH_11BIT}, 160*120*2, 160, 120, 11, 5, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_QUARTER, FREENECT_DEPTH_10BIT), FREENECT_RESOLUTION_QUARTER, {FREENECT_DEPTH_10BIT}, 160*120*2, 160, 120, 10, 6, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_QUARTER, FREENECT_DEPTH_MM), FREENECT_RESOLUTION_QUARTER, {FREENECT_DEPTH_MM}, 160*120*2, 160, 120, 16, 0, 30, 1},
+};
+static const freenect_frame_mode invalid_mode = {0, (freenect_resolution)0, {(freenect_video_format)0}, 0, 0, 0, 0, 0, 0, 0};
+
+#define IR_FRAME_H 488
+
+// Scratch space for turning a recorded frame into the selected format. The
+// raw buffer holds what the camera would have sent, so that the same
+// conversions as in the real library can run on it.
+static uint16_t *decoded_back;
+static uint8_t *raw_back;
+static uint8_t *rgb_back;
 
 
 static char *one_line(FILE *fp)
@@ -120,16 +246,16 @@ static int get_data_size(FILE *fp)
 	return out;
 }
 
-static int parse_line(char *type, double *cur_time, unsigned int *timestamp, unsigned int *data_size, char **data)
+static int parse_line(fake_source *src, char *type, double *cur_time, unsigned int *timestamp, int *device, unsigned int *data_size, char **data)
 {
-	char *line = one_line(index_fp);
+	char *line = one_line(src->index_fp);
 	if (!line) {
-		printf("Warning: No more lines in [%s]\n", input_path);
+		printf("Warning: No more lines in [%s]\n", src->path);
 		return -1;
 	}
-	int file_path_size = strlen(input_path) + strlen(line) + 50;
+	int file_path_size = strlen(src->path) + strlen(line) + 50;
 	char *file_path = malloc(file_path_size);
-	snprintf(file_path, file_path_size, "%s/%s", input_path, line);
+	snprintf(file_path, file_path_size, "%s/%s", src->path, line);
 	// Open file
 	FILE *cur_fp = fopen(file_path, "rb");
 	if (!cur_fp) {
@@ -139,7 +265,9 @@ static int parse_line(char *type, double *cur_time, unsigned int *timestamp, uns
 	// Parse data from file name
 	int ret = 0;
 	*data_size = get_data_size(cur_fp);
-	sscanf(line, "%c-%lf-%u-%*s", type, cur_time, timestamp);
+	// Recordings made before multi device support carry no device index
+	if (sscanf(line, "%c-%lf-%u-%d", type, cur_time, timestamp, device) < 4)
+		*device = 0;
 	*data = malloc(*data_size);
 	if (fread(*data, *data_size, 1, cur_fp) != 1) {
 		printf("Error: Couldn't read entire file.\n");
@@ -151,13 +279,13 @@ static int parse_line(char *type, double *cur_time, unsigned int *timestamp, uns
 	return ret;
 }
 
-static void open_index()
+static void open_index(fake_source *src)
 {
-	int index_path_size = strlen(input_path) + 50;
+	int index_path_size = strlen(src->path) + 50;
 	char *index_path = malloc(index_path_size);
-	snprintf(index_path, index_path_size, "%s/INDEX.txt", input_path);
-	index_fp = fopen(index_path, "rb");
-	if (!index_fp) {
+	snprintf(index_path, index_path_size, "%s/INDEX.txt", src->path);
+	src->index_fp = fopen(index_path, "rb");
+	if (!src->index_fp) {
 		printf("Error: Cannot open file [%s]\n", index_path);
 		exit(1);
 	}
@@ -166,12 +294,47 @@ static void open_index()
 
 static void close_index()
 {
-	fclose(index_fp);
-	index_fp = NULL;
+	int i;
+	for (i = 0; i < num_fake_sources; i++) {
+		fake_source *src = &fake_sources[i];
+		if (src->index_fp)
+			fclose(src->index_fp);
+		src->index_fp = NULL;
+		src->exhausted = false;
+		src->first_time = -1;
+	}
 	record_prev_time = 0;
 	playback_prev_time = 0;
 }
 
+static fake_source *next_source()
+{
+	// Pick the source whose pending record is due first
+	fake_source *next = NULL;
+	int i;
+	for (i = 0; i < num_fake_sources; i++) {
+		fake_source *src = &fake_sources[i];
+		if (!src->have_pending && !src->exhausted) {
+			if (!src->index_fp)
+				open_index(src);
+			if (parse_line(src, &src->type, &src->cur_time, &src->timestamp,
+			               &src->device, &src->data_size, &src->data) == 0) {
+				src->have_pending = true;
+				if (src->first_time < 0)
+					src->first_time = src->cur_time;
+			} else {
+				free(src->data);
+				src->data = NULL;
+				src->exhausted = true;
+			}
+		}
+		if (src->have_pending && (!next ||
+		    src->cur_time - src->first_time < next->cur_time - next->first_time))
+			next = src;
+	}
+	return next;
+}
+
 static char *skip_line(char *str)
 {
 	char *out = strchr(str, '\n');
@@ -209,86 +372,217 @@ static void convert_rgb_to_uyvy(uint8_t *rgb_buffer, uint8_t *yuv_buffer,
 	}
 }
 
+static uint16_t *read_frame16(char *data, unsigned int data_size, int width, int height)
+{
+	// Older recordings store depth as PGM, newer ones use the depth codec
+	if (data_size > 0 && data[0] == 'P')
+		return (uint16_t *)skip_line(data);
+	if (freenect_depth_decompress((uint8_t *)data, data_size, decoded_back, width, height) < 0) {
+		printf("Error: Compressed frame is corrupt\n");
+		exit(1);
+	}
+	return decoded_back;
+}
+
+static void convert_rgb_to_ir(uint8_t *rgb, uint16_t *ir)
+{
+	// Luminance scaled to 10 bits, with the extra IR lines left black
+	int i;
+	for (i = 0; i < 640*480; i++, rgb += 3)
+		ir[i] = (rgb[0] * 306 + rgb[1] * 601 + rgb[2] * 117) >> 8;
+	memset(ir + 640*480, 0, 640*(IR_FRAME_H-480)*sizeof(*ir));
+}
+
+static void convert_ir_to_rgb(uint16_t *ir, uint8_t *rgb)
+{
+	int i;
+	for (i = 0; i < 640*480; i++, rgb += 3)
+		rgb[0] = rgb[1] = rgb[2] = ir[i] >> 2;
+}
+
+static void process_depth(fake_device *fdev, uint16_t *cur_depth, uint32_t timestamp)
+{
+	freenect_device *fake_dev = &fdev->dev;
+	freenect_frame_mode mode = freenect_get_current_depth_mode(fake_dev);
+	void *depth_buffer = fdev->user_depth_buf ? fdev->user_depth_buf : fdev->default_depth_back;
+	int n = 640 * 480;
+	int i;
+
+	// 10 bit modes have half the range of the recorded 11 bit data
+	if (mode.depth_format == FREENECT_DEPTH_10BIT ||
+	    mode.depth_format == FREENECT_DEPTH_10BIT_PACKED) {
+		for (i = 0; i < n; i++)
+			cur_depth[i] >>= 1;
+	}
+
+	// Binned modes reduce the recorded frame the same way the device does
+	if (mode.resolution != FREENECT_RESOLUTION_MEDIUM) {
+		int vw = mode.depth_format == FREENECT_DEPTH_10BIT ? 10 : 11;
+		uint16_t invalid = vw == 10 ? 1023 : FREENECT_DEPTH_RAW_NO_VALUE;
+		convert_16bit_to_packed(cur_depth, raw_back, vw, n);
+		convert_packed_to_16bit_binned(raw_back, depth_buffer, vw, 640, 480,
+		                               640 / mode.width, fake_dev->depth_binning, invalid);
+		if (mode.depth_format == FREENECT_DEPTH_MM)
+			freenect_apply_binned_depth_to_mm(fake_dev, depth_buffer, mode.width * mode.height);
+		push_history(&fdev->depth_hist, depth_buffer, mode.bytes, timestamp);
+		fdev->depth_cb(fake_dev, depth_buffer, timestamp);
+		return;
+	}
+
+	switch (mode.depth_format) {
+	case FREENECT_DEPTH_11BIT:
+		convert_16bit_to_packed(cur_depth, raw_back, 11, n);
+		convert_packed11_to_16bit(raw_back, depth_buffer, n);
+		break;
+	case FREENECT_DEPTH_REGISTERED:
+		convert_16bit_to_packed(cur_depth, raw_back, 11, n);
+		freenect_apply_registration(fake_dev, raw_back, depth_buffer, false);
+		break;
+	case FREENECT_DEPTH_MM:
+		convert_16bit_to_packed(cur_depth, raw_back, 11, n);
+		freenect_apply_depth_to_mm(fake_dev, raw_back, depth_buffer);
+		break;
+	case FREENECT_DEPTH_10BIT:
+		convert_16bit_to_packed(cur_depth, raw_back, 10, n);
+		convert_packed_to_16bit(raw_back, depth_buffer, 10, n);
+		break;
+	case FREENECT_DEPTH_11BIT_PACKED:
+		convert_16bit_to_packed(cur_depth, depth_buffer, 11, n);
+		break;
+	case FREENECT_DEPTH_10BIT_PACKED:
+		convert_16bit_to_packed(cur_depth, depth_buffer, 10, n);
+		break;
+	default:
+		assert(0);
+		break;
+	}
+
+	push_history(&fdev->depth_hist, depth_buffer, mode.bytes, timestamp);
+	fdev->depth_cb(fake_dev, depth_buffer, timestamp);
+}
+
+static void process_video(fake_device *fdev, uint8_t *cur_rgb, uint16_t *cur_ir, uint32_t timestamp)
+{
+	/* Exactly one of cur_rgb and cur_ir is set, depending on what was
+	 * recorded. Formats of the other kind are approximated from it.
+	 */
+	freenect_device *fake_dev = &fdev->dev;
+	freenect_frame_mode mode = freenect_get_current_video_mode(fake_dev);
+	void *video_buffer = fdev->user_video_buf ? fdev->user_video_buf : fdev->default_video_back;
+	int n = mode.width * mode.height;
+
+	switch (mode.video_format) {
+	case FREENECT_VIDEO_RGB:
+	case FREENECT_VIDEO_BAYER:
+	case FREENECT_VIDEO_YUV_RGB:
+	case FREENECT_VIDEO_YUV_RAW:
+		if (!cur_rgb) {
+			convert_ir_to_rgb(cur_ir, rgb_back);
+			cur_rgb = rgb_back;
+		}
+		break;
+	case FREENECT_VIDEO_IR_8BIT:
+	case FREENECT_VIDEO_IR_10BIT:
+	case FREENECT_VIDEO_IR_10BIT_PACKED:
+		if (!cur_ir) {
+			convert_rgb_to_ir(cur_rgb, decoded_back);
+			cur_ir = decoded_back;
+		}
+		break;
+	default:
+		break;
+	}
+
+	switch (mode.video_format) {
+	case FREENECT_VIDEO_RGB:
+		memcpy(video_buffer, cur_rgb, mode.bytes);
+		break;
+	case FREENECT_VIDEO_BAYER:
+		convert_rgb_to_bayer(cur_rgb, video_buffer, mode);
+		break;
+	case FREENECT_VIDEO_YUV_RGB:
+		convert_rgb_to_uyvy(cur_rgb, raw_back, mode);
+		convert_uyvy_to_rgb(raw_back, video_buffer, mode);
+		break;
+	case FREENECT_VIDEO_YUV_RAW:
+		convert_rgb_to_uyvy(cur_rgb, video_buffer, mode);
+		break;
+	case FREENECT_VIDEO_IR_8BIT:
+		convert_16bit_to_packed(cur_ir, raw_back, 10, n);
+		convert_packed_to_8bit(raw_back, video_buffer, 10, n);
+		break;
+	case FREENECT_VIDEO_IR_10BIT:
+		convert_16bit_to_packed(cur_ir, raw_back, 10, n);
+		convert_packed_to_16bit(raw_back, video_buffer, 10, n);
+		break;
+	case FREENECT_VIDEO_IR_10BIT_PACKED:
+		convert_16bit_to_packed(cur_ir, video_buffer, 10, n);
+		break;
+	default:
+		assert(0);
+		break;
+	}
+
+	push_history(&fdev->video_hist, video_buffer, mode.bytes, timestamp);
+	fdev->video_cb(fake_dev, video_buffer, timestamp);
+}
+
 int freenect_process_events(freenect_context *ctx)
 {
 	/* This is where the magic happens. We read 1 update from the index
 	   per call, so this needs to be called in a loop like usual.  If the
-	   index line is a Depth/RGB image the provided callback is called.  If
+	   index line is a Depth/RGB/IR image the provided callback is called.  If
 	   the index line is accelerometer data, then it is used to update our
 	   internal state.  If you query for the accelerometer data you get the
 	   last sensor reading that we have.  The time delays are compensated as
 	   best as we can to match those from the original data and current run
 	   conditions (e.g., if it takes longer to run this code then we wait less).
 	 */
-	if (!index_fp)
-		open_index();
-	char type;
-	double record_cur_time;
-	unsigned int timestamp, data_size;
-	char *data = NULL;
-	if (parse_line(&type, &record_cur_time, &timestamp, &data_size, &data)) {
+	fake_source *src = next_source();
+	if (!src) {
                 if (loop_playback) {
 			close_index();
 			return 0;
                 } else
 		    return -1;
 	}
+	char type = src->type;
+	double record_cur_time = src->cur_time - src->first_time;
+	unsigned int timestamp = src->timestamp;
+	unsigned int data_size = src->data_size;
+	char *data = src->data;
+	int device = src->device;
+	src->have_pending = false;
+	src->data = NULL;
 	// Sleep an amount that compensates for the original and current delays
 	// playback_ is w.r.t. the current time
-	// record_ is w.r.t. the original time period during the recording
-	if (record_prev_time != 0. && playback_prev_time != 0.)
+	// record_ is w.r.t. the original time period during the recording,
+	// counted from the first record of its source
+	if (playback_prev_time != 0.)
 		sleep_highres((record_cur_time - record_prev_time) - (get_time() - playback_prev_time));
 	record_prev_time = record_cur_time;
+	if (device < 0 || device >= src->num_devices) {
+		free(data);
+		playback_prev_time = get_time();
+		return 0;
+	}
+	fake_device *fdev = &fake_devs[src->first_device + device];
 	switch (type) {
 		case 'd':
-			if (cur_depth_cb && depth_running) {
-				freenect_frame_mode mode = freenect_get_current_depth_mode(fake_dev);
-				void *cur_depth = skip_line(data);
-				void *depth_buffer = user_depth_buf ? user_depth_buf : default_depth_back;
-
-				switch (mode.depth_format) {
-				case FREENECT_DEPTH_11BIT:
-				    memcpy(depth_buffer, cur_depth, mode.bytes);
-				    break;
-                                case FREENECT_DEPTH_REGISTERED:
-                                    freenect_apply_registration(fake_dev, cur_depth, depth_buffer, true);
-                                    break;
-				case FREENECT_DEPTH_MM:
-				    freenect_apply_depth_unpacked_to_mm(fake_dev, cur_depth, depth_buffer);
-				    break;
-				default:
-				    assert(0);
-				    break;
-				}
-
-				cur_depth_cb(fake_dev, depth_buffer, timestamp);
-			}
+			if (fdev->depth_cb && fdev->depth_running)
+				process_depth(fdev, read_frame16(data, data_size, 640, 480), timestamp);
 			break;
 		case 'r':
-			if (cur_video_cb && rgb_running) {
-				void *cur_video = skip_line(data);
-				void *video_buffer = user_video_buf ? user_video_buf : default_video_back;
-
-				freenect_frame_mode mode = freenect_get_current_video_mode(fake_dev);
-
-				switch (mode.video_format) {
-				case FREENECT_VIDEO_RGB:
-					memcpy(video_buffer, cur_video, mode.bytes);
-					break;
-				case FREENECT_VIDEO_YUV_RAW:
-					convert_rgb_to_uyvy(cur_video, video_buffer, mode);
-					break;
-				default:
-					assert(0);
-					break;
-				}
-
-				cur_video_cb(fake_dev, video_buffer, timestamp);
-			}
+			if (fdev->video_cb && fdev->rgb_running)
+				process_video(fdev, (uint8_t *)skip_line(data), NULL, timestamp);
+			break;
+		case 'i':
+			if (fdev->video_cb && fdev->rgb_running)
+				process_video(fdev, NULL, read_frame16(data, data_size, 640, IR_FRAME_H), timestamp);
 			break;
 		case 'a':
-			if (data_size == sizeof(state)) {
-				memcpy(&state, data, sizeof(state));
+			if (data_size == sizeof(fdev->state)) {
+				memcpy(&fdev->state, data, sizeof(fdev->state));
 			} else if (!already_warned) {
 				already_warned = 1;
 				printf("\n\nWarning: Accelerometer data has an unexpected"
@@ -297,7 +591,7 @@ int freenect_process_events(freenect_context *ctx)
 				       "values.  This data was probably made with an "
 				       "older version of record (the upstream interface "
 				       "changed).\n\n",
-				       data_size, (unsigned int)sizeof state);
+				       data_size, (unsigned int)sizeof fdev->state);
 			}
 			break;
 	}
@@ -311,6 +605,23 @@ int freenect_process_events_timeout(freenect_context *ctx, struct timeval *timeo
 	return freenect_process_events(ctx);
 }
 
+// Playback has no file descriptors; an external event loop is told to call
+// freenect_process_events_timeout() right away, which paces the recording
+int freenect_get_pollfds(freenect_context *ctx, freenect_pollfd **fds)
+{
+	*fds = NULL;
+	return 0;
+}
+
+void freenect_set_pollfd_notifiers(freenect_context *ctx, freenect_pollfd_added_cb added, freenect_pollfd_removed_cb removed, void *user) {}
+
+int freenect_get_next_timeout(freenect_context *ctx, struct timeval *timeout)
+{
+	timeout->tv_sec = 0;
+	timeout->tv_usec = 0;
+	return 1;
+}
+
 double freenect_get_tilt_degs(freenect_raw_tilt_state *state)
 {
 	// NOTE: This is duped from tilt.c, this is the only function we need from there
@@ -319,7 +630,7 @@ double freenect_get_tilt_degs(freenect_raw_tilt_state *state)
 
 freenect_raw_tilt_state* freenect_get_tilt_state(freenect_device *dev)
 {
-	return &state;
+	return &to_fake(dev)->state;
 }
 
 freenect_tilt_status_code freenect_get_tilt_status(freenect_raw_tilt_state *state)
@@ -338,27 +649,31 @@ void freenect_get_mks_accel(freenect_raw_tilt_state *state, double* x, double* y
 
 void freenect_set_depth_callback(freenect_device *dev, freenect_depth_cb cb)
 {
-	cur_depth_cb = cb;
+	to_fake(dev)->depth_cb = cb;
 }
 
 void freenect_set_video_callback(freenect_device *dev, freenect_video_cb cb)
 {
-	cur_video_cb = cb;
+	to_fake(dev)->video_cb = cb;
 }
 
 int freenect_set_video_mode(freenect_device* dev, const freenect_frame_mode mode)
 {
+	if (!mode.is_valid)
+		return -1;
         // Always say it was successful but continue to pass through the
         // underlying data.  Would be better to check for conflict.
-	video_mode = mode;
+	to_fake(dev)->video_mode = mode;
         return 0;
 }
 
 int freenect_set_depth_mode(freenect_device* dev, const freenect_frame_mode mode)
 {
+	if (!mode.is_valid)
+		return -1;
         // Always say it was successful but continue to pass through the
         // underlying data.  Would be better to check for conflict.
-	depth_mode = mode;
+	to_fake(dev)->depth_mode = mode;
 
 	if ((mode.depth_format == FREENECT_DEPTH_MM ||
              mode.depth_format == FREENECT_DEPTH_REGISTERED) &&
@@ -371,110 +686,139 @@ int freenect_set_depth_mode(freenect_device* dev, const freenect_frame_mode mode
 }
 
 freenect_frame_mode freenect_find_video_mode(freenect_resolution res, freenect_video_format fmt) {
-    assert(FREENECT_RESOLUTION_MEDIUM == res);
-
-    switch(fmt) {
-    case FREENECT_VIDEO_RGB:
-	    return rgb_video_mode;
-    case FREENECT_VIDEO_YUV_RAW:
-	    return yuv_video_mode;
-    default:
-	    assert(0);
-	    break;
+    uint32_t unique_id = MAKE_RESERVED(res, fmt);
+    int i;
+    for (i = 0; i < video_mode_count; i++) {
+	    if (supported_video_modes[i].reserved == unique_id)
+		    return supported_video_modes[i];
     }
 
-    freenect_frame_mode invalid = { 0 };
-    return invalid;
+    return invalid_mode;
 }
 
 int freenect_get_video_mode_count()
 {
-    return 1;
+    return video_mode_count;
 }
 
 freenect_frame_mode freenect_get_video_mode(int mode_num)
 {
-    if (mode_num == 0)
-	return rgb_video_mode;
-    else if (mode_num == 1)
-	return yuv_video_mode;
-    else {
-	freenect_frame_mode invalid = { 0 };
-	return invalid;
-    }
+    if (mode_num >= 0 && mode_num < video_mode_count)
+	return supported_video_modes[mode_num];
+    return invalid_mode;
 }
 
 freenect_frame_mode freenect_get_current_video_mode(freenect_device *dev)
 {
-    return video_mode;
+    return to_fake(dev)->video_mode;
 }
 
 freenect_frame_mode freenect_find_depth_mode(freenect_resolution res, freenect_depth_format fmt) {
-    assert(FREENECT_RESOLUTION_MEDIUM == res);
-
-    switch (fmt) {
-    case FREENECT_DEPTH_11BIT:
-	    return depth_11_mode;
-    case FREENECT_DEPTH_REGISTERED:
-            return depth_registered_mode;
-    case FREENECT_DEPTH_MM:
-	    return depth_mm_mode;
-    default:
-	    assert(0);
-	    break;
+    uint32_t unique_id = MAKE_RESERVED(res, fmt);
+    int i;
+    for (i = 0; i < depth_mode_count; i++) {
+	    if (supported_depth_modes[i].reserved == unique_id)
+		    return supported_depth_modes[i];
     }
 
-    freenect_frame_mode invalid = { 0 };
-    return invalid;
+    return invalid_mode;
 }
 
 int freenect_get_depth_mode_count()
 {
-    return 3;
+    return depth_mode_count;
 }
 
 freenect_frame_mode freenect_get_depth_mode(int mode_num)
 {
-    if (mode_num == 0)
-	return depth_11_mode;
-    else if (mode_num == 1)
-	return depth_mm_mode;
-    else if (mode_num == 2)
-        return depth_registered_mode;
-    else {
-	freenect_frame_mode invalid = { 0 };
-	return invalid;
-    }
+    if (mode_num >= 0 && mode_num < depth_mode_count)
+	return supported_depth_modes[mode_num];
+    return invalid_mode;
 }
 
 freenect_frame_mode freenect_get_current_depth_mode(freenect_device *dev)
 {
-    return depth_mode;
+    return to_fake(dev)->depth_mode;
 }
 
 int freenect_num_devices(freenect_context *ctx)
 {
-	// Always 1 device
-	return 1;
+	return num_fake_devs;
 }
 
 int freenect_open_device(freenect_context *ctx, freenect_device **dev, int index)
 {
-	// Set it to some number to allow for NULL checks
-	*dev = fake_dev;
+	if (index < 0 || index >= num_fake_devs)
+		return -1;
+	*dev = &fake_devs[index].dev;
 	return 0;
 }
 
+int freenect_open_devices(freenect_context *ctx, freenect_device **devs, const int *indexes, int count)
+{
+	int i, opened = 0;
+	if (!devs || count <= 0)
+		return -1;
+	for (i = 0; i < count; i++) {
+		devs[i] = NULL;
+		if (freenect_open_device(ctx, &devs[i], indexes ? indexes[i] : i) == 0)
+			opened++;
+	}
+	return opened;
+}
+
 int freenect_open_device_by_camera_serial(freenect_context *ctx, freenect_device **dev, const char* camera_serial)
 {
-    *dev = fake_dev;
+    *dev = &fake_devs[0].dev;
     return 0;
 }
 
-static void read_device_info(freenect_device *dev)
+static int count_devices(const char *path, int max_devices)
+{
+	/* Multi device recordings tag every record with the index of the
+	 * device it came from; the highest index seen decides how many virtual
+	 * devices the recording provides.
+	 */
+	int index_path_size = strlen(path) + 50;
+	char *index_path = malloc(index_path_size);
+	snprintf(index_path, index_path_size, "%s/INDEX.txt", path);
+	FILE *fp = fopen(index_path, "rb");
+	free(index_path);
+	if (!fp)
+		return 1;
+
+	char *line;
+	int num_devices = 1;
+	int warned = 0;
+	while ((line = one_line(fp))) {
+		char type;
+		double cur_time;
+		unsigned int timestamp;
+		int device;
+		if (sscanf(line, "%c-%lf-%u-%d", &type, &cur_time, &timestamp, &device) == 4 &&
+		    device >= num_devices) {
+			if (device < max_devices) {
+				num_devices = device + 1;
+			} else if (!warned) {
+				warned = 1;
+				printf("Warning: [%s] has more devices than the %d "
+				       "fakenect can still provide, ignoring the rest\n",
+				       path, max_devices);
+			}
+		}
+		free(line);
+	}
+	fclose(fp);
+	return num_devices;
+}
+
+static void read_device_info(freenect_device *dev, const char *path, int index)
 {
 	char fn[512];
-	snprintf(fn, sizeof(fn), "%s/device.json", input_path);
+	if (index == 0)
+		snprintf(fn, sizeof(fn), "%s/device.json", path);
+	else
+		snprintf(fn, sizeof(fn), "%s/device-%d.json", path, index);
 
 	/* We silently return if this file is missing for compatibility with
 	 * older recordings and applications that don't depend on registration
@@ -526,12 +870,12 @@ static void read_device_info(freenect_device *dev)
 
 	json_value_free(js);
 
-	freenect_init_registration(fake_dev);
+	freenect_init_registration(dev);
 }
 
 int freenect_init(freenect_context **ctx, freenect_usb_context *usb_ctx)
 {
-	input_path = getenv("FAKENECT_PATH");
+	char *input_path = getenv("FAKENECT_PATH");
 	if (!input_path) {
 		printf("Error: Environmental variable FAKENECT_PATH is not set.  Set it to a path that was created using the 'record' utility.\n");
 		exit(1);
@@ -556,13 +900,43 @@ int freenect_init(freenect_context **ctx, freenect_usb_context *usb_ctx)
 
 	*ctx = fake_ctx;
 
-	read_device_info(fake_dev);
-
-	video_mode = rgb_video_mode;
-	depth_mode = depth_11_mode;
+	// Split the path list; the sources keep pointers into our copy
+	input_paths = strdup(input_path);
+	num_fake_devs = 0;
+	num_fake_sources = 0;
+	char *path;
+	for (path = strtok(input_paths, FAKENECT_PATH_SEPARATOR); path;
+	     path = strtok(NULL, FAKENECT_PATH_SEPARATOR)) {
+		if (num_fake_devs == FAKENECT_MAX_DEVICES) {
+			printf("Warning: fakenect supports at most %d devices, "
+			       "ignoring [%s]\n", FAKENECT_MAX_DEVICES, path);
+			continue;
+		}
+		fake_source *src = &fake_sources[num_fake_sources++];
+		memset(src, 0, sizeof(*src));
+		src->path = path;
+		src->first_time = -1;
+		src->first_device = num_fake_devs;
+		src->num_devices = count_devices(path, FAKENECT_MAX_DEVICES - num_fake_devs);
 
-	default_video_back = malloc(640*480*3);
-	default_depth_back = malloc(640*480*2);
+		int i;
+		for (i = 0; i < src->num_devices; i++) {
+			fake_device *fdev = &fake_devs[num_fake_devs++];
+			fdev->ir_brightness = 25;
+			fdev->video_mode = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB);
+			fdev->depth_mode = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT);
+			fdev->default_video_back = malloc(640*480*3);
+			fdev->default_depth_back = malloc(640*480*2);
+			read_device_info(&fdev->dev, path, i);
+		}
+	}
+	if (!num_fake_sources) {
+		printf("Error: Environmental variable FAKENECT_PATH is empty.\n");
+		exit(1);
+	}
+	decoded_back = malloc(640*IR_FRAME_H*2);
+	raw_back = malloc(640*IR_FRAME_H*2);
+	rgb_back = malloc(640*480*3);
 
 	return 0;
 }
@@ -577,75 +951,186 @@ void freenect_select_subdevices(freenect_context *ctx, freenect_device_flags sub
 	// we just ignore them and provide all captured data.
 }
 
+int freenect_set_hotplug_callback(freenect_context *ctx, freenect_hotplug_cb cb, void *user)
+{
+	// The recorded devices never come or go, so there is nothing to report
+	return 0;
+}
+
+int freenect_set_depth_binning(freenect_device* dev, freenect_depth_binning binning)
+{
+	if (binning != FREENECT_DEPTH_BINNING_MIN && binning != FREENECT_DEPTH_BINNING_MEDIAN && binning != FREENECT_DEPTH_BINNING_MEAN)
+		return -1;
+	dev->depth_binning = binning;
+	return 0;
+}
+
+// Recordings are played back unfiltered; only turning the filter off succeeds
+int freenect_set_depth_filter(freenect_device *dev, const freenect_depth_filter *filter)
+{
+	return filter ? -1 : 0;
+}
+
+int freenect_set_background_model(freenect_device *dev, const freenect_background_model *model)
+{
+	return model ? -1 : 0;
+}
+
+int freenect_get_foreground_mask(freenect_device *dev, const uint8_t **mask)
+{
+	*mask = NULL;
+	return -1;
+}
+
 int freenect_set_depth_buffer(freenect_device *dev, void *buf)
 {
-	user_depth_buf = buf;
+	to_fake(dev)->user_depth_buf = buf;
 	return 0;
 }
 
 int freenect_set_video_buffer(freenect_device *dev, void *buf)
 {
-	user_video_buf = buf;
+	to_fake(dev)->user_video_buf = buf;
 	return 0;
 }
 
 void freenect_set_user(freenect_device *dev, void *user)
 {
-	user_ptr = user;
+	to_fake(dev)->user_ptr = user;
 }
 
 void *freenect_get_user(freenect_device *dev)
 {
-	return user_ptr;
+	return to_fake(dev)->user_ptr;
 }
 
 int freenect_start_depth(freenect_device *dev)
 {
-	depth_running = 1;
+	to_fake(dev)->depth_running = 1;
 	return 0;
 }
 
 int freenect_start_video(freenect_device *dev)
 {
-	rgb_running = 1;
+	to_fake(dev)->rgb_running = 1;
 	return 0;
 }
 
 int freenect_stop_depth(freenect_device *dev)
 {
-	depth_running = 0;
+	to_fake(dev)->depth_running = 0;
+	free_history(&to_fake(dev)->depth_hist);
 	return 0;
 }
 
 int freenect_stop_video(freenect_device *dev)
 {
-	rgb_running = 0;
+	to_fake(dev)->rgb_running = 0;
+	free_history(&to_fake(dev)->video_hist);
 	return 0;
 }
 
+int freenect_set_depth_history(freenect_device *dev, int length)
+{
+	return set_history(&to_fake(dev)->depth_hist, to_fake(dev)->depth_running, length);
+}
+
+int freenect_set_video_history(freenect_device *dev, int length)
+{
+	return set_history(&to_fake(dev)->video_hist, to_fake(dev)->rgb_running, length);
+}
+
+int freenect_get_depth_history(freenect_device *dev, int age, const void **frame, uint32_t *timestamp)
+{
+	return get_history(&to_fake(dev)->depth_hist, age, frame, timestamp);
+}
+
+int freenect_get_video_history(freenect_device *dev, int age, const void **frame, uint32_t *timestamp)
+{
+	return get_history(&to_fake(dev)->video_hist, age, frame, timestamp);
+}
+
 int freenect_set_video_format(freenect_device *dev, freenect_video_format fmt)
 {
-	assert(fmt == FREENECT_VIDEO_RGB || fmt == FREENECT_VIDEO_YUV_RAW);
-	return 0;
+	return freenect_set_video_mode(dev, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, fmt));
 }
 int freenect_set_depth_format(freenect_device *dev, freenect_depth_format fmt)
 {
-	assert(fmt == FREENECT_DEPTH_11BIT);
-	return 0;
+	return freenect_set_depth_mode(dev, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, fmt));
 }
 
 void freenect_set_log_callback(freenect_context *ctx, freenect_log_cb cb) {}
 void freenect_set_log_level(freenect_context *ctx, freenect_loglevel level) {}
+int freenect_set_transfer_memory(freenect_context *ctx, freenect_transfer_memory mem) { return 0; }
+void freenect_set_event_thread_params(freenect_context *ctx, const freenect_thread_params *params) {}
+int freenect_apply_event_thread_params(freenect_context *ctx) { return 0; }
+
+static pthread_t event_thread;
+static int event_thread_started = 0;
+static volatile int event_thread_stop = 0;
+
+static void *event_thread_main(void *arg)
+{
+	// Playback sleeps between records, so each call returns within a frame
+	while (!event_thread_stop) {
+		if (freenect_process_events(fake_ctx) < 0)
+			break;
+	}
+	return NULL;
+}
+
+int freenect_start_event_thread(freenect_context *ctx)
+{
+	if (event_thread_started)
+		return -1;
+	event_thread_stop = 0;
+	if (pthread_create(&event_thread, NULL, event_thread_main, NULL) != 0)
+		return -1;
+	event_thread_started = 1;
+	return 0;
+}
+
+int freenect_stop_event_thread(freenect_context *ctx)
+{
+	if (!event_thread_started)
+		return -1;
+	event_thread_stop = 1;
+	pthread_join(event_thread, NULL);
+	event_thread_started = 0;
+	return 0;
+}
 int freenect_shutdown(freenect_context *ctx)
 {
-	free(default_video_back);
-	free(default_depth_back);
+	int i;
+	if (event_thread_started)
+		freenect_stop_event_thread(ctx);
+	for (i = 0; i < num_fake_devs; i++) {
+		free(fake_devs[i].default_video_back);
+		free(fake_devs[i].default_depth_back);
+		free_history(&fake_devs[i].depth_hist);
+		free_history(&fake_devs[i].video_hist);
+	}
+	for (i = 0; i < num_fake_sources; i++) {
+		if (fake_sources[i].index_fp)
+			fclose(fake_sources[i].index_fp);
+		free(fake_sources[i].data);
+	}
+	num_fake_sources = 0;
+	free(input_paths);
+	free(decoded_back);
+	free(raw_back);
+	free(rgb_back);
 	return 0;
 }
 int freenect_close_device(freenect_device *dev)
 {
 	return 0;
 }
+int freenect_set_auto_reconnect(freenect_device *dev, int enable, freenect_device_state_cb cb)
+{
+	// Played back devices are never lost
+	return 0;
+}
 int freenect_set_tilt_degs(freenect_device *dev, double angle)
 {
 	return 0;
@@ -660,11 +1145,11 @@ int freenect_update_tilt_state(freenect_device *dev)
 }
 int freenect_get_ir_brightness(freenect_device *dev)
 {
-	return ir_brightness;
+	return to_fake(dev)->ir_brightness;
 }
 int freenect_set_ir_brightness(freenect_device *dev, uint16_t brightness)
 {
-	ir_brightness = (brightness % 50);
+	to_fake(dev)->ir_brightness = (brightness % 50);
 	return 0;
 }
 
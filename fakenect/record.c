@@ -24,6 +24,7 @@
  */
 
 #include "libfreenect.h"
+#include "libfreenect_codec.h"
 #include "freenect_internal.h"
 #include "platform.h"
 #include "parson.h"
@@ -33,16 +34,26 @@
 #include <signal.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 char *out_dir=0;
 volatile sig_atomic_t running = 1;
-uint32_t last_timestamp = 0;
 FILE *index_fp = NULL;
 
+// All devices are driven from one event loop, so every record shares the
+// same host clock and is tagged with the index of the device it came from
+#define MAX_RECORD_DEVICES 8
+int num_record_devices = 1;
+freenect_device *record_devs[MAX_RECORD_DEVICES];
+uint32_t last_timestamp[MAX_RECORD_DEVICES];
+
 #define FREENECT_FRAME_W 640
 #define FREENECT_FRAME_H 480
+#define FREENECT_IR_FRAME_H 488
 
 int use_ffmpeg = 0;
+int use_pgm = 0;
+int use_ir = 0;
 char *ffmpeg_opts = 0;
 char *depth_name = 0;
 char *rgb_name = 0;
@@ -50,24 +61,43 @@ char *rgb_name = 0;
 FILE *depth_stream=0;
 FILE *rgb_stream=0;
 
-void dump_depth(FILE *fp, void *data, int data_size)
+uint8_t *depth_codec_buf = 0;
+size_t depth_codec_size = 0;
+
+void dump_depth(FILE *fp, void *data, int data_size, int height)
 {
-	fprintf(fp, "P5 %d %d 65535\n", FREENECT_FRAME_W, FREENECT_FRAME_H);
+	fprintf(fp, "P5 %d %d 65535\n", FREENECT_FRAME_W, height);
 	fwrite(data, data_size, 1, fp);
 }
 
+void dump_depth_compressed(FILE *fp, void *data, int height)
+{
+	// Sized for the taller IR frames so depth and IR can share it
+	if (!depth_codec_buf) {
+		depth_codec_size = freenect_depth_compress_bound(FREENECT_FRAME_W, FREENECT_IR_FRAME_H);
+		depth_codec_buf = malloc(depth_codec_size);
+	}
+	int len = freenect_depth_compress(data, FREENECT_FRAME_W, height,
+	                                  depth_codec_buf, depth_codec_size);
+	if (len < 0) {
+		printf("Error: Cannot compress depth frame\n");
+		exit(1);
+	}
+	fwrite(depth_codec_buf, len, 1, fp);
+}
+
 void dump_rgb(FILE *fp, void *data, int data_size)
 {
 	fprintf(fp, "P6 %d %d 255\n", FREENECT_FRAME_W, FREENECT_FRAME_H);
 	fwrite(data, data_size, 1, fp);
 }
 
-FILE *open_dump(char type, double cur_time, uint32_t timestamp, int data_size, const char *extension)
+FILE *open_dump(char type, double cur_time, uint32_t timestamp, int device, int data_size, const char *extension)
 {
-	char *fn = malloc(strlen(out_dir) + 50);
-	sprintf(fn, "%c-%f-%u.%s", type, cur_time, timestamp, extension);
+	char *fn = malloc(strlen(out_dir) + 60);
+	sprintf(fn, "%c-%f-%u-%d.%s", type, cur_time, timestamp, device, extension);
 	fprintf(index_fp, "%s\n", fn);
-	sprintf(fn, "%s/%c-%f-%u.%s", out_dir, type, cur_time, timestamp, extension);
+	sprintf(fn, "%s/%c-%f-%u-%d.%s", out_dir, type, cur_time, timestamp, device, extension);
 	FILE* fp = fopen(fn, "wb");
 	if (!fp) {
 		printf("Error: Cannot open file [%s]\n", fn);
@@ -101,25 +131,32 @@ FILE *open_ffmpeg(char *output_filename)
 	return proc;
 }
 
-void dump(char type, uint32_t timestamp, void *data, int data_size)
+void dump(char type, double cur_time, uint32_t timestamp, int device, void *data, int data_size)
 {
 	// timestamp can be at most 10 characters, we have a few extra
-	double cur_time = get_time();
 	FILE *fp;
-	last_timestamp = timestamp;
+	int height;
 	switch (type) {
 		case 'd':
-			fp = open_dump(type, cur_time, timestamp, data_size, "pgm");
-			dump_depth(fp, data, data_size);
+		case 'i':
+			// Depth and 10 bit IR are both 16 bit greyscale
+			height = type == 'i' ? FREENECT_IR_FRAME_H : FREENECT_FRAME_H;
+			if (use_pgm) {
+				fp = open_dump(type, cur_time, timestamp, device, data_size, "pgm");
+				dump_depth(fp, data, data_size, height);
+			} else {
+				fp = open_dump(type, cur_time, timestamp, device, data_size, "fdz");
+				dump_depth_compressed(fp, data, height);
+			}
 			fclose(fp);
 			break;
 		case 'r':
-			fp = open_dump(type, cur_time, timestamp, data_size, "ppm");
+			fp = open_dump(type, cur_time, timestamp, device, data_size, "ppm");
 			dump_rgb(fp, data, data_size);
 			fclose(fp);
 			break;
 		case 'a':
-			fp = open_dump(type, cur_time, timestamp, data_size, "dump");
+			fp = open_dump(type, cur_time, timestamp, device, data_size, "dump");
 			fwrite(data, data_size, 1, fp);
 			fclose(fp);
 			break;
@@ -145,45 +182,168 @@ void dump_ffmpeg_pad16(FILE *stream, uint32_t timestamp, void *data,
 	}
 }
 
-void snapshot_accel(freenect_device *dev)
+// Frames are handed from the libusb event thread to a writer thread through
+// a preallocated ring, so a slow disk never stalls freenect_process_events().
+// When the ring is full the new frame is dropped and counted instead.
+typedef struct {
+	char type;
+	double cur_time;
+	uint32_t timestamp;
+	int device;
+	int data_size;
+	uint8_t *data;
+} queued_frame;
+
+queued_frame *write_queue = 0;
+int write_queue_len = 16;
+int write_queue_slot_size = 0;
+int write_queue_head = 0;
+int write_queue_count = 0;
+int writer_done = 0;
+pthread_mutex_t write_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t write_queue_cond = PTHREAD_COND_INITIALIZER;
+pthread_t writer_thread;
+
+unsigned int dropped_depth = 0;
+unsigned int dropped_rgb = 0;
+unsigned int dropped_ir = 0;
+unsigned int dropped_accel = 0;
+
+void write_frame(queued_frame *frame)
 {
-	freenect_raw_tilt_state* state;
-	if (!last_timestamp)
-		return;
-	freenect_update_tilt_state(dev);
-	state = freenect_get_tilt_state(dev);
-	dump('a', last_timestamp, state, sizeof *state);
+	if (use_ffmpeg && frame->type == 'd') {
+		fprintf(index_fp, "d-%f-%u\n", frame->cur_time, frame->timestamp);
+		dump_ffmpeg_pad16(depth_stream, frame->timestamp, frame->data,
+		                  frame->data_size);
+	} else if (use_ffmpeg && frame->type == 'r') {
+		fprintf(index_fp, "d-%f-%u\n", frame->cur_time, frame->timestamp);
+		dump_ffmpeg_24(rgb_stream, frame->timestamp, frame->data,
+		               frame->data_size);
+	} else {
+		dump(frame->type, frame->cur_time, frame->timestamp, frame->device,
+		     frame->data, frame->data_size);
+	}
 }
 
+void *writer_threadfunc(void *arg)
+{
+	pthread_mutex_lock(&write_queue_mutex);
+	while (1) {
+		while (!write_queue_count && !writer_done)
+			pthread_cond_wait(&write_queue_cond, &write_queue_mutex);
+		// Drain everything that was queued before stopping
+		if (!write_queue_count)
+			break;
+		queued_frame *frame = &write_queue[write_queue_head];
+		pthread_mutex_unlock(&write_queue_mutex);
 
-void depth_cb(freenect_device *dev, void *depth, uint32_t timestamp)
+		write_frame(frame);
+
+		pthread_mutex_lock(&write_queue_mutex);
+		write_queue_head = (write_queue_head + 1) % write_queue_len;
+		write_queue_count--;
+	}
+	pthread_mutex_unlock(&write_queue_mutex);
+	return NULL;
+}
+
+void enqueue(char type, int device, uint32_t timestamp, void *data, int data_size)
 {
-	dump('d', timestamp, depth, freenect_get_current_depth_mode(dev).bytes);
+	double cur_time = get_time();
+	queued_frame *frame = NULL;
+	last_timestamp[device] = timestamp;
+
+	pthread_mutex_lock(&write_queue_mutex);
+	if (write_queue_count < write_queue_len && data_size <= write_queue_slot_size)
+		frame = &write_queue[(write_queue_head + write_queue_count) % write_queue_len];
+	pthread_mutex_unlock(&write_queue_mutex);
+
+	if (!frame) {
+		switch (type) {
+			case 'd': dropped_depth++; break;
+			case 'r': dropped_rgb++; break;
+			case 'i': dropped_ir++; break;
+			case 'a': dropped_accel++; break;
+		}
+		return;
+	}
+
+	// This is the only thread filling slots, and the writer doesn't look at
+	// this one until it is counted below, so the copy needs no lock
+	frame->type = type;
+	frame->cur_time = cur_time;
+	frame->timestamp = timestamp;
+	frame->device = device;
+	frame->data_size = data_size;
+	memcpy(frame->data, data, data_size);
+
+	pthread_mutex_lock(&write_queue_mutex);
+	write_queue_count++;
+	pthread_cond_signal(&write_queue_cond);
+	pthread_mutex_unlock(&write_queue_mutex);
 }
 
+int start_writer(int slot_size)
+{
+	int i;
+	write_queue = calloc(write_queue_len, sizeof(*write_queue));
+	if (!write_queue)
+		return -1;
+	for (i = 0; i < write_queue_len; i++) {
+		write_queue[i].data = malloc(slot_size);
+		if (!write_queue[i].data)
+			return -1;
+	}
+	write_queue_slot_size = slot_size;
+	return pthread_create(&writer_thread, NULL, writer_threadfunc, NULL);
+}
 
-void rgb_cb(freenect_device *dev, void *rgb, uint32_t timestamp)
+void stop_writer()
 {
-	dump('r', timestamp, rgb, freenect_get_current_video_mode(dev).bytes);
+	int i;
+	pthread_mutex_lock(&write_queue_mutex);
+	writer_done = 1;
+	pthread_cond_signal(&write_queue_cond);
+	pthread_mutex_unlock(&write_queue_mutex);
+	pthread_join(writer_thread, NULL);
+
+	for (i = 0; i < write_queue_len; i++)
+		free(write_queue[i].data);
+	free(write_queue);
+	write_queue = NULL;
+
+	if (dropped_depth || dropped_rgb || dropped_ir || dropped_accel)
+		printf("Warning: Writer could not keep up, dropped %u depth, %u rgb, "
+		       "%u ir and %u accel frames\n", dropped_depth, dropped_rgb, dropped_ir, dropped_accel);
 }
 
-void depth_cb_ffmpeg(freenect_device *dev, void *depth, uint32_t timestamp)
+void snapshot_accel(int device)
 {
-	double cur_time = get_time();
-	fprintf(index_fp, "d-%f-%u\n", cur_time, timestamp);
+	freenect_raw_tilt_state* state;
+	freenect_device *dev = record_devs[device];
+	if (!last_timestamp[device])
+		return;
+	freenect_update_tilt_state(dev);
+	state = freenect_get_tilt_state(dev);
+	enqueue('a', device, last_timestamp[device], state, sizeof *state);
+}
 
-	dump_ffmpeg_pad16(depth_stream, timestamp, depth,
-                      freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM,
-                                               FREENECT_DEPTH_11BIT).bytes);
+int device_index(freenect_device *dev)
+{
+	return (int)(intptr_t)freenect_get_user(dev);
 }
 
-void rgb_cb_ffmpeg(freenect_device *dev, void *rgb, uint32_t timestamp)
+void depth_cb(freenect_device *dev, void *depth, uint32_t timestamp)
 {
-	double cur_time = get_time();
-	fprintf(index_fp, "d-%f-%u\n", cur_time, timestamp);
+	enqueue('d', device_index(dev), timestamp, depth, freenect_get_current_depth_mode(dev).bytes);
+}
 
-	dump_ffmpeg_24(rgb_stream, timestamp, rgb,
-                   freenect_get_current_video_mode(dev).bytes);
+
+void rgb_cb(freenect_device *dev, void *rgb, uint32_t timestamp)
+{
+	freenect_frame_mode mode = freenect_get_current_video_mode(dev);
+	char type = mode.video_format == FREENECT_VIDEO_IR_10BIT ? 'i' : 'r';
+	enqueue(type, device_index(dev), timestamp, rgb, mode.bytes);
 }
 
 void init_ffmpeg_streams()
@@ -203,7 +363,7 @@ void print_mode(const char *name, freenect_frame_mode mode) {
 	   mode.framerate, mode.is_valid);
 }
 
-static void write_device_info(freenect_device *dev)
+static void write_device_info(freenect_device *dev, int device)
 {
 	JSON_Value *js = json_value_init_object();
 	JSON_Object *dev_js = json_object(js);
@@ -259,8 +419,13 @@ static void write_device_info(freenect_device *dev)
 
 	json_object_set_number(dev_js, "const_shift", dev->registration.const_shift);
 
+	// device.json keeps its name for device 0 so that single device
+	// recordings look the same as before
 	char fn[512];
-	snprintf(fn, sizeof(fn), "%s/device.json", out_dir);
+	if (device == 0)
+		snprintf(fn, sizeof(fn), "%s/device.json", out_dir);
+	else
+		snprintf(fn, sizeof(fn), "%s/device-%d.json", out_dir, device);
 
 	json_serialize_to_file_pretty(js, fn);
 
@@ -270,7 +435,7 @@ static void write_device_info(freenect_device *dev)
 void init()
 {
 	freenect_context *ctx;
-	freenect_device *dev;
+	int i;
 	if (freenect_init(&ctx, 0)) {
 		printf("Error: Cannot get context\n");
 		return;
@@ -279,33 +444,57 @@ void init()
 	// fakenect doesn't support audio yet, so don't bother claiming the device
 	freenect_select_subdevices(ctx, (freenect_device_flags)(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA));
 
-	if (freenect_open_device(ctx, &dev, 0)) {
-		printf("Error: Cannot get device\n");
+	if (freenect_num_devices(ctx) < num_record_devices) {
+		printf("Error: Asked for %d devices but only %d are connected\n",
+		       num_record_devices, freenect_num_devices(ctx));
+		return;
+	}
+	for (i = 0; i < num_record_devices; i++) {
+		if (freenect_open_device(ctx, &record_devs[i], i)) {
+			printf("Error: Cannot get device %d\n", i);
+			return;
+		}
+		freenect_set_user(record_devs[i], (void *)(intptr_t)i);
+	}
+	freenect_frame_mode depth_mode = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT);
+	// The camera streams either RGB or IR, never both
+	freenect_frame_mode video_mode = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM,
+	                                                          use_ir ? FREENECT_VIDEO_IR_10BIT : FREENECT_VIDEO_RGB);
+	print_mode("Depth", depth_mode);
+	print_mode("Video", video_mode);
+
+	int slot_size = depth_mode.bytes > video_mode.bytes ? depth_mode.bytes : video_mode.bytes;
+	if (start_writer(slot_size)) {
+		printf("Error: Cannot start writer thread\n");
 		return;
 	}
-	print_mode("Depth", freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT));
-	print_mode("Video", freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB));
-	freenect_set_depth_mode(dev, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT));
-	freenect_start_depth(dev);
-	freenect_set_video_mode(dev, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB));
-	freenect_start_video(dev);
 
-	write_device_info(dev);
+	for (i = 0; i < num_record_devices; i++) {
+		freenect_device *dev = record_devs[i];
+		freenect_set_depth_mode(dev, depth_mode);
+		freenect_start_depth(dev);
+		freenect_set_video_mode(dev, video_mode);
+		freenect_start_video(dev);
+
+		write_device_info(dev, i);
 
-	if (use_ffmpeg) {
-		init_ffmpeg_streams();
-		freenect_set_depth_callback(dev, depth_cb_ffmpeg);
-		freenect_set_video_callback(dev, rgb_cb_ffmpeg);
-	} else {
 		freenect_set_depth_callback(dev, depth_cb);
 		freenect_set_video_callback(dev, rgb_cb);
 	}
-	while (running && freenect_process_events(ctx) >= 0)
-		snapshot_accel(dev);
-	freenect_stop_depth(dev);
-	freenect_stop_video(dev);
-	freenect_close_device(dev);
+
+	if (use_ffmpeg)
+		init_ffmpeg_streams();
+	while (running && freenect_process_events(ctx) >= 0) {
+		for (i = 0; i < num_record_devices; i++)
+			snapshot_accel(i);
+	}
+	for (i = 0; i < num_record_devices; i++) {
+		freenect_stop_depth(record_devs[i]);
+		freenect_stop_video(record_devs[i]);
+		freenect_close_device(record_devs[i]);
+	}
 	freenect_shutdown(ctx);
+	stop_writer();
 }
 
 FILE *open_index(const char *fn)
@@ -335,8 +524,8 @@ void signal_cleanup(int num)
 void usage()
 {
 	printf("Records the Kinect sensor data to a directory\nResult can be used as input to Fakenect\nUsage:\n");
-	printf("  record [-h] [-ffmpeg] [-ffmpeg-opts <options>] "
-		   "<target basename>\n");
+	printf("  record [-h] [-pgm] [-ir] [-queue <frames>] [-devices <count>] [-ffmpeg] "
+		   "[-ffmpeg-opts <options>] <target basename>\n");
 	exit(0);
 }
 
@@ -346,6 +535,21 @@ int main(int argc, char **argv)
 	while (c < argc) {
 		if (strcmp(argv[c],"-ffmpeg")==0)
 			use_ffmpeg = 1;
+		else if (strcmp(argv[c],"-pgm")==0)
+			use_pgm = 1;
+		else if (strcmp(argv[c],"-ir")==0)
+			use_ir = 1;
+		else if (strcmp(argv[c],"-queue")==0) {
+			if (++c < argc)
+				write_queue_len = atoi(argv[c]);
+			if (write_queue_len <= 0)
+				usage();
+		} else if (strcmp(argv[c],"-devices")==0) {
+			if (++c < argc)
+				num_record_devices = atoi(argv[c]);
+			if (num_record_devices <= 0 || num_record_devices > MAX_RECORD_DEVICES)
+				usage();
+		}
 		else if (strcmp(argv[c],"-ffmpeg-opts")==0) {
 			if (++c < argc)
 				ffmpeg_opts = argv[c];
@@ -358,6 +562,14 @@ int main(int argc, char **argv)
 
 	if (!out_dir)
 		usage();
+	if (use_ffmpeg && num_record_devices > 1) {
+		printf("Error: -ffmpeg only supports recording a single device\n");
+		return 1;
+	}
+	if (use_ffmpeg && use_ir) {
+		printf("Error: -ffmpeg only supports recording RGB video\n");
+		return 1;
+	}
 
 	signal(SIGINT, signal_cleanup);
 
@@ -413,6 +625,7 @@ int main(int argc, char **argv)
 
 		init();
 		fclose(index_fp);
+		free(depth_codec_buf);
 	}
 	return 0;
 }
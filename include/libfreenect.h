@@ -74,10 +74,14 @@ struct freenect_device_attributes
 /// Not all available resolutions are actually supported for all video formats.
 /// Frame modes may not perfectly match resolutions.  For instance,
 /// FREENECT_RESOLUTION_MEDIUM is 640x488 for the IR camera.
+/// The depth camera always captures VGA; its FREENECT_RESOLUTION_LOW and
+/// FREENECT_RESOLUTION_QUARTER modes are binned from it while unpacking,
+/// see freenect_set_depth_binning().
 typedef enum {
-	FREENECT_RESOLUTION_LOW    = 0, /**< QVGA - 320x240 */
-	FREENECT_RESOLUTION_MEDIUM = 1, /**< VGA  - 640x480 */
-	FREENECT_RESOLUTION_HIGH   = 2, /**< SXGA - 1280x1024 */
+	FREENECT_RESOLUTION_LOW     = 0, /**< QVGA - 320x240 */
+	FREENECT_RESOLUTION_MEDIUM  = 1, /**< VGA  - 640x480 */
+	FREENECT_RESOLUTION_HIGH    = 2, /**< SXGA - 1280x1024 */
+	FREENECT_RESOLUTION_QUARTER = 3, /**< QQVGA - 160x120 */
 	FREENECT_RESOLUTION_DUMMY  = 2147483647, /**< Dummy value to force enum to be 32 bits wide */
 } freenect_resolution;
 
@@ -250,6 +254,25 @@ FREENECTAPI void freenect_set_log_level(freenect_context *ctx, freenect_loglevel
  */
 FREENECTAPI void freenect_set_log_callback(freenect_context *ctx, freenect_log_cb cb);
 
+/*
+ * Thread safety
+ *
+ * While one thread handles events for a context, through
+ * freenect_process_events() or an external event loop, other threads may
+ * use the devices of that context: send camera commands (flags, exposure,
+ * IR brightness), change modes, start and stop streams, set stream buffers
+ * and depth filters, move the motor and set the LED, and list and count
+ * devices. Camera commands from several threads are queued per device and
+ * sent one at a time. Stream callbacks run on the event handling thread
+ * while holding a per device lock, so setting a buffer or filter from
+ * another thread waits for a running frame callback at most, never for USB.
+ *
+ * Opening and closing devices, freenect_shutdown() and setting callbacks
+ * must not race with event handling. Functions that wait for the device,
+ * such as camera commands and motor control, must not be called from
+ * stream callbacks.
+ */
+
 /**
  * Calls the platform specific usb event processor
  *
@@ -271,10 +294,133 @@ FREENECTAPI int freenect_process_events(freenect_context *ctx);
  */
 FREENECTAPI int freenect_process_events_timeout(freenect_context *ctx, struct timeval* timeout);
 
+/// A file descriptor to watch for driving the context from an external
+/// event loop. events holds POLLIN/POLLOUT flags as used by poll().
+typedef struct {
+	int fd;
+	short events;
+} freenect_pollfd;
+
+/// Typedefs for file descriptor notifications
+typedef void (*freenect_pollfd_added_cb)(int fd, short events, void *user);
+typedef void (*freenect_pollfd_removed_cb)(int fd, void *user);
+
+/**
+ * Get the file descriptors to watch when driving the context from an
+ * external event loop (epoll, select, ...) instead of calling
+ * freenect_process_events(). Whenever one becomes ready, or the time given by
+ * freenect_get_next_timeout() has passed, call
+ * freenect_process_events_timeout() with a zero timeout. Not supported on
+ * Windows.
+ *
+ * @param ctx Context to get the file descriptors of
+ * @param fds Set to an array of file descriptors, to be freed with free()
+ *
+ * @return Number of file descriptors, < 0 if not supported
+ */
+FREENECTAPI int freenect_get_pollfds(freenect_context *ctx, freenect_pollfd **fds);
+
+/**
+ * Set functions to be told when file descriptors are added to or removed
+ * from the set returned by freenect_get_pollfds(), so an external event loop
+ * can follow changes without asking for the whole set again.
+ *
+ * @param ctx Context to watch
+ * @param added Function called for each new file descriptor, or NULL
+ * @param removed Function called for each file descriptor that went away, or NULL
+ * @param user Pointer passed back to the functions
+ */
+FREENECTAPI void freenect_set_pollfd_notifiers(freenect_context *ctx, freenect_pollfd_added_cb added, freenect_pollfd_removed_cb removed, void *user);
+
+/**
+ * Get how long an external event loop may wait on the file descriptors
+ * before calling freenect_process_events_timeout() anyway, for USB
+ * transfers that time out. On platforms where timeouts are signalled
+ * through a file descriptor this is never needed.
+ *
+ * @param ctx Context to get the timeout of
+ * @param timeout Set to the time left until the next timeout if one is pending
+ *
+ * @return 1 if a timeout is pending, 0 if there is none, < 0 on error
+ */
+FREENECTAPI int freenect_get_next_timeout(freenect_context *ctx, struct timeval *timeout);
+
+/// Scheduling of the thread that calls freenect_process_events(). Packets
+/// are lost whenever that thread is kept off the CPU for longer than the
+/// transfers in flight last, so on busy hosts it helps to give it a core of
+/// its own and real-time priority.
+typedef struct {
+	/// CPUs the thread may run on, bit n for CPU n. 0 leaves the affinity
+	/// alone. Linux and Windows only.
+	uint64_t cpu_mask;
+	/// SCHED_FIFO priority (1..99), or 0 for normal scheduling. Usually
+	/// needs CAP_SYS_NICE or an rtprio limit. On Windows any value > 0 selects
+	/// THREAD_PRIORITY_TIME_CRITICAL.
+	int rt_priority;
+	/// Nonzero to lock all current and future pages of the process in
+	/// memory with mlockall(), so page faults cannot stall the thread. Not
+	/// supported on Windows.
+	int lock_memory;
+} freenect_thread_params;
+
+/**
+ * Set how the event thread of a context is scheduled. The settings are
+ * taken up by freenect_start_event_thread() and
+ * freenect_apply_event_thread_params(); a thread that is already running
+ * keeps its settings. Until this is called, the settings come from the
+ * LIBFREENECT_EVENT_CPUS (CPU mask, e.g. 0x4), LIBFREENECT_EVENT_PRIORITY and
+ * LIBFREENECT_EVENT_MLOCK environment variables, so that programs using a
+ * wrapper can be tuned without changes.
+ *
+ * @param ctx Context to set the event thread scheduling of
+ * @param params Scheduling settings, or NULL for normal scheduling
+ */
+FREENECTAPI void freenect_set_event_thread_params(freenect_context *ctx, const freenect_thread_params *params);
+
+/**
+ * Apply the event thread settings of a context to the calling thread. For
+ * applications and wrappers that run freenect_process_events() on a thread
+ * of their own; call it once from that thread before handling events.
+ *
+ * @param ctx Context whose settings to apply
+ *
+ * @return 0 on success, < 0 if any of the settings could not be applied (the
+ * others still are)
+ */
+FREENECTAPI int freenect_apply_event_thread_params(freenect_context *ctx);
+
+/**
+ * Start a thread that calls freenect_process_events() until
+ * freenect_stop_event_thread() is called, scheduled as set by
+ * freenect_set_event_thread_params(). Settings that cannot be applied are
+ * logged and the thread runs regardless.
+ *
+ * @param ctx Context to handle the events of
+ *
+ * @return 0 on success, < 0 if the thread could not be started or is already running
+ */
+FREENECTAPI int freenect_start_event_thread(freenect_context *ctx);
+
+/**
+ * Stop the thread started by freenect_start_event_thread() and wait for it
+ * to finish. Must not be called from a callback, since those run on that
+ * thread. freenect_shutdown() stops the thread if it is still running.
+ *
+ * @param ctx Context to stop handling the events of
+ *
+ * @return 0 on success, < 0 if no event thread is running
+ */
+FREENECTAPI int freenect_stop_event_thread(freenect_context *ctx);
+
 /**
  * Return the number of kinect devices currently connected to the
  * system
  *
+ * The library keeps a registry of the devices on the bus. Where libusb
+ * supports hotplug it is updated by hotplug events, which are handled by
+ * freenect_process_events() (or by this call while no device is open), so
+ * the bus is not rescanned.
+ *
  * @param ctx Context to access device count through
  *
  * @return Number of devices connected, < 0 on error
@@ -283,7 +429,8 @@ FREENECTAPI int freenect_num_devices(freenect_context *ctx);
 
 /**
  * Scans for kinect devices and produces a linked list of their attributes
- * (namely, serial numbers), returning the number of devices.
+ * (namely, serial numbers), returning the number of devices. Serial numbers
+ * are read from a device the first time it is listed and cached after that.
  *
  * @param ctx Context to scan for kinect devices with
  * @param attribute_list Pointer to where this function will store the resultant linked list
@@ -299,6 +446,31 @@ FREENECTAPI int freenect_list_device_attributes(freenect_context *ctx, struct fr
  */
 FREENECTAPI void freenect_free_device_attributes(struct freenect_device_attributes* attribute_list);
 
+/// Bus changes reported to a hotplug callback
+typedef enum {
+	FREENECT_HOTPLUG_ARRIVED = 0, /**< A kinect camera was plugged in */
+	FREENECT_HOTPLUG_LEFT    = 1, /**< A kinect camera was unplugged */
+} freenect_hotplug_event;
+
+/// Typedef for hotplug callbacks
+typedef void (*freenect_hotplug_cb)(freenect_context *ctx, freenect_hotplug_event event, void *user);
+
+/**
+ * Set a callback to be told when kinect cameras are plugged in or unplugged,
+ * instead of polling freenect_num_devices(). Bus changes are queued while
+ * USB events are handled, and the callback is called for each of them when
+ * freenect_process_events() or freenect_process_events_timeout() returns
+ * from handling events, on the thread that called it. The device list is
+ * already up to date by then, and the callback may open and close devices.
+ *
+ * @param ctx Context to watch the bus of
+ * @param cb Function to call, or NULL to stop notification
+ * @param user Pointer passed back to the callback
+ *
+ * @return 0 on success, < 0 if hotplug notification is not supported on this platform
+ */
+FREENECTAPI int freenect_set_hotplug_callback(freenect_context *ctx, freenect_hotplug_cb cb, void *user);
+
 /**
  * Answer which subdevices this library supports.  This is most useful for
  * wrappers trying to determine whether the underlying library was built with
@@ -330,6 +502,27 @@ FREENECTAPI void freenect_select_subdevices(freenect_context *ctx, freenect_devi
  */
 FREENECTAPI freenect_device_flags freenect_enabled_subdevices(freenect_context *ctx);
 
+/// Memory the isochronous transfer buffers of a stream are allocated from
+typedef enum {
+	FREENECT_TRANSFER_MEM_HEAP      = 0, /**< Ordinary heap memory (default) */
+	FREENECT_TRANSFER_MEM_DEVICE    = 1, /**< Memory mapped from the USB device, so the kernel transfers without copying (Linux, libusb 1.0.21 or later) */
+	FREENECT_TRANSFER_MEM_HUGEPAGES = 2, /**< Prefaulted huge pages, cutting page faults and TLB misses (Linux) */
+} freenect_transfer_memory;
+
+/**
+ * Select the memory streams started after this call allocate their
+ * transfer buffers from. Buffers of stopped streams are kept by the
+ * context and reused by the next stream that fits, on any device. If the
+ * memory cannot be allocated when a stream starts, ordinary heap memory is
+ * used instead.
+ *
+ * @param ctx Context to set the transfer memory of
+ * @param mem Kind of memory to allocate transfer buffers from
+ *
+ * @return 0 on success, < 0 if the kind of memory is not supported by this build
+ */
+FREENECTAPI int freenect_set_transfer_memory(freenect_context *ctx, freenect_transfer_memory mem);
+
 /**
  * Opens a kinect device via a context. Index specifies the index of
  * the device on the current state of the bus. Bus resets may cause
@@ -343,6 +536,23 @@ FREENECTAPI freenect_device_flags freenect_enabled_subdevices(freenect_context *
  */
 FREENECTAPI int freenect_open_device(freenect_context *ctx, freenect_device **dev, int index);
 
+/**
+ * Opens several kinect devices at once. The bus is enumerated a single time
+ * and the slow parts of opening a device (waiting for the audio firmware to
+ * come up and fetching the camera calibration) run for all devices in
+ * parallel, so the call takes about as long as opening the slowest device.
+ *
+ * @param ctx Context to open devices through
+ * @param devs Array of count device pointers. Each entry is set to the opened
+ * device, or NULL if that device failed to open.
+ * @param indexes Array of count bus indexes to open, or NULL to open the
+ * devices with indexes 0 to count - 1
+ * @param count Number of devices to open
+ *
+ * @return Number of devices opened, < 0 on error
+ */
+FREENECTAPI int freenect_open_devices(freenect_context *ctx, freenect_device **devs, const int *indexes, int count);
+
 /**
  * Opens a kinect device (via a context) associated with a particular camera
  * subdevice serial number.  This function will fail if no device with a
@@ -365,6 +575,36 @@ FREENECTAPI int freenect_open_device_by_camera_serial(freenect_context *ctx, fre
  */
 FREENECTAPI int freenect_close_device(freenect_device *dev);
 
+/// Device state changes reported when automatic reconnection is enabled
+typedef enum {
+	FREENECT_DEVICE_LOST        = 0, /**< The device dropped off the bus; its streams were stopped */
+	FREENECT_DEVICE_RECONNECTED = 1, /**< The device came back and its streams were restarted */
+} freenect_device_state;
+
+/// Typedef for device state change callbacks
+typedef void (*freenect_device_state_cb)(freenect_device *dev, freenect_device_state state);
+
+/**
+ * Enable or disable automatic reconnection. Without it, a device that drops
+ * off the bus makes freenect_process_events() return an error and has to be
+ * closed and reopened. With it, freenect_process_events() stops the streams
+ * of the device, waits for a camera with the same serial number to come
+ * back, reopens it and restarts the streams that were running with the same
+ * modes, buffers and flags. Motor and LED state are not restored.
+ *
+ * While the device is lost, calls that talk to it (starting streams,
+ * setting flags, tilt, LED and registers) fail with -1 instead of reaching
+ * the closed USB handles. Stopping streams and closing the device remain
+ * safe.
+ *
+ * @param dev Device to watch
+ * @param enable 1 to enable automatic reconnection, 0 to disable it
+ * @param cb Function told about the device being lost and reconnected, may be NULL
+ *
+ * @return 0 on success, < 0 if the serial number of the device can't be read
+ */
+FREENECTAPI int freenect_set_auto_reconnect(freenect_device *dev, int enable, freenect_device_state_cb cb);
+
 /**
  * Set the device user data, for passing generic information into
  * callbacks
@@ -447,6 +687,58 @@ FREENECTAPI int freenect_set_depth_buffer(freenect_device *dev, void *buf);
  */
 FREENECTAPI int freenect_set_video_buffer(freenect_device *dev, void *buf);
 
+/**
+ * Keep the last length converted depth frames, with their timestamps, in
+ * memory allocated when the stream starts. Without a user buffer set,
+ * frames are converted straight into the history, so keeping it costs no
+ * copy. Can only be changed while the depth stream is stopped.
+ *
+ * @param dev Device to keep depth history for
+ * @param length Number of frames to keep, 0 to disable (default)
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_set_depth_history(freenect_device *dev, int length);
+
+/**
+ * Keep the last length converted video frames. See
+ * freenect_set_depth_history().
+ *
+ * @param dev Device to keep video history for
+ * @param length Number of frames to keep, 0 to disable (default)
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_set_video_history(freenect_device *dev, int length);
+
+/**
+ * Get a read-only view of a frame in the depth history. The view stays
+ * valid until that frame drops out of the history, so use it from the
+ * thread calling freenect_process_events(), e.g. inside the depth callback,
+ * where the current frame already has age 0.
+ *
+ * @param dev Device to get depth history from
+ * @param age 0 for the newest frame, 1 for the one before, and so on
+ * @param frame Set to the frame data
+ * @param timestamp Set to the frame timestamp, may be NULL
+ *
+ * @return 0 on success, < 0 if fewer than age + 1 frames are kept
+ */
+FREENECTAPI int freenect_get_depth_history(freenect_device *dev, int age, const void **frame, uint32_t *timestamp);
+
+/**
+ * Get a read-only view of a frame in the video history. See
+ * freenect_get_depth_history().
+ *
+ * @param dev Device to get video history from
+ * @param age 0 for the newest frame, 1 for the one before, and so on
+ * @param frame Set to the frame data
+ * @param timestamp Set to the frame timestamp, may be NULL
+ *
+ * @return 0 on success, < 0 if fewer than age + 1 frames are kept
+ */
+FREENECTAPI int freenect_get_video_history(freenect_device *dev, int age, const void **frame, uint32_t *timestamp);
+
 /**
  * Start the depth information stream for a device.
  *
@@ -661,6 +953,29 @@ FREENECTAPI freenect_frame_mode freenect_find_depth_mode(freenect_resolution res
  */
 FREENECTAPI int freenect_set_depth_mode(freenect_device* dev, const freenect_frame_mode mode);
 
+/// How depth samples are combined into one pixel of a binned depth mode.
+/// Invalid samples are ignored; a pixel is only invalid if all of its
+/// samples are.
+typedef enum {
+	FREENECT_DEPTH_BINNING_MIN    = 0, /**< Nearest sample (default) */
+	FREENECT_DEPTH_BINNING_MEDIAN = 1, /**< Median sample, the nearer one of the middle two for even counts */
+	FREENECT_DEPTH_BINNING_MEAN   = 2, /**< Rounded mean of the samples */
+	FREENECT_DEPTH_BINNING_DUMMY  = 2147483647, /**< Dummy value to force enum to be 32 bits wide */
+} freenect_depth_binning;
+
+/**
+ * Sets how the FREENECT_RESOLUTION_LOW and FREENECT_RESOLUTION_QUARTER
+ * depth modes combine each 2x2 or 4x4 block of VGA samples. Binning works
+ * on raw depth values, before the conversion to millimeters of
+ * FREENECT_DEPTH_MM. Can be changed while streaming.
+ *
+ * @param dev Device for which to set the binning method
+ * @param binning Binning method
+ *
+ * @return 0 on success, < 0 if error
+ */
+FREENECTAPI int freenect_set_depth_binning(freenect_device* dev, freenect_depth_binning binning);
+
 /**
  * Enables or disables the specified flag.
  * 
@@ -0,0 +1,87 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2011 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+#pragma once
+
+#include "libfreenect.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Size of the header at the start of every compressed depth frame
+#define FREENECT_DEPTH_CODEC_HEADER_SIZE 8
+
+/**
+ * Largest number of bytes freenect_depth_compress() can produce for a frame
+ * of the given dimensions. Use this to size the output buffer.
+ *
+ * @param width Frame width in pixels
+ * @param height Frame height in pixels
+ *
+ * @return Worst case compressed size in bytes, or 0 for invalid dimensions
+ */
+FREENECTAPI size_t freenect_depth_compress_bound(int width, int height);
+
+/**
+ * Losslessly compress one frame of unpacked 16 bit depth samples
+ * (FREENECT_DEPTH_11BIT, FREENECT_DEPTH_10BIT, FREENECT_DEPTH_MM or
+ * FREENECT_DEPTH_REGISTERED). Each sample is predicted from its left, upper
+ * and upper-left neighbours and the residuals are stored with a byte
+ * oriented variable length code that collapses runs of correctly predicted
+ * samples, so flat and invalid regions cost almost nothing.
+ *
+ * The output is self-describing and byte order independent.
+ *
+ * @param depth Frame of width * height samples
+ * @param width Frame width in pixels
+ * @param height Frame height in pixels
+ * @param out Output buffer
+ * @param out_size Size of the output buffer in bytes
+ *
+ * @return Number of bytes written to out on success, < 0 on error
+ */
+FREENECTAPI int freenect_depth_compress(const uint16_t* depth, int width, int height, uint8_t* out, size_t out_size);
+
+/**
+ * Decompress a frame produced by freenect_depth_compress(). The frame
+ * dimensions stored in the stream must match the ones given.
+ *
+ * @param in Compressed frame
+ * @param in_size Size of the compressed frame in bytes
+ * @param depth Output buffer of width * height samples
+ * @param width Expected frame width in pixels
+ * @param height Expected frame height in pixels
+ *
+ * @return 0 on success, < 0 if the data is corrupt, truncated or the
+ * dimensions do not match
+ */
+FREENECTAPI int freenect_depth_decompress(const uint8_t* in, size_t in_size, uint16_t* depth, int width, int height);
+
+#ifdef __cplusplus
+}
+#endif
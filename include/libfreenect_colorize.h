@@ -0,0 +1,86 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2011 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+#pragma once
+
+#include "libfreenect.h"
+#include "libfreenect_registration.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Color of every raw 11 bit depth value, used to turn depth frames into
+/// images for display. Fill it with one of the functions below or by hand.
+typedef struct {
+	uint8_t color[FREENECT_DEPTH_RAW_MAX_VALUE][4]; /**< R, G, B, A */
+} freenect_depth_palette;
+
+/**
+ * Fill a palette with the colors used by the example viewers: a rainbow
+ * from white (near) through red, yellow, green, cyan and blue to black
+ * (far), on a cubic curve that spends most colors on the near range.
+ * Invalid samples are black.
+ *
+ * @param palette Palette to fill
+ */
+FREENECTAPI void freenect_depth_palette_gamma(freenect_depth_palette *palette);
+
+/**
+ * Fill a palette with the same rainbow spread evenly over a range of
+ * distances. Raw values are converted to millimeters with the device's
+ * registration, so colorizing a raw frame with this palette gives the same
+ * image as converting it to FREENECT_DEPTH_MM first. Samples outside the
+ * range get the color of the nearest end, invalid samples are black.
+ *
+ * @param palette Palette to fill
+ * @param reg Registration of the device, see freenect_copy_registration()
+ * @param near_mm Distance that gets the first color
+ * @param far_mm Distance that gets the last color
+ *
+ * @return 0 on success, < 0 if the range is empty or reg has no depth tables
+ */
+FREENECTAPI int freenect_depth_palette_range(freenect_depth_palette *palette, const freenect_registration *reg, int near_mm, int far_mm);
+
+/**
+ * Colorize a depth frame through a palette in a single pass. Packed frames
+ * are unpacked on the fly, so a FREENECT_DEPTH_11BIT_PACKED stream can be
+ * displayed without ever writing out 16 bit samples.
+ *
+ * @param palette Palette to look colors up in
+ * @param depth Frame in FREENECT_DEPTH_11BIT_PACKED or FREENECT_DEPTH_11BIT format
+ * @param fmt Format of depth
+ * @param width Frame width in pixels
+ * @param height Frame height in pixels; width * height must be a multiple of 8 for packed frames
+ * @param out Output image, width * height * channels bytes
+ * @param channels 3 to write RGB, 4 to write RGBA
+ *
+ * @return 0 on success, < 0 if the format, dimensions or channels are not supported
+ */
+FREENECTAPI int freenect_colorize_depth(const freenect_depth_palette *palette, const void *depth, freenect_depth_format fmt, int width, int height, uint8_t *out, int channels);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,127 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2011 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+#pragma once
+
+#include "libfreenect.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Optional filtering of unpacked depth frames (FREENECT_DEPTH_11BIT,
+/// FREENECT_DEPTH_10BIT, FREENECT_DEPTH_MM and FREENECT_DEPTH_REGISTERED),
+/// run on every frame right after unpacking and before the depth callback.
+/// Packed formats are passed through untouched.
+typedef struct {
+	/// Weight of a new sample in the running average, out of 256. Lower
+	/// values smooth more; 256 disables temporal smoothing.
+	int temporal_alpha;
+	/// A sample differing from the running average by more than this is
+	/// taken as is instead of being blended, so moving edges do not smear.
+	/// In the units of the depth format; 0 picks a default for the format.
+	int temporal_threshold;
+	/// Number of frames a pixel keeps its last value after its samples go
+	/// invalid (0..255)
+	int hold_frames;
+	/// Horizontal runs of invalid pixels up to this width are filled from
+	/// the farther of their two neighbours; 0 disables hole filling.
+	int max_hole_width;
+} freenect_depth_filter;
+
+/**
+ * Filter settings that suit most scenes: moderate smoothing, a two frame
+ * hold and filling of holes up to 8 pixels wide.
+ *
+ * @return Default filter settings
+ */
+FREENECTAPI freenect_depth_filter freenect_default_depth_filter(void);
+
+/**
+ * Enable, reconfigure or disable depth filtering on a device. The filter
+ * state is reset whenever the settings change and when the depth stream is
+ * restarted. May be called from any thread while the depth stream is
+ * running.
+ *
+ * @param dev Device to filter depth frames of
+ * @param filter Filter settings, or NULL to disable filtering
+ *
+ * @return 0 on success, < 0 if the settings are out of range
+ */
+FREENECTAPI int freenect_set_depth_filter(freenect_device *dev, const freenect_depth_filter *filter);
+
+/// Layout of the foreground mask produced by the background model
+typedef enum {
+	FREENECT_MASK_8BIT = 0, /**< One byte per pixel, 255 for foreground and 0 otherwise */
+	FREENECT_MASK_1BIT = 1, /**< One bit per pixel, 8 pixels per byte with the leftmost in the most significant bit */
+} freenect_mask_format;
+
+/// Background subtraction on unpacked depth frames. The background is
+/// learned from the first frames after the model is set or the depth stream
+/// is started; after that every pixel that is valid and closer than its
+/// background by more than the tolerance is marked as foreground. The
+/// tolerance of a pixel is the larger of the threshold and the spread of
+/// its samples while learning, so noisy pixels need a larger step.
+typedef struct {
+	/// Number of frames to learn the background over (1..65535)
+	int learn_frames;
+	/// Minimum distance in front of the background, in the units of the
+	/// depth format. 0 picks a default for the format.
+	int threshold;
+	/// Layout of the mask returned by freenect_get_foreground_mask()
+	freenect_mask_format mask_format;
+} freenect_background_model;
+
+/**
+ * Enable or disable background subtraction on a device. Setting a model
+ * discards the learned background and starts learning again. Runs after
+ * freenect_set_depth_filter() if both are enabled. May be called from any
+ * thread while the depth stream is running.
+ *
+ * @param dev Device to model the background of
+ * @param model Model settings, or NULL to disable background subtraction
+ *
+ * @return 0 on success, < 0 if the settings are out of range
+ */
+FREENECTAPI int freenect_set_background_model(freenect_device *dev, const freenect_background_model *model);
+
+/**
+ * Get the foreground mask of the current depth frame. Call this from the
+ * depth callback; the mask stays valid until the callback returns.
+ *
+ * @param dev Device the depth callback was called for
+ * @param mask Set to the mask, or NULL while the background is still being
+ * learned. An 8 bit mask has width * height bytes, a 1 bit mask
+ * width * height / 8 bytes.
+ *
+ * @return 0 if a mask is available, the number of frames left to learn
+ * while learning, < 0 if background subtraction is disabled or the depth
+ * format is not supported
+ */
+FREENECTAPI int freenect_get_foreground_mask(freenect_device *dev, const uint8_t **mask);
+
+#ifdef __cplusplus
+}
+#endif
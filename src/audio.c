@@ -82,7 +82,7 @@ static void iso_out_callback(freenect_device *dev, uint8_t *pkt, int len) {
 	prepare_iso_out_data(dev, pkt);
 }
 
-static void iso_in_callback(freenect_device *dev, uint8_t *pkt, int len) {
+static void iso_in_packet(freenect_device *dev, uint8_t *pkt, int len) {
 	freenect_context *ctx = dev->parent;
 	if (len == 524) { // Cool, this is audio data
 		audio_in_block* block = (audio_in_block*)pkt;
@@ -139,6 +139,15 @@ static void iso_in_callback(freenect_device *dev, uint8_t *pkt, int len) {
 	}
 }
 
+// The transfers of a stopped stream may still come back while the buffers
+// are freed, so packets are only handled while the stream is running
+static void iso_in_callback(freenect_device *dev, uint8_t *pkt, int len) {
+	fn_mutex_lock(dev->lock);
+	if (dev->audio.running)
+		iso_in_packet(dev, pkt, len);
+	fn_mutex_unlock(dev->lock);
+}
+
 void freenect_set_audio_in_callback(freenect_device *dev, freenect_audio_in_cb callback) {
 	dev->audio_in_cb = callback;
 }
@@ -150,7 +159,7 @@ int freenect_start_audio(freenect_device* dev) {
 	freenect_context *ctx = dev->parent;
 	int res;
 
-	if (dev->audio.running)
+	if (dev->audio.running || dev->reconnect.lost)
 		return -1;
 
 	// Allocate buffers
@@ -218,6 +227,7 @@ int freenect_stop_audio(freenect_device* dev) {
 	}
 
 	// Free buffers
+	fn_mutex_lock(dev->lock);
 	if (dev->audio.audio_out_ring)
 		free(dev->audio.audio_out_ring);
 	if (dev->audio.cancelled_buffer)
@@ -235,6 +245,7 @@ int freenect_stop_audio(freenect_device* dev) {
 	dev->audio.audio_out_ring = NULL;
 	dev->audio.cancelled_buffer = NULL;
 	dev->audio.in_unknown = NULL;
+	fn_mutex_unlock(dev->lock);
 
 	return ret;
 }
@@ -31,6 +31,8 @@
 
 #include "freenect_internal.h"
 #include "registration.h"
+#include "convert.h"
+#include "filter.h"
 #include "cameras.h"
 #include "flags.h"
 
@@ -61,7 +63,7 @@ static freenect_frame_mode supported_video_modes[video_mode_count] = {
 	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_YUV_RAW), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_YUV_RAW}, 640*480*2, 640, 480, 16, 0, 15, 1 },
 };
 
-#define depth_mode_count 6
+#define depth_mode_count 12
 static freenect_frame_mode supported_depth_modes[depth_mode_count] = {
 	// reserved, resolution, format, bytes, width, height, data_bits_per_pixel, padding_bits_per_pixel, framerate, is_valid
 	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT), FREENECT_RESOLUTION_MEDIUM, {FREENECT_DEPTH_11BIT}, 640*480*2, 640, 480, 11, 5, 30, 1},
@@ -70,6 +72,14 @@ static freenect_frame_mode supported_depth_modes[depth_mode_count] = {
 	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_10BIT_PACKED), FREENECT_RESOLUTION_MEDIUM, {FREENECT_DEPTH_10BIT_PACKED}, 640*480*10/8, 640, 480, 10, 0, 30, 1},
 	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_REGISTERED), FREENECT_RESOLUTION_MEDIUM, {FREENECT_DEPTH_REGISTERED}, 640*480*2, 640, 480, 16, 0, 30, 1},
 	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_MM), FREENECT_RESOLUTION_MEDIUM, {FREENECT_DEPTH_MM}, 640*480*2, 640, 480, 16, 0, 30, 1},
+
+	// Binned from VGA while unpacking
+	{MAKE_RESERVED(FREENECT_RESOLUTION_LOW, FREENECT_DEPTH_11BIT), FREENECT_RESOLUTION_LOW, {FREENECT_DEPTH_11BIT}, 320*240*2, 320, 240, 11, 5, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_LOW, FREENECT_DEPTH_10BIT), FREENECT_RESOLUTION_LOW, {FREENECT_DEPTH_10BIT}, 320*240*2, 320, 240, 10, 6, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_LOW, FREENECT_DEPTH_MM), FREENECT_RESOLUTION_LOW, {FREENECT_DEPTH_MM}, 320*240*2, 320, 240, 16, 0, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_QUARTER, FREENECT_DEPTH_11BIT), FREENECT_RESOLUTION_QUARTER, {FREENECT_DEPTH_11BIT}, 160*120*2, 160, 120, 11, 5, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_QUARTER, FREENECT_DEPTH_10BIT), FREENECT_RESOLUTION_QUARTER, {FREENECT_DEPTH_10BIT}, 160*120*2, 160, 120, 10, 6, 30, 1},
+	{MAKE_RESERVED(FREENECT_RESOLUTION_QUARTER, FREENECT_DEPTH_MM), FREENECT_RESOLUTION_QUARTER, {FREENECT_DEPTH_MM}, 160*120*2, 160, 120, 16, 0, 30, 1},
 };
 static const freenect_frame_mode invalid_mode = {0, (freenect_resolution)0, {(freenect_video_format)0}, 0, 0, 0, 0, 0, 0, 0};
 
@@ -228,17 +238,46 @@ static int stream_process(freenect_context *ctx, packet_stream *strm, uint8_t *p
 	return got_frame_size;
 }
 
-static void stream_init(freenect_context *ctx, packet_stream *strm, int rlen, int plen)
+static void *stream_history_slot(packet_stream *strm, int slot)
+{
+	return strm->hist_buf + (size_t)slot * strm->hist_frame_size;
+}
+
+// Without a user buffer, frames are converted straight into the history
+static void *stream_default_buf(packet_stream *strm)
+{
+	if (strm->hist_buf)
+		return stream_history_slot(strm, strm->hist_head);
+	return strm->lib_buf;
+}
+
+static int stream_init(freenect_context *ctx, packet_stream *strm, int rlen, int plen)
 {
 	strm->valid_frames = 0;
 	strm->synced = 0;
 
+	strm->hist_count = 0;
+	strm->hist_head = 0;
+	if (strm->hist_len) {
+		strm->hist_frame_size = plen;
+		strm->hist_buf = (uint8_t*)malloc((size_t)(strm->hist_len + 1) * plen);
+		strm->hist_timestamps = (uint32_t*)malloc((strm->hist_len + 1) * sizeof(uint32_t));
+		if (!strm->hist_buf || !strm->hist_timestamps) {
+			FN_ERROR("Failed to allocate a history of %d frames\n", strm->hist_len);
+			free(strm->hist_buf);
+			free(strm->hist_timestamps);
+			strm->hist_buf = NULL;
+			strm->hist_timestamps = NULL;
+			return -1;
+		}
+	}
+
 	if (strm->usr_buf) {
 		strm->lib_buf = NULL;
 		strm->proc_buf = strm->usr_buf;
 	} else {
 		strm->lib_buf = malloc(plen);
-		strm->proc_buf = strm->lib_buf;
+		strm->proc_buf = stream_default_buf(strm);
 	}
 
 	if (rlen == 0) {
@@ -255,6 +294,7 @@ static void stream_init(freenect_context *ctx, packet_stream *strm, int rlen, in
 	if (strm->last_pkt_size == 0)
 		strm->last_pkt_size = strm->pkt_size;
 	strm->pkts_per_frame = (strm->frame_size + strm->pkt_size - 1) / strm->pkt_size;
+	return 0;
 }
 
 static void stream_freebufs(freenect_context *ctx, packet_stream *strm)
@@ -263,10 +303,62 @@ static void stream_freebufs(freenect_context *ctx, packet_stream *strm)
 		free(strm->raw_buf);
 	if (strm->lib_buf)
 		free(strm->lib_buf);
+	free(strm->hist_buf);
+	free(strm->hist_timestamps);
 
 	strm->raw_buf = NULL;
 	strm->proc_buf = NULL;
 	strm->lib_buf = NULL;
+	strm->hist_buf = NULL;
+	strm->hist_timestamps = NULL;
+	strm->hist_count = 0;
+}
+
+// Record the frame just converted into proc_buf in the history
+static void stream_push_history(packet_stream *strm)
+{
+	if (!strm->hist_buf)
+		return;
+	void *slot = stream_history_slot(strm, strm->hist_head);
+	if (strm->proc_buf != slot)
+		memcpy(slot, strm->proc_buf, strm->hist_frame_size);
+	strm->hist_timestamps[strm->hist_head] = strm->timestamp;
+	strm->hist_head = (strm->hist_head + 1) % (strm->hist_len + 1);
+	if (strm->hist_count < strm->hist_len)
+		strm->hist_count++;
+}
+
+// Move on to the next history slot once the callback is done with the frame
+static void stream_advance_history(packet_stream *strm)
+{
+	if (!strm->hist_buf || strm->usr_buf)
+		return;
+	strm->proc_buf = stream_history_slot(strm, strm->hist_head);
+	if (!strm->split_bufs)
+		strm->raw_buf = (uint8_t*)strm->proc_buf;
+}
+
+static int stream_get_history(packet_stream *strm, int age, const void **frame, uint32_t *timestamp)
+{
+	if (age < 0 || age >= strm->hist_count)
+		return -1;
+	int slot = (strm->hist_head + strm->hist_len - age) % (strm->hist_len + 1);
+	*frame = stream_history_slot(strm, slot);
+	if (timestamp)
+		*timestamp = strm->hist_timestamps[slot];
+	return 0;
+}
+
+static int stream_set_history(freenect_context *ctx, packet_stream *strm, int length)
+{
+	if (length < 0)
+		return -1;
+	if (strm->running) {
+		FN_ERROR("Frame history can only be changed while the stream is stopped\n");
+		return -1;
+	}
+	strm->hist_len = length;
+	return 0;
 }
 
 static int stream_setbuf(freenect_context *ctx, packet_stream *strm, void *pbuf)
@@ -282,7 +374,7 @@ static int stream_setbuf(freenect_context *ctx, packet_stream *strm, void *pbuf)
 		strm->usr_buf = pbuf;
 
 		if (!pbuf)
-			strm->proc_buf = strm->lib_buf;
+			strm->proc_buf = stream_default_buf(strm);
 		else
 			strm->proc_buf = pbuf;
 
@@ -292,89 +384,31 @@ static int stream_setbuf(freenect_context *ctx, packet_stream *strm, void *pbuf)
 	}
 }
 
-/**
- * Convert a packed array of n elements with vw useful bits into array of
- * zero-padded 16bit elements.
- *
- * @param src The source packed array, of size (n * vw / 8) bytes
- * @param dest The destination unpacked array, of size (n * 2) bytes
- * @param vw The virtual width of elements, that is the number of useful bits for each of them
- * @param n The number of elements (in particular, of the destination array), NOT a length in bytes
- */
-static inline void convert_packed_to_16bit(uint8_t *src, uint16_t *dest, int vw, int n)
-{
-	unsigned int mask = (1 << vw) - 1;
-	uint32_t buffer = 0;
-	int bitsIn = 0;
-	while (n--) {
-		while (bitsIn < vw) {
-			buffer = (buffer << 8) | *(src++);
-			bitsIn += 8;
-		}
-		bitsIn -= vw;
-		*(dest++) = (buffer >> bitsIn) & mask;
-	}
-}
-
-/**
- * Convert a packed array of n elements with vw useful bits into array of
- * 8bit elements, dropping LSB.
- *
- * @param src The source packed array, of size (n * vw / 8) bytes
- * @param dest The destination unpacked array, of size (n * 2) bytes
- * @param vw The virtual width of elements, that is the number of useful bits for each of them
- * @param n The number of elements (in particular, of the destination array), NOT a length in bytes
- *
- * @pre vw is expected to be >= 8.
- */
-static inline void convert_packed_to_8bit(uint8_t *src, uint8_t *dest, int vw, int n)
-{
-	uint32_t buffer = 0;
-	int bitsIn = 0;
-	while (n--) {
-		while (bitsIn < vw) {
-			buffer = (buffer << 8) | *(src++);
-			bitsIn += 8;
-		}
-		bitsIn -= vw;
-		*(dest++) = buffer >> (bitsIn + vw - 8);
-	}
-}
-
-// Loop-unrolled version of the 11-to-16 bit unpacker.  n must be a multiple of 8.
-static void convert_packed11_to_16bit(uint8_t *raw, uint16_t *frame, int n)
+// Unpack a VGA depth frame straight into a binned FREENECT_RESOLUTION_LOW
+// or FREENECT_RESOLUTION_QUARTER frame
+static void depth_process_binned(freenect_device *dev)
 {
-	uint16_t baseMask = (1 << 11) - 1;
-	while(n >= 8)
-	{
-		uint8_t r0  = *(raw+0);
-		uint8_t r1  = *(raw+1);
-		uint8_t r2  = *(raw+2);
-		uint8_t r3  = *(raw+3);
-		uint8_t r4  = *(raw+4);
-		uint8_t r5  = *(raw+5);
-		uint8_t r6  = *(raw+6);
-		uint8_t r7  = *(raw+7);
-		uint8_t r8  = *(raw+8);
-		uint8_t r9  = *(raw+9);
-		uint8_t r10 = *(raw+10);
-
-		frame[0] =  (r0<<3)  | (r1>>5);
-		frame[1] = ((r1<<6)  | (r2>>2) )           & baseMask;
-		frame[2] = ((r2<<9)  | (r3<<1) | (r4>>7) ) & baseMask;
-		frame[3] = ((r4<<4)  | (r5>>4) )           & baseMask;
-		frame[4] = ((r5<<7)  | (r6>>1) )           & baseMask;
-		frame[5] = ((r6<<10) | (r7<<2) | (r8>>6) ) & baseMask;
-		frame[6] = ((r8<<5)  | (r9>>3) )           & baseMask;
-		frame[7] = ((r9<<8)  | (r10)   )           & baseMask;
-
-		n -= 8;
-		raw += 11;
-		frame += 8;
+	freenect_context *ctx = dev->parent;
+	freenect_frame_mode frame_mode = freenect_get_current_depth_mode(dev);
+	int factor = 640 / frame_mode.width;
+	switch (dev->depth_format) {
+		case FREENECT_DEPTH_11BIT:
+			convert_packed_to_16bit_binned(dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, 11, 640, 480, factor, dev->depth_binning, FREENECT_DEPTH_RAW_NO_VALUE);
+			break;
+		case FREENECT_DEPTH_10BIT:
+			convert_packed_to_16bit_binned(dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, 10, 640, 480, factor, dev->depth_binning, 1023);
+			break;
+		case FREENECT_DEPTH_MM:
+			convert_packed_to_16bit_binned(dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, 11, 640, 480, factor, dev->depth_binning, FREENECT_DEPTH_RAW_NO_VALUE);
+			freenect_apply_binned_depth_to_mm(dev, (uint16_t*)dev->depth.proc_buf, frame_mode.width * frame_mode.height);
+			break;
+		default:
+			FN_ERROR("depth_process_binned() was called, but an invalid depth_format is set\n");
+			break;
 	}
 }
 
-static void depth_process(freenect_device *dev, uint8_t *pkt, int len)
+static void depth_process_packet(freenect_device *dev, uint8_t *pkt, int len)
 {
 	freenect_context *ctx = dev->parent;
 
@@ -392,229 +426,46 @@ static void depth_process(freenect_device *dev, uint8_t *pkt, int len)
 	FN_SPEW("Got depth frame of size %d/%d, %d/%d packets arrived, TS %08x\n", got_frame_size,
 	        dev->depth.frame_size, dev->depth.valid_pkts, dev->depth.pkts_per_frame, dev->depth.timestamp);
 
-	switch (dev->depth_format) {
-		case FREENECT_DEPTH_11BIT:
-			convert_packed11_to_16bit(dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, 640*480);
-			break;
-		case FREENECT_DEPTH_REGISTERED:
-			freenect_apply_registration(dev, dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, false);
-			break;
-		case FREENECT_DEPTH_MM:
-			freenect_apply_depth_to_mm(dev, dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf );
-			break;
-		case FREENECT_DEPTH_10BIT:
-			convert_packed_to_16bit(dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, 10, 640*480);
-			break;
-		case FREENECT_DEPTH_10BIT_PACKED:
-		case FREENECT_DEPTH_11BIT_PACKED:
-			break;
-		default:
-			FN_ERROR("depth_process() was called, but an invalid depth_format is set\n");
-			break;
+	if (dev->depth_resolution != FREENECT_RESOLUTION_MEDIUM) {
+		depth_process_binned(dev);
+	} else {
+		switch (dev->depth_format) {
+			case FREENECT_DEPTH_11BIT:
+				convert_packed11_to_16bit(dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, 640*480);
+				break;
+			case FREENECT_DEPTH_REGISTERED:
+				freenect_apply_registration(dev, dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, false);
+				break;
+			case FREENECT_DEPTH_MM:
+				freenect_apply_depth_to_mm(dev, dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf );
+				break;
+			case FREENECT_DEPTH_10BIT:
+				convert_packed_to_16bit(dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, 10, 640*480);
+				break;
+			case FREENECT_DEPTH_10BIT_PACKED:
+			case FREENECT_DEPTH_11BIT_PACKED:
+				break;
+			default:
+				FN_ERROR("depth_process() was called, but an invalid depth_format is set\n");
+				break;
+		}
 	}
+	freenect_apply_depth_filter(dev, (uint16_t*)dev->depth.proc_buf);
+	freenect_apply_background_model(dev, (uint16_t*)dev->depth.proc_buf);
+	stream_push_history(&dev->depth);
 	if (dev->depth_cb)
 		dev->depth_cb(dev, dev->depth.proc_buf, dev->depth.timestamp);
+	stream_advance_history(&dev->depth);
 }
 
-#define CLAMP(x) if (x < 0) {x = 0;} if (x > 255) {x = 255;}
-static void convert_uyvy_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode)
-{
-	int x, y;
-	for(y = 0; y < frame_mode.height; ++y) {
-		for(x = 0; x < frame_mode.width; x+=2) {
-			int i = (frame_mode.width * y + x);
-			int u  = raw_buf[2*i];
-			int y1 = raw_buf[2*i+1];
-			int v  = raw_buf[2*i+2];
-			int y2 = raw_buf[2*i+3];
-			int r1 = (y1-16)*1164/1000 + (v-128)*1596/1000;
-			int g1 = (y1-16)*1164/1000 - (v-128)*813/1000 - (u-128)*391/1000;
-			int b1 = (y1-16)*1164/1000 + (u-128)*2018/1000;
-			int r2 = (y2-16)*1164/1000 + (v-128)*1596/1000;
-			int g2 = (y2-16)*1164/1000 - (v-128)*813/1000 - (u-128)*391/1000;
-			int b2 = (y2-16)*1164/1000 + (u-128)*2018/1000;
-			CLAMP(r1)
-			CLAMP(g1)
-			CLAMP(b1)
-			CLAMP(r2)
-			CLAMP(g2)
-			CLAMP(b2)
-			proc_buf[3*i]  =r1;
-			proc_buf[3*i+1]=g1;
-			proc_buf[3*i+2]=b1;
-			proc_buf[3*i+3]=r2;
-			proc_buf[3*i+4]=g2;
-			proc_buf[3*i+5]=b2;
-		}
-	}
-}
-#undef CLAMP
-
-static void convert_bayer_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode)
+static void depth_process(freenect_device *dev, uint8_t *pkt, int len)
 {
-	int x,y;
-	/* Pixel arrangement:
-	 * G R G R G R G R
-	 * B G B G B G B G
-	 * G R G R G R G R
-	 * B G B G B G B G
-	 * G R G R G R G R
-	 * B G B G B G B G
-	 *
-	 * To convert a Bayer-pattern into RGB you have to handle four pattern
-	 * configurations:
-	 * 1)         2)         3)         4)
-	 *      B1      B1 G1 B2   R1 G1 R2      R1       <- previous line
-	 *   R1 G1 R2   G2 R1 G3   G2 B1 G3   B1 G1 B2    <- current line
-	 *      B2      B3 G4 B4   R3 G4 R4      R2       <- next line
-	 *   ^  ^  ^
-	 *   |  |  next pixel
-	 *   |  current pixel
-	 *   previous pixel
-	 *
-	 * The RGB values (r,g,b) for each configuration are calculated as
-	 * follows:
-	 *
-	 * 1) r = (R1 + R2) / 2
-	 *    g =  G1
-	 *    b = (B1 + B2) / 2
-	 *
-	 * 2) r =  R1
-	 *    g = (G1 + G2 + G3 + G4) / 4
-	 *    b = (B1 + B2 + B3 + B4) / 4
-	 *
-	 * 3) r = (R1 + R2 + R3 + R4) / 4
-	 *    g = (G1 + G2 + G3 + G4) / 4
-	 *    b =  B1
-	 *
-	 * 4) r = (R1 + R2) / 2
-	 *    g =  G1
-	 *    b = (B1 + B2) / 2
-	 *
-	 * To efficiently calculate these values, two 32bit integers are used
-	 * as "shift-buffers". One integer to store the 3 horizontal bayer pixel
-	 * values (previous, current, next) of the current line. The other
-	 * integer to store the vertical average value of the bayer pixels
-	 * (previous, current, next) of the previous and next line.
-	 *
-	 * The boundary conditions for the first and last line and the first
-	 * and last column are solved via mirroring the second and second last
-	 * line and the second and second last column.
-	 *
-	 * To reduce slow memory access, the values of a rgb pixel are packet
-	 * into a 32bit variable and transfered together.
-	 */
-
-	uint8_t *dst = proc_buf; // pointer to destination
-
-	uint8_t *prevLine;        // pointer to previous, current and next line
-	uint8_t *curLine;         // of the source bayer pattern
-	uint8_t *nextLine;
-
-	// storing horizontal values in hVals:
-	// previous << 16, current << 8, next
-	uint32_t hVals;
-	// storing vertical averages in vSums:
-	// previous << 16, current << 8, next
-	uint32_t vSums;
-
-	// init curLine and nextLine pointers
-	curLine  = raw_buf;
-	nextLine = curLine + frame_mode.width;
-	for (y = 0; y < frame_mode.height; ++y) {
-
-		if ((y > 0) && (y < frame_mode.height-1))
-			prevLine = curLine - frame_mode.width; // normal case
-		else if (y == 0)
-			prevLine = nextLine;      // top boundary case
-		else
-			nextLine = prevLine;      // bottom boundary case
-
-		// init horizontal shift-buffer with current value
-		hVals  = (*(curLine++) << 8);
-		// handle left column boundary case
-		hVals |= (*curLine << 16);
-		// init vertical average shift-buffer with current values average
-		vSums = ((*(prevLine++) + *(nextLine++)) << 7) & 0xFF00;
-		// handle left column boundary case
-		vSums |= ((*prevLine + *nextLine) << 15) & 0xFF0000;
-
-		// store if line is odd or not
-		uint8_t yOdd = y & 1;
-		// the right column boundary case is not handled inside this loop
-		// thus the "639"
-		for (x = 0; x < frame_mode.width-1; ++x) {
-			// place next value in shift buffers
-			hVals |= *(curLine++);
-			vSums |= (*(prevLine++) + *(nextLine++)) >> 1;
-
-			// calculate the horizontal sum as this sum is needed in
-			// any configuration
-			uint8_t hSum = ((uint8_t)(hVals >> 16) + (uint8_t)(hVals)) >> 1;
-
-			if (yOdd == 0) {
-				if ((x & 1) == 0) {
-					// Configuration 1
-					*(dst++) = hSum;		// r
-					*(dst++) = hVals >> 8;	// g
-					*(dst++) = vSums >> 8;	// b
-				} else {
-					// Configuration 2
-					*(dst++) = hVals >> 8;
-					*(dst++) = (hSum + (uint8_t)(vSums >> 8)) >> 1;
-					*(dst++) = ((uint8_t)(vSums >> 16) + (uint8_t)(vSums)) >> 1;
-				}
-			} else {
-				if ((x & 1) == 0) {
-					// Configuration 3
-					*(dst++) = ((uint8_t)(vSums >> 16) + (uint8_t)(vSums)) >> 1;
-					*(dst++) = (hSum + (uint8_t)(vSums >> 8)) >> 1;
-					*(dst++) = hVals >> 8;
-				} else {
-					// Configuration 4
-					*(dst++) = vSums >> 8;
-					*(dst++) = hVals >> 8;
-					*(dst++) = hSum;
-				}
-			}
-
-			// shift the shift-buffers
-			hVals <<= 8;
-			vSums <<= 8;
-		} // end of for x loop
-		// right column boundary case, mirroring second last column
-		hVals |= (uint8_t)(hVals >> 16);
-		vSums |= (uint8_t)(vSums >> 16);
-
-		// the horizontal sum simplifies to the second last column value
-		uint8_t hSum = (uint8_t)(hVals);
-
-		if (yOdd == 0) {
-			if ((x & 1) == 0) {
-				*(dst++) = hSum;
-				*(dst++) = hVals >> 8;
-				*(dst++) = vSums >> 8;
-			} else {
-				*(dst++) = hVals >> 8;
-				*(dst++) = (hSum + (uint8_t)(vSums >> 8)) >> 1;
-				*(dst++) = vSums;
-			}
-		} else {
-			if ((x & 1) == 0) {
-				*(dst++) = vSums;
-				*(dst++) = (hSum + (uint8_t)(vSums >> 8)) >> 1;
-				*(dst++) = hVals >> 8;
-			} else {
-				*(dst++) = vSums >> 8;
-				*(dst++) = hVals >> 8;
-				*(dst++) = hSum;
-			}
-		}
-
-	} // end of for y loop
+	fn_mutex_lock(dev->lock);
+	depth_process_packet(dev, pkt, len);
+	fn_mutex_unlock(dev->lock);
 }
 
-static void video_process(freenect_device *dev, uint8_t *pkt, int len)
+static void video_process_packet(freenect_device *dev, uint8_t *pkt, int len)
 {
 	freenect_context *ctx = dev->parent;
 
@@ -657,8 +508,17 @@ static void video_process(freenect_device *dev, uint8_t *pkt, int len)
 			break;
 	}
 
+	stream_push_history(&dev->video);
 	if (dev->video_cb)
 		dev->video_cb(dev, dev->video.proc_buf, dev->video.timestamp);
+	stream_advance_history(&dev->video);
+}
+
+static void video_process(freenect_device *dev, uint8_t *pkt, int len)
+{
+	fn_mutex_lock(dev->lock);
+	video_process_packet(dev, pkt, len);
+	fn_mutex_unlock(dev->lock);
 }
 
 static int freenect_fetch_reg_info(freenect_device *dev)
@@ -799,9 +659,9 @@ static int freenect_fetch_zero_plane_info(freenect_device *dev)
 	uint16_t cmd[5] = {0}; // Offset is the only field in this command, and it's 0
 
 	int res;
-	res = send_cmd(dev, 0x04, cmd, 10, reply, ctx->zero_plane_res); //OPCODE_GET_FIXED_PARAMS = 4,
-	if (res != ctx->zero_plane_res) {
-		FN_ERROR("freenect_fetch_zero_plane_info: send_cmd read %d bytes (expected %d)\n", res,ctx->zero_plane_res);
+	res = send_cmd(dev, 0x04, cmd, 10, reply, dev->zero_plane_res); //OPCODE_GET_FIXED_PARAMS = 4,
+	if (res != dev->zero_plane_res) {
+		FN_ERROR("freenect_fetch_zero_plane_info: send_cmd read %d bytes (expected %d)\n", res,dev->zero_plane_res);
 		return -1;
 	}
 
@@ -842,61 +702,69 @@ int freenect_start_depth(freenect_device *dev)
 {
 	freenect_context *ctx = dev->parent;
 
-	if (dev->depth.running)
+	if (dev->depth.running || dev->reconnect.lost)
 		return -1;
 
 	dev->depth.pkt_size = DEPTH_PKTDSIZE;
 	dev->depth.flag = 0x70;
 	dev->depth.variable_length = 0;
 
+	int res = 0;
 	switch (dev->depth_format) {
 		case FREENECT_DEPTH_REGISTERED:
 		case FREENECT_DEPTH_MM:
 			freenect_init_registration(dev);
 		case FREENECT_DEPTH_11BIT:
-			stream_init(ctx, &dev->depth, freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_11BIT_PACKED).bytes, freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_11BIT).bytes);
+			res = stream_init(ctx, &dev->depth, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT_PACKED).bytes, freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_11BIT).bytes);
 			break;
 		case FREENECT_DEPTH_10BIT:
-			stream_init(ctx, &dev->depth, freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_10BIT_PACKED).bytes, freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_10BIT).bytes);
+			res = stream_init(ctx, &dev->depth, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_10BIT_PACKED).bytes, freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_10BIT).bytes);
 			break;
 		case FREENECT_DEPTH_11BIT_PACKED:
 		case FREENECT_DEPTH_10BIT_PACKED:
-			stream_init(ctx, &dev->depth, 0, freenect_find_depth_mode(dev->depth_resolution, dev->depth_format).bytes);
+			res = stream_init(ctx, &dev->depth, 0, freenect_find_depth_mode(dev->depth_resolution, dev->depth_format).bytes);
 			break;
 		default:
 			FN_ERROR("freenect_start_depth() called with invalid depth format %d\n", dev->depth_format);
 			return -1;
 	}
+	if (res < 0)
+		return -1;
 
 	const unsigned char depth_endpoint = 0x82;
 	int packet_size = fnusb_get_max_iso_packet_size(&dev->usb_cam, depth_endpoint, DEPTH_PKTBUF);
 
 	FN_INFO("[Stream 70] Negotiated packet size %d\n", packet_size);
 
-	int res = fnusb_start_iso(&dev->usb_cam, &dev->depth_isoc, depth_process, depth_endpoint, NUM_XFERS, PKTS_PER_XFER, packet_size);
+	res = fnusb_start_iso(&dev->usb_cam, &dev->depth_isoc, depth_process, depth_endpoint, NUM_XFERS, PKTS_PER_XFER, packet_size);
 	if (res < 0)
 		return res;
 
-	write_register(dev, 0x105, 0x00); // Disable auto-cycle of projector
-	write_register(dev, 0x06, 0x00); // reset depth stream
+	uint16_t depth_mode = 0x03;
 	switch (dev->depth_format) {
 		case FREENECT_DEPTH_11BIT:
 		case FREENECT_DEPTH_11BIT_PACKED:
 		case FREENECT_DEPTH_REGISTERED:
 		case FREENECT_DEPTH_MM:
-			write_register(dev, 0x12, 0x03);
+			depth_mode = 0x03;
 			break;
 		case FREENECT_DEPTH_10BIT:
 		case FREENECT_DEPTH_10BIT_PACKED:
-			write_register(dev, 0x12, 0x02);
+			depth_mode = 0x02;
 			break;
 		case FREENECT_DEPTH_DUMMY: // Returned already, hush gcc
 			break;
 	}
-	write_register(dev, 0x13, 0x01);
-	write_register(dev, 0x14, 0x1e);
-	write_register(dev, 0x06, 0x02); // start depth stream
-	write_register(dev, 0x17, 0x00); // disable depth hflip
+	reg_write writes[] = {
+		{ 0x105, 0x00 }, // Disable auto-cycle of projector
+		{ 0x06, 0x00 }, // reset depth stream
+		{ 0x12, depth_mode },
+		{ 0x13, 0x01 },
+		{ 0x14, 0x1e },
+		{ 0x06, 0x02 }, // start depth stream
+		{ 0x17, 0x00 }, // disable depth hflip
+	};
+	write_registers(dev, writes, sizeof(writes) / sizeof(writes[0]));
 
 	dev->depth.running = 1;
 	return 0;
@@ -906,7 +774,7 @@ int freenect_start_video(freenect_device *dev)
 {
 	freenect_context *ctx = dev->parent;
 
-	if (dev->video.running)
+	if (dev->video.running || dev->reconnect.lost)
 		return -1;
 
 	dev->video.pkt_size = VIDEO_PKTDSIZE;
@@ -992,62 +860,72 @@ int freenect_start_video(freenect_device *dev)
 	}
 
 	freenect_frame_mode frame_mode = freenect_get_current_video_mode(dev);
+	int res = 0;
 	switch (dev->video_format) {
 		case FREENECT_VIDEO_RGB:
-			stream_init(ctx, &dev->video, freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_BAYER).bytes, frame_mode.bytes);
+			res = stream_init(ctx, &dev->video, freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_BAYER).bytes, frame_mode.bytes);
 			break;
 		case FREENECT_VIDEO_BAYER:
-			stream_init(ctx, &dev->video, 0, frame_mode.bytes);
+			res = stream_init(ctx, &dev->video, 0, frame_mode.bytes);
 			break;
 		case FREENECT_VIDEO_IR_8BIT:
-			stream_init(ctx, &dev->video, freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_IR_10BIT_PACKED).bytes, frame_mode.bytes);
+			res = stream_init(ctx, &dev->video, freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_IR_10BIT_PACKED).bytes, frame_mode.bytes);
 			break;
 		case FREENECT_VIDEO_IR_10BIT:
-			stream_init(ctx, &dev->video, freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_IR_10BIT_PACKED).bytes, frame_mode.bytes);
+			res = stream_init(ctx, &dev->video, freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_IR_10BIT_PACKED).bytes, frame_mode.bytes);
 			break;
 		case FREENECT_VIDEO_IR_10BIT_PACKED:
-			stream_init(ctx, &dev->video, 0, frame_mode.bytes);
+			res = stream_init(ctx, &dev->video, 0, frame_mode.bytes);
 			break;
 		case FREENECT_VIDEO_YUV_RGB:
-			stream_init(ctx, &dev->video, freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_YUV_RAW).bytes, frame_mode.bytes);
+			res = stream_init(ctx, &dev->video, freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_YUV_RAW).bytes, frame_mode.bytes);
 			break;
 		case FREENECT_VIDEO_YUV_RAW:
-			stream_init(ctx, &dev->video, 0, frame_mode.bytes);
+			res = stream_init(ctx, &dev->video, 0, frame_mode.bytes);
 			break;
 		case FREENECT_VIDEO_DUMMY: // Silence compiler
 			break;
 	}
+	if (res < 0)
+		return -1;
 
 	const unsigned char video_endpoint = 0x81;
 	int packet_size = fnusb_get_max_iso_packet_size(&dev->usb_cam, video_endpoint, VIDEO_PKTBUF);
 
 	FN_INFO("[Stream 80] Negotiated packet size %d\n", packet_size);
 
-	int res = fnusb_start_iso(&dev->usb_cam, &dev->video_isoc, video_process, video_endpoint, NUM_XFERS, PKTS_PER_XFER, packet_size);
+	res = fnusb_start_iso(&dev->usb_cam, &dev->video_isoc, video_process, video_endpoint, NUM_XFERS, PKTS_PER_XFER, packet_size);
 	if (res < 0)
 		return res;
 
-	write_register(dev, mode_reg, mode_value);
-	write_register(dev, res_reg, res_value);
-	write_register(dev, fps_reg, fps_value);
-
+	reg_write writes[6] = {
+		{ mode_reg, mode_value },
+		{ res_reg, res_value },
+		{ fps_reg, fps_value },
+	};
+	int num_writes = 3;
 	switch (dev->video_format) {
 		case FREENECT_VIDEO_RGB:
 		case FREENECT_VIDEO_BAYER:
 		case FREENECT_VIDEO_YUV_RGB:
 		case FREENECT_VIDEO_YUV_RAW:
-			write_register(dev, 0x05, 0x01); // start video stream
+			writes[num_writes].reg = 0x05; // start video stream
+			writes[num_writes++].data = 0x01;
 			break;
 		case FREENECT_VIDEO_IR_8BIT:
 		case FREENECT_VIDEO_IR_10BIT:
 		case FREENECT_VIDEO_IR_10BIT_PACKED:
-			write_register(dev, 0x105, 0x00); // Disable auto-cycle of projector
-			write_register(dev, 0x05, 0x03); // start video stream
+			writes[num_writes].reg = 0x105; // Disable auto-cycle of projector
+			writes[num_writes++].data = 0x00;
+			writes[num_writes].reg = 0x05; // start video stream
+			writes[num_writes++].data = 0x03;
 			break;
 		case FREENECT_VIDEO_DUMMY: // Silence compiler
 			break;
 	}
-	write_register(dev, hflip_reg, 0x00); // disable Hflip
+	writes[num_writes].reg = hflip_reg; // disable Hflip
+	writes[num_writes++].data = 0x00;
+	write_registers(dev, writes, num_writes);
 
 	dev->video.running = 1;
 	return 0;
@@ -1070,8 +948,12 @@ int freenect_stop_depth(freenect_device *dev)
 		return res;
 	}
 
+	fn_mutex_lock(dev->lock);
 	freenect_destroy_registration(&(dev->registration));
+	freenect_reset_depth_filter(dev);
+	freenect_reset_background_model(dev);
 	stream_freebufs(ctx, &dev->depth);
+	fn_mutex_unlock(dev->lock);
 	return 0;
 }
 
@@ -1092,7 +974,9 @@ int freenect_stop_video(freenect_device *dev)
 		return res;
 	}
 
+	fn_mutex_lock(dev->lock);
 	stream_freebufs(ctx, &dev->video);
+	fn_mutex_unlock(dev->lock);
 	return 0;
 }
 
@@ -1238,14 +1122,51 @@ int freenect_set_depth_mode(freenect_device* dev, const freenect_frame_mode mode
 	dev->depth_resolution = res;
 	return 0;
 }
+
+int freenect_set_depth_binning(freenect_device* dev, freenect_depth_binning binning)
+{
+	freenect_context *ctx = dev->parent;
+	if (binning != FREENECT_DEPTH_BINNING_MIN && binning != FREENECT_DEPTH_BINNING_MEDIAN && binning != FREENECT_DEPTH_BINNING_MEAN) {
+		FN_ERROR("freenect_set_depth_binning: invalid binning method %d\n", binning);
+		return -1;
+	}
+	dev->depth_binning = binning;
+	return 0;
+}
 int freenect_set_depth_buffer(freenect_device *dev, void *buf)
 {
-	return stream_setbuf(dev->parent, &dev->depth, buf);
+	fn_mutex_lock(dev->lock);
+	int res = stream_setbuf(dev->parent, &dev->depth, buf);
+	fn_mutex_unlock(dev->lock);
+	return res;
 }
 
 int freenect_set_video_buffer(freenect_device *dev, void *buf)
 {
-	return stream_setbuf(dev->parent, &dev->video, buf);
+	fn_mutex_lock(dev->lock);
+	int res = stream_setbuf(dev->parent, &dev->video, buf);
+	fn_mutex_unlock(dev->lock);
+	return res;
+}
+
+int freenect_set_depth_history(freenect_device *dev, int length)
+{
+	return stream_set_history(dev->parent, &dev->depth, length);
+}
+
+int freenect_set_video_history(freenect_device *dev, int length)
+{
+	return stream_set_history(dev->parent, &dev->video, length);
+}
+
+int freenect_get_depth_history(freenect_device *dev, int age, const void **frame, uint32_t *timestamp)
+{
+	return stream_get_history(&dev->depth, age, frame, timestamp);
+}
+
+int freenect_get_video_history(freenect_device *dev, int age, const void **frame, uint32_t *timestamp)
+{
+	return stream_get_history(&dev->video, age, frame, timestamp);
 }
 
 FN_INTERNAL int freenect_camera_init(freenect_device *dev)
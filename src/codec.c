@@ -0,0 +1,313 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2011 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+#include "libfreenect.h"
+#include "libfreenect_codec.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Stream layout:
+ *
+ *   'F' 'D' 'Z' <version> <width lo> <width hi> <height lo> <height hi>
+ *
+ * followed by codes describing the prediction residual of every sample in
+ * raster order. Samples are predicted with the median edge detector from
+ * LOCO-I (left, above, upper-left), which handles the sharp object edges of
+ * depth images well. Codes:
+ *
+ *   00nnnnnn                 run of n+1 zero residuals (1..64)
+ *   01aaabbb                 two residuals, 3 bit two's complement each
+ *   10zzzzzz                 one residual, zigzag encoded (-32..31)
+ *   110zzzzz zzzzzzzz        one residual, zigzag encoded (-4096..4095)
+ *   1110zzzz zzzzzzzz zzzzzzzz  one residual, zigzag encoded (any 16 bit)
+ *   11110000 nnnnnnnn nnnnnnnn  run of n+1 zero residuals (1..65536)
+ *
+ * Multi byte fields are big endian within the code. Everything else is
+ * reserved.
+ */
+
+#define CODEC_VERSION 1
+
+#define CODE_RUN      0x00
+#define CODE_PAIR     0x40
+#define CODE_SHORT    0x80
+#define CODE_MEDIUM   0xC0
+#define CODE_LONG     0xE0
+#define CODE_LONG_RUN 0xF0
+
+#define SHORT_RUN_MAX 64
+#define LONG_RUN_MAX  65536
+
+// Worst case: every sample needs a CODE_LONG residual
+#define MAX_CODE_BYTES 3
+
+static inline int predict(const uint16_t* row, const uint16_t* prev, int x)
+{
+	if (!prev)
+		return x ? row[x-1] : 0;
+	if (!x)
+		return prev[0];
+
+	int a = row[x-1];
+	int b = prev[x];
+	int c = prev[x-1];
+	int max = a > b ? a : b;
+	int min = a < b ? a : b;
+	if (c >= max)
+		return min;
+	if (c <= min)
+		return max;
+	return a + b - c;
+}
+
+static inline uint32_t zigzag(int32_t r)
+{
+	return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t z)
+{
+	return (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+}
+
+static inline int is_pairable(int32_t r)
+{
+	return r >= -4 && r <= 3;
+}
+
+static inline int residual_bytes(int32_t r)
+{
+	uint32_t z = zigzag(r);
+	return z < 64 ? 1 : z < 8192 ? 2 : 3;
+}
+
+static uint8_t* put_residual(uint8_t* p, int32_t r)
+{
+	uint32_t z = zigzag(r);
+	if (z < 64) {
+		*p++ = CODE_SHORT | z;
+	} else if (z < 8192) {
+		*p++ = CODE_MEDIUM | (z >> 8);
+		*p++ = z & 0xff;
+	} else {
+		*p++ = CODE_LONG | (z >> 16);
+		*p++ = (z >> 8) & 0xff;
+		*p++ = z & 0xff;
+	}
+	return p;
+}
+
+static uint8_t* put_run(uint8_t* p, uint8_t* end, int run)
+{
+	while (run > 0) {
+		if (run <= SHORT_RUN_MAX) {
+			if (end - p < 1)
+				return NULL;
+			*p++ = CODE_RUN | (run - 1);
+			run = 0;
+		} else {
+			int n = run < LONG_RUN_MAX ? run : LONG_RUN_MAX;
+			if (end - p < 3)
+				return NULL;
+			*p++ = CODE_LONG_RUN;
+			*p++ = ((n - 1) >> 8) & 0xff;
+			*p++ = (n - 1) & 0xff;
+			run -= n;
+		}
+	}
+	return p;
+}
+
+size_t freenect_depth_compress_bound(int width, int height)
+{
+	if (width <= 0 || height <= 0 || width > 0xffff || height > 0xffff)
+		return 0;
+	return FREENECT_DEPTH_CODEC_HEADER_SIZE + (size_t)width * height * MAX_CODE_BYTES;
+}
+
+int freenect_depth_compress(const uint16_t* depth, int width, int height, uint8_t* out, size_t out_size)
+{
+	if (!depth || !out || !freenect_depth_compress_bound(width, height))
+		return -1;
+	if (out_size < FREENECT_DEPTH_CODEC_HEADER_SIZE)
+		return -1;
+
+	uint8_t* p = out;
+	uint8_t* end = out + out_size;
+	*p++ = 'F';
+	*p++ = 'D';
+	*p++ = 'Z';
+	*p++ = CODEC_VERSION;
+	*p++ = width & 0xff;
+	*p++ = (width >> 8) & 0xff;
+	*p++ = height & 0xff;
+	*p++ = (height >> 8) & 0xff;
+
+	int run = 0;
+	int have_pending = 0;
+	int32_t pending = 0;
+	const uint16_t* prev = NULL;
+	int x, y;
+	for (y = 0; y < height; y++) {
+		const uint16_t* row = depth + y * width;
+		for (x = 0; x < width; x++) {
+			int32_t r = (int32_t)row[x] - predict(row, prev, x);
+			if (r == 0 && !have_pending) {
+				run++;
+				continue;
+			}
+			if (run) {
+				p = put_run(p, end, run);
+				if (!p)
+					return -1;
+				run = 0;
+			}
+			if (have_pending && is_pairable(r)) {
+				if (end - p < 1)
+					return -1;
+				*p++ = CODE_PAIR | ((pending & 0x7) << 3) | (r & 0x7);
+				have_pending = 0;
+				continue;
+			}
+			if (have_pending) {
+				if (end - p < residual_bytes(pending))
+					return -1;
+				p = put_residual(p, pending);
+				have_pending = 0;
+			}
+			if (is_pairable(r)) {
+				pending = r;
+				have_pending = 1;
+			} else {
+				if (end - p < residual_bytes(r))
+					return -1;
+				p = put_residual(p, r);
+			}
+		}
+		prev = row;
+	}
+	if (run) {
+		p = put_run(p, end, run);
+		if (!p)
+			return -1;
+	}
+	if (have_pending) {
+		if (end - p < residual_bytes(pending))
+			return -1;
+		p = put_residual(p, pending);
+	}
+	return (int)(p - out);
+}
+
+typedef struct {
+	int width;
+	int x;
+	uint16_t* row;
+	const uint16_t* prev;
+	size_t remaining;
+} decode_cursor;
+
+static inline int put_sample(decode_cursor* c, int32_t r)
+{
+	if (!c->remaining)
+		return -1;
+	int32_t v = predict(c->row, c->prev, c->x) + r;
+	if (v < 0 || v > 0xffff)
+		return -1;
+	c->row[c->x] = (uint16_t)v;
+	c->remaining--;
+	if (++c->x == c->width) {
+		c->x = 0;
+		c->prev = c->row;
+		c->row += c->width;
+	}
+	return 0;
+}
+
+int freenect_depth_decompress(const uint8_t* in, size_t in_size, uint16_t* depth, int width, int height)
+{
+	if (!in || !depth || !freenect_depth_compress_bound(width, height))
+		return -1;
+	if (in_size < FREENECT_DEPTH_CODEC_HEADER_SIZE)
+		return -1;
+	if (in[0] != 'F' || in[1] != 'D' || in[2] != 'Z' || in[3] != CODEC_VERSION)
+		return -1;
+	if ((in[4] | (in[5] << 8)) != width || (in[6] | (in[7] << 8)) != height)
+		return -1;
+
+	decode_cursor c;
+	c.width = width;
+	c.x = 0;
+	c.row = depth;
+	c.prev = NULL;
+	c.remaining = (size_t)width * height;
+
+	const uint8_t* p = in + FREENECT_DEPTH_CODEC_HEADER_SIZE;
+	const uint8_t* end = in + in_size;
+	while (p < end) {
+		uint8_t code = *p++;
+		int run = 0;
+		if (code < CODE_PAIR) {
+			run = (code & 0x3f) + 1;
+		} else if (code < CODE_SHORT) {
+			// Sign extend both 3 bit fields
+			int32_t a = (int32_t)((code >> 3) & 0x7) - ((code & 0x20) ? 8 : 0);
+			int32_t b = (int32_t)(code & 0x7) - ((code & 0x04) ? 8 : 0);
+			if (put_sample(&c, a) < 0 || put_sample(&c, b) < 0)
+				return -1;
+		} else if (code < CODE_MEDIUM) {
+			if (put_sample(&c, unzigzag(code & 0x3f)) < 0)
+				return -1;
+		} else if (code < CODE_LONG) {
+			if (end - p < 1)
+				return -1;
+			uint32_t z = ((uint32_t)(code & 0x1f) << 8) | p[0];
+			p += 1;
+			if (put_sample(&c, unzigzag(z)) < 0)
+				return -1;
+		} else if (code < CODE_LONG_RUN) {
+			if (end - p < 2)
+				return -1;
+			uint32_t z = ((uint32_t)(code & 0x0f) << 16) | (p[0] << 8) | p[1];
+			p += 2;
+			if (put_sample(&c, unzigzag(z)) < 0)
+				return -1;
+		} else if (code == CODE_LONG_RUN) {
+			if (end - p < 2)
+				return -1;
+			run = ((p[0] << 8) | p[1]) + 1;
+			p += 2;
+		} else {
+			return -1;
+		}
+		while (run--) {
+			if (put_sample(&c, 0) < 0)
+				return -1;
+		}
+	}
+	return c.remaining ? -1 : 0;
+}
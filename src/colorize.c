@@ -0,0 +1,155 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2011 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+#include "libfreenect.h"
+#include "libfreenect_colorize.h"
+#include "convert.h"
+#include <string.h>
+
+// Packed frames are unpacked this many samples at a time into a buffer that
+// stays in L1 cache, then looked up
+#define CHUNK_SAMPLES 512
+
+#define RAINBOW_STEPS (6*256)
+
+static void rainbow(int pval, uint8_t *c)
+{
+	int lb = pval & 0xff;
+	switch (pval >> 8) {
+		case 0:
+			c[0] = 255;
+			c[1] = 255-lb;
+			c[2] = 255-lb;
+			break;
+		case 1:
+			c[0] = 255;
+			c[1] = lb;
+			c[2] = 0;
+			break;
+		case 2:
+			c[0] = 255-lb;
+			c[1] = 255;
+			c[2] = 0;
+			break;
+		case 3:
+			c[0] = 0;
+			c[1] = 255;
+			c[2] = lb;
+			break;
+		case 4:
+			c[0] = 0;
+			c[1] = 255-lb;
+			c[2] = 255;
+			break;
+		case 5:
+			c[0] = 0;
+			c[1] = 0;
+			c[2] = 255-lb;
+			break;
+		default:
+			c[0] = 0;
+			c[1] = 0;
+			c[2] = 0;
+			break;
+	}
+	c[3] = 255;
+}
+
+void freenect_depth_palette_gamma(freenect_depth_palette *palette)
+{
+	int i;
+	for (i = 0; i < FREENECT_DEPTH_RAW_MAX_VALUE; i++) {
+		// (i / 2048)^3 * 6 * 6 * 256, without going through floats
+		uint64_t cube = (uint64_t)i * i * i;
+		rainbow((int)((cube * 6 * RAINBOW_STEPS) >> 33), palette->color[i]);
+	}
+}
+
+int freenect_depth_palette_range(freenect_depth_palette *palette, const freenect_registration *reg, int near_mm, int far_mm)
+{
+	if (!reg || !reg->raw_to_mm_shift || near_mm < 0 || far_mm <= near_mm)
+		return -1;
+
+	int i;
+	for (i = 0; i < FREENECT_DEPTH_RAW_MAX_VALUE; i++) {
+		int mm = reg->raw_to_mm_shift[i];
+		if (i == FREENECT_DEPTH_RAW_NO_VALUE || mm == FREENECT_DEPTH_MM_NO_VALUE) {
+			rainbow(RAINBOW_STEPS, palette->color[i]);
+			continue;
+		}
+		mm = mm < near_mm ? near_mm : mm > far_mm ? far_mm : mm;
+		rainbow((mm - near_mm) * (RAINBOW_STEPS - 1) / (far_mm - near_mm), palette->color[i]);
+	}
+	return 0;
+}
+
+static void lookup(const freenect_depth_palette *palette, const uint16_t *depth, int n, uint8_t *out, int channels)
+{
+	int i;
+	if (channels == 4) {
+		for (i = 0; i < n; i++) {
+			uint16_t v = depth[i] < FREENECT_DEPTH_RAW_NO_VALUE ? depth[i] : FREENECT_DEPTH_RAW_NO_VALUE;
+			memcpy(out + 4*i, palette->color[v], 4);
+		}
+	} else {
+		for (i = 0; i < n; i++) {
+			uint16_t v = depth[i] < FREENECT_DEPTH_RAW_NO_VALUE ? depth[i] : FREENECT_DEPTH_RAW_NO_VALUE;
+			out[3*i+0] = palette->color[v][0];
+			out[3*i+1] = palette->color[v][1];
+			out[3*i+2] = palette->color[v][2];
+		}
+	}
+}
+
+int freenect_colorize_depth(const freenect_depth_palette *palette, const void *depth, freenect_depth_format fmt, int width, int height, uint8_t *out, int channels)
+{
+	if (!palette || !depth || !out || width <= 0 || height <= 0 || (channels != 3 && channels != 4))
+		return -1;
+
+	int n = width * height;
+	switch (fmt) {
+		case FREENECT_DEPTH_11BIT:
+			lookup(palette, (const uint16_t*)depth, n, out, channels);
+			return 0;
+		case FREENECT_DEPTH_11BIT_PACKED: {
+			if (n % 8)
+				return -1;
+			uint16_t chunk[CHUNK_SAMPLES];
+			uint8_t *raw = (uint8_t*)depth;
+			while (n > 0) {
+				int len = n < CHUNK_SAMPLES ? n : CHUNK_SAMPLES;
+				convert_packed11_to_16bit(raw, chunk, len);
+				lookup(palette, chunk, len, out, channels);
+				raw += len * 11 / 8;
+				out += len * channels;
+				n -= len;
+			}
+			return 0;
+		}
+		default:
+			return -1;
+	}
+}
@@ -0,0 +1,439 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2011 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+#include "libfreenect.h"
+#include "convert.h"
+
+/**
+ * Convert a packed array of n elements with vw useful bits into array of
+ * zero-padded 16bit elements.
+ *
+ * @param src The source packed array, of size (n * vw / 8) bytes
+ * @param dest The destination unpacked array, of size (n * 2) bytes
+ * @param vw The virtual width of elements, that is the number of useful bits for each of them
+ * @param n The number of elements (in particular, of the destination array), NOT a length in bytes
+ */
+void convert_packed_to_16bit(uint8_t *src, uint16_t *dest, int vw, int n)
+{
+	unsigned int mask = (1 << vw) - 1;
+	uint32_t buffer = 0;
+	int bitsIn = 0;
+	while (n--) {
+		while (bitsIn < vw) {
+			buffer = (buffer << 8) | *(src++);
+			bitsIn += 8;
+		}
+		bitsIn -= vw;
+		*(dest++) = (buffer >> bitsIn) & mask;
+	}
+}
+
+/**
+ * Convert a packed array of n elements with vw useful bits into array of
+ * 8bit elements, dropping LSB.
+ *
+ * @param src The source packed array, of size (n * vw / 8) bytes
+ * @param dest The destination unpacked array, of size (n * 2) bytes
+ * @param vw The virtual width of elements, that is the number of useful bits for each of them
+ * @param n The number of elements (in particular, of the destination array), NOT a length in bytes
+ *
+ * @pre vw is expected to be >= 8.
+ */
+void convert_packed_to_8bit(uint8_t *src, uint8_t *dest, int vw, int n)
+{
+	uint32_t buffer = 0;
+	int bitsIn = 0;
+	while (n--) {
+		while (bitsIn < vw) {
+			buffer = (buffer << 8) | *(src++);
+			bitsIn += 8;
+		}
+		bitsIn -= vw;
+		*(dest++) = buffer >> (bitsIn + vw - 8);
+	}
+}
+
+// Loop-unrolled version of the 11-to-16 bit unpacker.  n must be a multiple of 8.
+void convert_packed11_to_16bit(uint8_t *raw, uint16_t *frame, int n)
+{
+	uint16_t baseMask = (1 << 11) - 1;
+	while(n >= 8)
+	{
+		uint8_t r0  = *(raw+0);
+		uint8_t r1  = *(raw+1);
+		uint8_t r2  = *(raw+2);
+		uint8_t r3  = *(raw+3);
+		uint8_t r4  = *(raw+4);
+		uint8_t r5  = *(raw+5);
+		uint8_t r6  = *(raw+6);
+		uint8_t r7  = *(raw+7);
+		uint8_t r8  = *(raw+8);
+		uint8_t r9  = *(raw+9);
+		uint8_t r10 = *(raw+10);
+
+		frame[0] =  (r0<<3)  | (r1>>5);
+		frame[1] = ((r1<<6)  | (r2>>2) )           & baseMask;
+		frame[2] = ((r2<<9)  | (r3<<1) | (r4>>7) ) & baseMask;
+		frame[3] = ((r4<<4)  | (r5>>4) )           & baseMask;
+		frame[4] = ((r5<<7)  | (r6>>1) )           & baseMask;
+		frame[5] = ((r6<<10) | (r7<<2) | (r8>>6) ) & baseMask;
+		frame[6] = ((r8<<5)  | (r9>>3) )           & baseMask;
+		frame[7] = ((r9<<8)  | (r10)   )           & baseMask;
+
+		n -= 8;
+		raw += 11;
+		frame += 8;
+	}
+}
+
+#define MAX_BIN_FACTOR 4
+#define MAX_BIN_WIDTH 640
+
+static uint16_t bin_samples(uint16_t *s, int n, freenect_depth_binning binning, uint16_t invalid)
+{
+	int i, j;
+	if (!n)
+		return invalid;
+	switch (binning) {
+		case FREENECT_DEPTH_BINNING_MEDIAN:
+			for (i = 1; i < n; i++) {
+				uint16_t v = s[i];
+				for (j = i; j > 0 && s[j-1] > v; j--)
+					s[j] = s[j-1];
+				s[j] = v;
+			}
+			return s[(n - 1) / 2];
+		case FREENECT_DEPTH_BINNING_MEAN: {
+			uint32_t sum = 0;
+			for (i = 0; i < n; i++)
+				sum += s[i];
+			return (sum + n / 2) / n;
+		}
+		default: {
+			uint16_t min = s[0];
+			for (i = 1; i < n; i++)
+				min = s[i] < min ? s[i] : min;
+			return min;
+		}
+	}
+}
+
+/**
+ * Unpack a frame of packed depth samples and bin it down by factor in both
+ * directions, a few rows at a time so the full resolution frame is never
+ * written out.
+ *
+ * @param raw The packed frame, of size (width * height * vw / 8) bytes
+ * @param frame The binned frame, of (width / factor) * (height / factor) elements
+ * @param vw The number of bits per packed sample, 10 or 11
+ * @param width Width of the packed frame, at most MAX_BIN_WIDTH
+ * @param height Height of the packed frame
+ * @param factor Bin size, at most MAX_BIN_FACTOR
+ * @param binning How the samples of a bin are combined
+ * @param invalid The value of samples without depth
+ */
+void convert_packed_to_16bit_binned(uint8_t *raw, uint16_t *frame, int vw, int width, int height, int factor, freenect_depth_binning binning, uint16_t invalid)
+{
+	uint16_t rows[MAX_BIN_FACTOR * MAX_BIN_WIDTH];
+	uint16_t samples[MAX_BIN_FACTOR * MAX_BIN_FACTOR];
+	int row_bytes = width * vw / 8;
+	int out_width = width / factor;
+	int x, y, r, c;
+
+	if (factor > MAX_BIN_FACTOR || width > MAX_BIN_WIDTH)
+		return;
+
+	for (y = 0; y < height / factor; y++) {
+		for (r = 0; r < factor; r++) {
+			if (vw == 11)
+				convert_packed11_to_16bit(raw, rows + r * width, width);
+			else
+				convert_packed_to_16bit(raw, rows + r * width, vw, width);
+			raw += row_bytes;
+		}
+		for (x = 0; x < out_width; x++) {
+			int n = 0;
+			for (r = 0; r < factor; r++) {
+				uint16_t *src = rows + r * width + x * factor;
+				for (c = 0; c < factor; c++) {
+					samples[n] = src[c];
+					n += src[c] != invalid;
+				}
+			}
+			*(frame++) = bin_samples(samples, n, binning, invalid);
+		}
+	}
+}
+
+#define CLAMP(x) if (x < 0) {x = 0;} if (x > 255) {x = 255;}
+void convert_uyvy_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode)
+{
+	int x, y;
+	for(y = 0; y < frame_mode.height; ++y) {
+		for(x = 0; x < frame_mode.width; x+=2) {
+			int i = (frame_mode.width * y + x);
+			int u  = raw_buf[2*i];
+			int y1 = raw_buf[2*i+1];
+			int v  = raw_buf[2*i+2];
+			int y2 = raw_buf[2*i+3];
+			int r1 = (y1-16)*1164/1000 + (v-128)*1596/1000;
+			int g1 = (y1-16)*1164/1000 - (v-128)*813/1000 - (u-128)*391/1000;
+			int b1 = (y1-16)*1164/1000 + (u-128)*2018/1000;
+			int r2 = (y2-16)*1164/1000 + (v-128)*1596/1000;
+			int g2 = (y2-16)*1164/1000 - (v-128)*813/1000 - (u-128)*391/1000;
+			int b2 = (y2-16)*1164/1000 + (u-128)*2018/1000;
+			CLAMP(r1)
+			CLAMP(g1)
+			CLAMP(b1)
+			CLAMP(r2)
+			CLAMP(g2)
+			CLAMP(b2)
+			proc_buf[3*i]  =r1;
+			proc_buf[3*i+1]=g1;
+			proc_buf[3*i+2]=b1;
+			proc_buf[3*i+3]=r2;
+			proc_buf[3*i+4]=g2;
+			proc_buf[3*i+5]=b2;
+		}
+	}
+}
+#undef CLAMP
+
+void convert_bayer_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode)
+{
+	int x,y;
+	/* Pixel arrangement:
+	 * G R G R G R G R
+	 * B G B G B G B G
+	 * G R G R G R G R
+	 * B G B G B G B G
+	 * G R G R G R G R
+	 * B G B G B G B G
+	 *
+	 * To convert a Bayer-pattern into RGB you have to handle four pattern
+	 * configurations:
+	 * 1)         2)         3)         4)
+	 *      B1      B1 G1 B2   R1 G1 R2      R1       <- previous line
+	 *   R1 G1 R2   G2 R1 G3   G2 B1 G3   B1 G1 B2    <- current line
+	 *      B2      B3 G4 B4   R3 G4 R4      R2       <- next line
+	 *   ^  ^  ^
+	 *   |  |  next pixel
+	 *   |  current pixel
+	 *   previous pixel
+	 *
+	 * The RGB values (r,g,b) for each configuration are calculated as
+	 * follows:
+	 *
+	 * 1) r = (R1 + R2) / 2
+	 *    g =  G1
+	 *    b = (B1 + B2) / 2
+	 *
+	 * 2) r =  R1
+	 *    g = (G1 + G2 + G3 + G4) / 4
+	 *    b = (B1 + B2 + B3 + B4) / 4
+	 *
+	 * 3) r = (R1 + R2 + R3 + R4) / 4
+	 *    g = (G1 + G2 + G3 + G4) / 4
+	 *    b =  B1
+	 *
+	 * 4) r = (R1 + R2) / 2
+	 *    g =  G1
+	 *    b = (B1 + B2) / 2
+	 *
+	 * To efficiently calculate these values, two 32bit integers are used
+	 * as "shift-buffers". One integer to store the 3 horizontal bayer pixel
+	 * values (previous, current, next) of the current line. The other
+	 * integer to store the vertical average value of the bayer pixels
+	 * (previous, current, next) of the previous and next line.
+	 *
+	 * The boundary conditions for the first and last line and the first
+	 * and last column are solved via mirroring the second and second last
+	 * line and the second and second last column.
+	 *
+	 * To reduce slow memory access, the values of a rgb pixel are packet
+	 * into a 32bit variable and transfered together.
+	 */
+
+	uint8_t *dst = proc_buf; // pointer to destination
+
+	uint8_t *prevLine;        // pointer to previous, current and next line
+	uint8_t *curLine;         // of the source bayer pattern
+	uint8_t *nextLine;
+
+	// storing horizontal values in hVals:
+	// previous << 16, current << 8, next
+	uint32_t hVals;
+	// storing vertical averages in vSums:
+	// previous << 16, current << 8, next
+	uint32_t vSums;
+
+	// init curLine and nextLine pointers
+	curLine  = raw_buf;
+	nextLine = curLine + frame_mode.width;
+	for (y = 0; y < frame_mode.height; ++y) {
+
+		if ((y > 0) && (y < frame_mode.height-1))
+			prevLine = curLine - frame_mode.width; // normal case
+		else if (y == 0)
+			prevLine = nextLine;      // top boundary case
+		else
+			nextLine = prevLine;      // bottom boundary case
+
+		// init horizontal shift-buffer with current value
+		hVals  = (*(curLine++) << 8);
+		// handle left column boundary case
+		hVals |= (*curLine << 16);
+		// init vertical average shift-buffer with current values average
+		vSums = ((*(prevLine++) + *(nextLine++)) << 7) & 0xFF00;
+		// handle left column boundary case
+		vSums |= ((*prevLine + *nextLine) << 15) & 0xFF0000;
+
+		// store if line is odd or not
+		uint8_t yOdd = y & 1;
+		// the right column boundary case is not handled inside this loop
+		// thus the "639"
+		for (x = 0; x < frame_mode.width-1; ++x) {
+			// place next value in shift buffers
+			hVals |= *(curLine++);
+			vSums |= (*(prevLine++) + *(nextLine++)) >> 1;
+
+			// calculate the horizontal sum as this sum is needed in
+			// any configuration
+			uint8_t hSum = ((uint8_t)(hVals >> 16) + (uint8_t)(hVals)) >> 1;
+
+			if (yOdd == 0) {
+				if ((x & 1) == 0) {
+					// Configuration 1
+					*(dst++) = hSum;		// r
+					*(dst++) = hVals >> 8;	// g
+					*(dst++) = vSums >> 8;	// b
+				} else {
+					// Configuration 2
+					*(dst++) = hVals >> 8;
+					*(dst++) = (hSum + (uint8_t)(vSums >> 8)) >> 1;
+					*(dst++) = ((uint8_t)(vSums >> 16) + (uint8_t)(vSums)) >> 1;
+				}
+			} else {
+				if ((x & 1) == 0) {
+					// Configuration 3
+					*(dst++) = ((uint8_t)(vSums >> 16) + (uint8_t)(vSums)) >> 1;
+					*(dst++) = (hSum + (uint8_t)(vSums >> 8)) >> 1;
+					*(dst++) = hVals >> 8;
+				} else {
+					// Configuration 4
+					*(dst++) = vSums >> 8;
+					*(dst++) = hVals >> 8;
+					*(dst++) = hSum;
+				}
+			}
+
+			// shift the shift-buffers
+			hVals <<= 8;
+			vSums <<= 8;
+		} // end of for x loop
+		// right column boundary case, mirroring second last column
+		hVals |= (uint8_t)(hVals >> 16);
+		vSums |= (uint8_t)(vSums >> 16);
+
+		// the horizontal sum simplifies to the second last column value
+		uint8_t hSum = (uint8_t)(hVals);
+
+		if (yOdd == 0) {
+			if ((x & 1) == 0) {
+				*(dst++) = hSum;
+				*(dst++) = hVals >> 8;
+				*(dst++) = vSums >> 8;
+			} else {
+				*(dst++) = hVals >> 8;
+				*(dst++) = (hSum + (uint8_t)(vSums >> 8)) >> 1;
+				*(dst++) = vSums;
+			}
+		} else {
+			if ((x & 1) == 0) {
+				*(dst++) = vSums;
+				*(dst++) = (hSum + (uint8_t)(vSums >> 8)) >> 1;
+				*(dst++) = hVals >> 8;
+			} else {
+				*(dst++) = vSums >> 8;
+				*(dst++) = hVals >> 8;
+				*(dst++) = hSum;
+			}
+		}
+
+	} // end of for y loop
+}
+
+
+/**
+ * Convert an array of n zero-padded 16bit elements into a packed array with
+ * vw useful bits per element, the layout the camera sends. This is the
+ * inverse of convert_packed_to_16bit().
+ *
+ * @param src The source unpacked array, of size (n * 2) bytes
+ * @param dest The destination packed array, of size (n * vw / 8) bytes
+ * @param vw The virtual width of elements, that is the number of useful bits for each of them
+ * @param n The number of elements (in particular, of the source array), NOT a length in bytes
+ */
+void convert_16bit_to_packed(uint16_t *src, uint8_t *dest, int vw, int n)
+{
+	unsigned int mask = (1 << vw) - 1;
+	uint32_t buffer = 0;
+	int bitsIn = 0;
+	while (n--) {
+		buffer = (buffer << vw) | (*(src++) & mask);
+		bitsIn += vw;
+		while (bitsIn >= 8) {
+			bitsIn -= 8;
+			*(dest++) = buffer >> bitsIn;
+		}
+	}
+	if (bitsIn)
+		*dest = buffer << (8 - bitsIn);
+}
+
+/**
+ * Sample an RGB image down to the camera's Bayer pattern (see
+ * convert_bayer_to_rgb() for the pixel arrangement).
+ *
+ * @param rgb The source image, of size (width * height * 3) bytes
+ * @param bayer The destination pattern, of size (width * height) bytes
+ * @param frame_mode Mode describing the dimensions of both images
+ */
+void convert_rgb_to_bayer(uint8_t *rgb, uint8_t *bayer, freenect_frame_mode frame_mode)
+{
+	int x, y;
+	for (y = 0; y < frame_mode.height; ++y) {
+		for (x = 0; x < frame_mode.width; ++x) {
+			// G R on even lines, B G on odd lines
+			int channel = 1;
+			if ((y & 1) == 0 && (x & 1) == 1)
+				channel = 0;
+			else if ((y & 1) == 1 && (x & 1) == 0)
+				channel = 2;
+			*(bayer++) = rgb[3 * (y * frame_mode.width + x) + channel];
+		}
+	}
+}
@@ -0,0 +1,39 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2011 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+#pragma once
+
+#include "libfreenect.h"
+
+// Internal pixel format conversions, shared by the camera streams and fakenect
+void convert_packed_to_16bit(uint8_t *src, uint16_t *dest, int vw, int n);
+void convert_packed_to_8bit(uint8_t *src, uint8_t *dest, int vw, int n);
+void convert_packed11_to_16bit(uint8_t *raw, uint16_t *frame, int n);
+void convert_packed_to_16bit_binned(uint8_t *raw, uint16_t *frame, int vw, int width, int height, int factor, freenect_depth_binning binning, uint16_t invalid);
+void convert_uyvy_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode);
+void convert_bayer_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode);
+void convert_16bit_to_packed(uint16_t *src, uint8_t *dest, int vw, int n);
+void convert_rgb_to_bayer(uint8_t *rgb, uint8_t *bayer, freenect_frame_mode frame_mode);
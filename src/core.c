@@ -30,10 +30,16 @@
 #include <stdarg.h>
 
 #include <unistd.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 #include "freenect_internal.h"
 #include "registration.h"
 #include "cameras.h"
+#include "flags.h"
 #include "loader.h"
 
 
@@ -49,22 +55,38 @@ FREENECTAPI int freenect_init(freenect_context **ctx, freenect_usb_context *usb_
 
 	(*ctx)->log_level = LL_NOTICE;
 	(*ctx)->enabled_subdevices = (freenect_device_flags)(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA);
+	(*ctx)->lock = fn_mutex_create();
+	if (!(*ctx)->lock) {
+		free(*ctx);
+		*ctx = NULL;
+		return -1;
+	}
 	res = fnusb_init(&(*ctx)->usb, usb_ctx);
 	if (res < 0) {
+		fn_mutex_destroy((*ctx)->lock);
 		free(*ctx);
 		*ctx = NULL;
+		return res;
 	}
+	fnusb_registry_init(*ctx);
 	return res;
 }
 
 FREENECTAPI int freenect_shutdown(freenect_context *ctx)
 {
+	if (ctx->event_thread)
+		freenect_stop_event_thread(ctx);
+
 	while (ctx->first) {
 		FN_NOTICE("Device %p open during shutdown, closing...\n", ctx->first);
 		freenect_close_device(ctx->first);
 	}
 
+	if (ctx->pollfd_added_cb || ctx->pollfd_removed_cb)
+		fnusb_set_pollfd_notifiers(ctx, 0);
+	fnusb_registry_free(ctx);
 	fnusb_shutdown(&ctx->usb);
+	fn_mutex_destroy(ctx->lock);
 	free(ctx);
 	return 0;
 }
@@ -77,12 +99,111 @@ FREENECTAPI int freenect_process_events(freenect_context *ctx)
 	return freenect_process_events_timeout(ctx, &timeout);
 }
 
+// Stop the streams of a device that dropped off the bus and release it,
+// remembering what to restart once it is back
+static void device_lost(freenect_device *dev)
+{
+	freenect_context *ctx = dev->parent;
+	reconnect_state *r = &dev->reconnect;
+
+	FN_ERROR("USB device %s lost, waiting for it to come back\n", r->serial);
+	r->depth_running = dev->depth.running;
+	r->video_running = dev->video.running;
+	r->audio_running = dev->audio.running;
+	if (dev->video.running)
+		freenect_stop_video(dev);
+	if (dev->depth.running)
+		freenect_stop_depth(dev);
+	if (dev->audio.running)
+		freenect_stop_audio(dev);
+	drain_cmds(dev);
+	fnusb_close_subdevices(dev);
+
+	r->lost = 1;
+	r->generation = fnusb_registry_generation(ctx);
+	if (r->cb)
+		r->cb(dev, FREENECT_DEVICE_LOST);
+}
+
+static int restore_device(freenect_device *dev)
+{
+	reconnect_state *r = &dev->reconnect;
+	int i;
+
+	if (r->depth_running && freenect_start_depth(dev) < 0)
+		return -1;
+	if (r->video_running && freenect_start_video(dev) < 0)
+		return -1;
+	if (r->audio_running && freenect_start_audio(dev) < 0)
+		return -1;
+	for (i = 0; i < 32; i++) {
+		uint32_t flag = (uint32_t)1 << i;
+		if ((dev->flags_on | dev->flags_off) & flag)
+			freenect_set_flag(dev, (freenect_flag)flag, (dev->flags_on & flag) ? FREENECT_ON : FREENECT_OFF);
+	}
+	if (dev->ir_brightness)
+		freenect_set_ir_brightness(dev, dev->ir_brightness);
+	return 0;
+}
+
+// Look for a lost device whenever devices came or went since the last try
+static void try_reconnect(freenect_device *dev)
+{
+	freenect_context *ctx = dev->parent;
+	reconnect_state *r = &dev->reconnect;
+
+	unsigned int generation = fnusb_registry_generation(ctx);
+	if (generation == r->generation)
+		return;
+	r->generation = generation;
+
+	dev->usb_cam.device_dead = 0;
+	dev->usb_motor.device_dead = 0;
+	dev->usb_audio.device_dead = 0;
+	if (fnusb_reopen_subdevices(dev, r->serial) < 0)
+		return;
+
+	r->lost = 0;
+	if (restore_device(dev) < 0) {
+		FN_ERROR("USB device %s came back but its streams could not be restarted\n", r->serial);
+		if (dev->video.running)
+			freenect_stop_video(dev);
+		if (dev->depth.running)
+			freenect_stop_depth(dev);
+		if (dev->audio.running)
+			freenect_stop_audio(dev);
+		drain_cmds(dev);
+		fnusb_close_subdevices(dev);
+		r->lost = 1;
+		return;
+	}
+
+	FN_NOTICE("USB device %s reconnected\n", r->serial);
+	if (r->cb)
+		r->cb(dev, FREENECT_DEVICE_RECONNECTED);
+}
+
 FREENECTAPI int freenect_process_events_timeout(freenect_context *ctx, struct timeval *timeout)
 {
 	int res = fnusb_process_events_timeout(&ctx->usb, timeout);
+	// Hotplug events are queued during event handling, so that the callback
+	// is free to open and close devices
+	freenect_hotplug_event event;
+	while (fnusb_next_hotplug_event(ctx, &event)) {
+		if (ctx->hotplug_cb)
+			ctx->hotplug_cb(ctx, event, ctx->hotplug_user);
+	}
 	// Iterate over the devices in ctx.  If any of them are flagged as
 	freenect_device* dev = ctx->first;
 	while(dev) {
+		if (dev->reconnect.enabled) {
+			if (!dev->reconnect.lost && (dev->usb_cam.device_dead || dev->usb_audio.device_dead))
+				device_lost(dev);
+			if (dev->reconnect.lost)
+				try_reconnect(dev);
+			dev = dev->next;
+			continue;
+		}
 		if (dev->usb_cam.device_dead) {
 			FN_ERROR("USB camera marked dead, stopping streams\n");
 			res = -1;
@@ -99,6 +220,24 @@ FREENECTAPI int freenect_process_events_timeout(freenect_context *ctx, struct ti
 	return res;
 }
 
+FREENECTAPI int freenect_get_pollfds(freenect_context *ctx, freenect_pollfd **fds)
+{
+	return fnusb_get_pollfds(ctx, fds);
+}
+
+FREENECTAPI void freenect_set_pollfd_notifiers(freenect_context *ctx, freenect_pollfd_added_cb added, freenect_pollfd_removed_cb removed, void *user)
+{
+	ctx->pollfd_added_cb = added;
+	ctx->pollfd_removed_cb = removed;
+	ctx->pollfd_user = user;
+	fnusb_set_pollfd_notifiers(ctx, added || removed);
+}
+
+FREENECTAPI int freenect_get_next_timeout(freenect_context *ctx, struct timeval *timeout)
+{
+	return fnusb_get_next_timeout(&ctx->usb, timeout);
+}
+
 FREENECTAPI int freenect_num_devices(freenect_context *ctx)
 {
 	return fnusb_num_devices(ctx);
@@ -109,6 +248,20 @@ FREENECTAPI int freenect_list_device_attributes(freenect_context *ctx, struct fr
 	return fnusb_list_device_attributes(ctx, attribute_list);
 }
 
+FREENECTAPI int freenect_set_hotplug_callback(freenect_context *ctx, freenect_hotplug_cb cb, void *user)
+{
+	if (!ctx->usb.hotplug)
+		return -1;
+	ctx->hotplug_cb = cb;
+	ctx->hotplug_user = user;
+	return 0;
+}
+
+FREENECTAPI int freenect_set_transfer_memory(freenect_context *ctx, freenect_transfer_memory mem)
+{
+	return fnusb_set_transfer_memory(ctx, mem);
+}
+
 FREENECTAPI void freenect_free_device_attributes(struct freenect_device_attributes *attribute_list)
 {
 	// Iterate over list, freeing contents of each item as we go.
@@ -140,23 +293,39 @@ FREENECTAPI freenect_device_flags freenect_enabled_subdevices(freenect_context *
 	return ctx->enabled_subdevices;
 }
 
-FREENECTAPI int freenect_open_device(freenect_context *ctx, freenect_device **dev, int index)
+static freenect_device *alloc_device(freenect_context *ctx)
 {
-	int res;
 	freenect_device *pdev = (freenect_device*)malloc(sizeof(freenect_device));
 	if (!pdev)
-		return -1;
+		return NULL;
 
 	memset(pdev, 0, sizeof(*pdev));
 
 	pdev->parent = ctx;
-
-	res = fnusb_open_subdevices(pdev, index);
-	if (res < 0) {
+	pdev->lock = fn_mutex_create();
+	pdev->motor_lock = fn_mutex_create();
+	pdev->cmd_lock = fn_mutex_create();
+	if (!pdev->lock || !pdev->motor_lock || !pdev->cmd_lock) {
+		fn_mutex_destroy(pdev->lock);
+		fn_mutex_destroy(pdev->motor_lock);
+		fn_mutex_destroy(pdev->cmd_lock);
 		free(pdev);
-		return res;
+		return NULL;
 	}
+	return pdev;
+}
+
+static void free_device(freenect_device *pdev)
+{
+	fn_mutex_destroy(pdev->lock);
+	fn_mutex_destroy(pdev->motor_lock);
+	fn_mutex_destroy(pdev->cmd_lock);
+	free(pdev);
+}
 
+static void append_device(freenect_context *ctx, freenect_device *pdev)
+{
+	fn_mutex_lock(ctx->lock);
 	if (!ctx->first) {
 		ctx->first = pdev;
 	} else {
@@ -165,6 +334,23 @@ FREENECTAPI int freenect_open_device(freenect_context *ctx, freenect_device **de
 			prev = prev->next;
 		prev->next = pdev;
 	}
+	fn_mutex_unlock(ctx->lock);
+}
+
+FREENECTAPI int freenect_open_device(freenect_context *ctx, freenect_device **dev, int index)
+{
+	int res;
+	freenect_device *pdev = alloc_device(ctx);
+	if (!pdev)
+		return -1;
+
+	res = fnusb_open_subdevices(pdev, index);
+	if (res < 0) {
+		free_device(pdev);
+		return res;
+	}
+
+	append_device(ctx, pdev);
 
 	*dev = pdev;
 
@@ -178,6 +364,141 @@ FREENECTAPI int freenect_open_device(freenect_context *ctx, freenect_device **de
 	return 0;
 }
 
+typedef struct {
+	freenect_device *dev;
+	char *audio_serial;
+	int res;
+#ifdef _WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+	int threaded;
+} open_job;
+
+// The part of opening a device that only touches the device itself and may
+// take a while, so it can run for several devices at once
+static void finish_open(open_job *job)
+{
+	job->res = 0;
+	if (job->audio_serial)
+		job->res = fnusb_wait_audio_firmware(job->dev, job->audio_serial);
+	if (job->res >= 0 && job->dev->usb_cam.dev)
+		job->res = freenect_camera_init(job->dev);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI open_worker(LPVOID arg)
+{
+	finish_open((open_job*)arg);
+	return 0;
+}
+#else
+static void *open_worker(void *arg)
+{
+	finish_open((open_job*)arg);
+	return NULL;
+}
+#endif
+
+FREENECTAPI int freenect_open_devices(freenect_context *ctx, freenect_device **devs, const int *indexes, int count)
+{
+	int i, res, opened = 0;
+	if (!devs || count <= 0)
+		return -1;
+
+	open_job *jobs = (open_job*)calloc(count, sizeof(open_job));
+	if (!jobs)
+		return -1;
+
+	// Claiming the subdevices reads and updates context state, so it is
+	// done one device at a time from a single device list.
+	libusb_device **list;
+	ssize_t list_count = fnusb_get_device_list(ctx, &list);
+	if (list_count < 0) {
+		free(jobs);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		int index = indexes ? indexes[i] : i;
+		devs[i] = NULL;
+
+		freenect_device *pdev = alloc_device(ctx);
+		if (!pdev)
+			continue;
+
+		res = fnusb_open_listed_subdevices(pdev, index, list, list_count, &jobs[i].audio_serial);
+		if (res < 0) {
+			FN_ERROR("freenect_open_devices: Failed to open device %d\n", index);
+			free_device(pdev);
+			continue;
+		}
+		append_device(ctx, pdev);
+		jobs[i].dev = pdev;
+	}
+	fnusb_free_device_list(list);
+
+	for (i = 0; i < count; i++) {
+		if (!jobs[i].dev)
+			continue;
+#ifdef _WIN32
+		jobs[i].thread = CreateThread(NULL, 0, open_worker, &jobs[i], 0, NULL);
+		jobs[i].threaded = jobs[i].thread != NULL;
+#else
+		jobs[i].threaded = pthread_create(&jobs[i].thread, NULL, open_worker, &jobs[i]) == 0;
+#endif
+		if (!jobs[i].threaded)
+			finish_open(&jobs[i]);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!jobs[i].dev)
+			continue;
+		if (jobs[i].threaded) {
+#ifdef _WIN32
+			WaitForSingleObject(jobs[i].thread, INFINITE);
+			CloseHandle(jobs[i].thread);
+#else
+			pthread_join(jobs[i].thread, NULL);
+#endif
+		}
+		if (jobs[i].res < 0) {
+			FN_ERROR("freenect_open_devices: Failed to initialize device %d\n", indexes ? indexes[i] : i);
+			freenect_close_device(jobs[i].dev);
+			continue;
+		}
+		devs[i] = jobs[i].dev;
+		opened++;
+	}
+
+	free(jobs);
+	return opened;
+}
+
+FREENECTAPI int freenect_set_auto_reconnect(freenect_device *dev, int enable, freenect_device_state_cb cb)
+{
+	freenect_context *ctx = dev->parent;
+	reconnect_state *r = &dev->reconnect;
+
+	if (!enable) {
+		r->enabled = 0;
+		r->cb = NULL;
+		return 0;
+	}
+
+	if (!r->serial) {
+		char serial[256];
+		if (fnusb_camera_serial(dev, serial) < 0) {
+			FN_ERROR("freenect_set_auto_reconnect: Couldn't read the camera serial\n");
+			return -1;
+		}
+		r->serial = strdup(serial);
+	}
+	r->enabled = 1;
+	r->cb = cb;
+	return 0;
+}
+
 FREENECTAPI int freenect_open_device_by_camera_serial(freenect_context *ctx, freenect_device **dev, const char* camera_serial)
 {
 	// This is implemented by listing the devices and seeing which index (if
@@ -209,6 +530,7 @@ FREENECTAPI int freenect_close_device(freenect_device *dev)
 
 	if (dev->usb_cam.dev) {
 		freenect_camera_teardown(dev);
+		drain_cmds(dev);
 	}
 
 	res = fnusb_close_subdevices(dev);
@@ -216,7 +538,9 @@ FREENECTAPI int freenect_close_device(freenect_device *dev)
 		FN_ERROR("fnusb_close_subdevices failed: %d\n", res);
 		return res;
 	}
+	free(dev->reconnect.serial);
 
+	fn_mutex_lock(ctx->lock);
 	freenect_device *last = NULL;
 	freenect_device *cur = ctx->first;
 
@@ -226,6 +550,7 @@ FREENECTAPI int freenect_close_device(freenect_device *dev)
 	}
 
 	if (!cur) {
+		fn_mutex_unlock(ctx->lock);
 		FN_ERROR("device %p not found in linked list for this context!\n", dev);
 		return -1;
 	}
@@ -234,8 +559,9 @@ FREENECTAPI int freenect_close_device(freenect_device *dev)
 		last->next = cur->next;
 	else
 		ctx->first = cur->next;
+	fn_mutex_unlock(ctx->lock);
 
-	free(dev);
+	free_device(dev);
 	return 0;
 }
 
@@ -0,0 +1,226 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2011 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // CPU_SET and sched_setaffinity()
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+#include "freenect_internal.h"
+
+struct _fn_event_thread {
+	freenect_context *ctx;
+	volatile int stop;
+#ifdef _WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+};
+
+// Defaults for contexts that never had freenect_set_event_thread_params()
+static void params_from_env(freenect_thread_params *params)
+{
+	const char *var;
+
+	memset(params, 0, sizeof(*params));
+	if ((var = getenv("LIBFREENECT_EVENT_CPUS")) != NULL)
+		params->cpu_mask = strtoull(var, NULL, 0);
+	if ((var = getenv("LIBFREENECT_EVENT_PRIORITY")) != NULL)
+		params->rt_priority = atoi(var);
+	if ((var = getenv("LIBFREENECT_EVENT_MLOCK")) != NULL)
+		params->lock_memory = atoi(var);
+}
+
+static void get_params(freenect_context *ctx, freenect_thread_params *params)
+{
+	fn_mutex_lock(ctx->lock);
+	if (!ctx->event_params_set) {
+		params_from_env(&ctx->event_params);
+		ctx->event_params_set = 1;
+	}
+	*params = ctx->event_params;
+	fn_mutex_unlock(ctx->lock);
+}
+
+FREENECTAPI void freenect_set_event_thread_params(freenect_context *ctx, const freenect_thread_params *params)
+{
+	fn_mutex_lock(ctx->lock);
+	if (params)
+		ctx->event_params = *params;
+	else
+		memset(&ctx->event_params, 0, sizeof(ctx->event_params));
+	ctx->event_params_set = 1;
+	fn_mutex_unlock(ctx->lock);
+}
+
+FREENECTAPI int freenect_apply_event_thread_params(freenect_context *ctx)
+{
+	freenect_thread_params params;
+	int ret = 0;
+
+	get_params(ctx, &params);
+
+#ifdef _WIN32
+	if (params.cpu_mask) {
+		if (!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)params.cpu_mask)) {
+			FN_WARNING("Failed to set event thread affinity to %llx: error %lu\n", (unsigned long long)params.cpu_mask, GetLastError());
+			ret = -1;
+		}
+	}
+	if (params.rt_priority > 0) {
+		if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+			FN_WARNING("Failed to raise event thread priority: error %lu\n", GetLastError());
+			ret = -1;
+		}
+	}
+	if (params.lock_memory) {
+		FN_WARNING("Locking memory is not supported on this platform\n");
+		ret = -1;
+	}
+#else
+	if (params.cpu_mask) {
+#ifdef __linux__
+		cpu_set_t cpus;
+		int i;
+		CPU_ZERO(&cpus);
+		for (i = 0; i < 64 && i < CPU_SETSIZE; i++) {
+			if (params.cpu_mask & ((uint64_t)1 << i))
+				CPU_SET(i, &cpus);
+		}
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+			FN_WARNING("Failed to set event thread affinity to %llx\n", (unsigned long long)params.cpu_mask);
+			ret = -1;
+		}
+#else
+		FN_WARNING("Setting thread affinity is not supported on this platform\n");
+		ret = -1;
+#endif
+	}
+	if (params.rt_priority > 0) {
+		struct sched_param sp;
+		int min = sched_get_priority_min(SCHED_FIFO);
+		int max = sched_get_priority_max(SCHED_FIFO);
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = params.rt_priority < min ? min : params.rt_priority > max ? max : params.rt_priority;
+		int res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (res != 0) {
+			FN_WARNING("Failed to set SCHED_FIFO priority %d for the event thread: %s\n", sp.sched_priority, strerror(res));
+			ret = -1;
+		}
+	}
+	if (params.lock_memory) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+			FN_WARNING("Failed to lock process memory\n");
+			ret = -1;
+		}
+	}
+#endif
+	return ret;
+}
+
+static void run_events(fn_event_thread *thread)
+{
+	freenect_context *ctx = thread->ctx;
+
+	freenect_apply_event_thread_params(ctx);
+	while (!thread->stop) {
+		// Short enough that stopping the thread does not hang around
+		struct timeval timeout = { 0, 100000 };
+		int res = freenect_process_events_timeout(ctx, &timeout);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			FN_ERROR("Event thread stopping after error %d\n", res);
+			break;
+		}
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI event_thread(LPVOID arg)
+{
+	run_events((fn_event_thread*)arg);
+	return 0;
+}
+#else
+static void *event_thread(void *arg)
+{
+	run_events((fn_event_thread*)arg);
+	return NULL;
+}
+#endif
+
+FREENECTAPI int freenect_start_event_thread(freenect_context *ctx)
+{
+	if (ctx->event_thread) {
+		FN_ERROR("Event thread already running\n");
+		return -1;
+	}
+
+	fn_event_thread *thread = (fn_event_thread*)malloc(sizeof(fn_event_thread));
+	if (!thread)
+		return -1;
+	thread->ctx = ctx;
+	thread->stop = 0;
+#ifdef _WIN32
+	thread->thread = CreateThread(NULL, 0, event_thread, thread, 0, NULL);
+	if (thread->thread == NULL) {
+#else
+	if (pthread_create(&thread->thread, NULL, event_thread, thread) != 0) {
+#endif
+		FN_ERROR("Failed to create event thread\n");
+		free(thread);
+		return -1;
+	}
+	ctx->event_thread = thread;
+	return 0;
+}
+
+FREENECTAPI int freenect_stop_event_thread(freenect_context *ctx)
+{
+	fn_event_thread *thread = ctx->event_thread;
+	if (!thread)
+		return -1;
+
+	thread->stop = 1;
+#ifdef _WIN32
+	WaitForSingleObject(thread->thread, INFINITE);
+	CloseHandle(thread->thread);
+#else
+	pthread_join(thread->thread, NULL);
+#endif
+	ctx->event_thread = NULL;
+	free(thread);
+	return 0;
+}
@@ -0,0 +1,399 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2011 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "freenect_internal.h"
+#include "filter.h"
+
+/*
+ * Depth filter: each pixel keeps its filtered depth and the number of frames since it last
+ * had a valid sample, 3 bytes in total.
+ *
+ * Background model: while learning, each pixel accumulates the sum, count
+ * and range of its valid samples. Once learned these collapse into a single
+ * limit per pixel, so classifying a frame is one compare per pixel.
+ *
+ * The per-pixel loops are the SIMD passes: they take non-aliasing pointers
+ * and only use selects the vectorizer can turn into masks, and this file is
+ * built with -ftree-vectorize (see src/CMakeLists.txt). Check with
+ * -fopt-info-vec after changing them.
+ */
+
+static int depth_format_info(freenect_depth_format fmt, uint16_t *invalid, int *threshold)
+{
+	switch (fmt) {
+		case FREENECT_DEPTH_11BIT:
+			*invalid = FREENECT_DEPTH_RAW_NO_VALUE;
+			*threshold = 12;
+			return 0;
+		case FREENECT_DEPTH_10BIT:
+			*invalid = 1023; // All ones, like FREENECT_DEPTH_RAW_NO_VALUE
+			*threshold = 6;
+			return 0;
+		case FREENECT_DEPTH_MM:
+		case FREENECT_DEPTH_REGISTERED:
+			*invalid = FREENECT_DEPTH_MM_NO_VALUE;
+			*threshold = 40;
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+static void temporal_filter(uint16_t *__restrict frame, uint16_t *__restrict value,
+                            uint8_t *__restrict age, int n,
+                            uint16_t invalid, int alpha, int threshold, int hold)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		int x = frame[i];
+		int f = value[i];
+		int a = age[i];
+		int diff = x > f ? x - f : f - x;
+		int x_valid = x != invalid;
+		int jump = f == invalid || diff > threshold;
+		int blended = (f * (256 - alpha) + x * alpha + 128) >> 8;
+		int held = a < hold ? f : invalid;
+		int out = x_valid ? (jump ? x : blended) : held;
+		value[i] = out;
+		age[i] = x_valid ? 0 : (a < 255 ? a + 1 : 255);
+		frame[i] = out;
+	}
+}
+
+static void fill_holes(uint16_t *frame, int width, int height, uint16_t invalid, int max_width)
+{
+	int y;
+	for (y = 0; y < height; y++) {
+		uint16_t *row = frame + y * width;
+		int x = 0;
+		while (x < width) {
+			if (row[x] != invalid) {
+				x++;
+				continue;
+			}
+			int start = x;
+			while (x < width && row[x] == invalid)
+				x++;
+			if (x - start > max_width)
+				continue;
+			uint16_t left = start > 0 ? row[start-1] : invalid;
+			uint16_t right = x < width ? row[x] : invalid;
+			uint16_t fill;
+			if (left == invalid)
+				fill = right;
+			else if (right == invalid)
+				fill = left;
+			else
+				// Holes mostly come from shadows behind foreground objects
+				fill = left > right ? left : right;
+			if (fill == invalid)
+				continue;
+			int i;
+			for (i = start; i < x; i++)
+				row[i] = fill;
+		}
+	}
+}
+
+static void free_state(depth_filter_state *state)
+{
+	free(state->value);
+	free(state->age);
+	state->value = NULL;
+	state->age = NULL;
+	state->pixels = 0;
+}
+
+static int alloc_state(freenect_context *ctx, depth_filter_state *state, int pixels, uint16_t invalid)
+{
+	free_state(state);
+	state->value = (uint16_t*)malloc(pixels * sizeof(uint16_t));
+	state->age = (uint8_t*)malloc(pixels);
+	if (!state->value || !state->age) {
+		FN_ERROR("Failed to allocate depth filter state\n");
+		free_state(state);
+		return -1;
+	}
+	int i;
+	for (i = 0; i < pixels; i++)
+		state->value[i] = invalid;
+	memset(state->age, 0xff, pixels);
+	state->pixels = pixels;
+	return 0;
+}
+
+void freenect_reset_depth_filter(freenect_device *dev)
+{
+	free_state(&dev->depth_filter);
+}
+
+void freenect_apply_depth_filter(freenect_device *dev, uint16_t *frame)
+{
+	freenect_context *ctx = dev->parent;
+	depth_filter_state *state = &dev->depth_filter;
+	uint16_t invalid;
+	int threshold;
+
+	if (!state->enabled)
+		return;
+	if (depth_format_info(dev->depth_format, &invalid, &threshold) < 0)
+		return;
+
+	freenect_frame_mode mode = freenect_get_current_depth_mode(dev);
+	int pixels = mode.width * mode.height;
+	if (state->pixels != pixels && alloc_state(ctx, state, pixels, invalid) < 0)
+		return;
+
+	const freenect_depth_filter *p = &state->params;
+	if (p->temporal_threshold)
+		threshold = p->temporal_threshold;
+	temporal_filter(frame, state->value, state->age, pixels, invalid,
+	                p->temporal_alpha, threshold, p->hold_frames);
+	if (p->max_hole_width)
+		fill_holes(frame, mode.width, mode.height, invalid, p->max_hole_width);
+}
+
+freenect_depth_filter freenect_default_depth_filter(void)
+{
+	freenect_depth_filter filter;
+	filter.temporal_alpha = 96;
+	filter.temporal_threshold = 0;
+	filter.hold_frames = 2;
+	filter.max_hole_width = 8;
+	return filter;
+}
+
+int freenect_set_depth_filter(freenect_device *dev, const freenect_depth_filter *filter)
+{
+	freenect_context *ctx = dev->parent;
+	depth_filter_state *state = &dev->depth_filter;
+
+	if (filter) {
+		if (filter->temporal_alpha < 1 || filter->temporal_alpha > 256 ||
+		    filter->temporal_threshold < 0 ||
+		    filter->hold_frames < 0 || filter->hold_frames > 255 ||
+		    filter->max_hole_width < 0) {
+			FN_ERROR("Invalid depth filter settings\n");
+			return -1;
+		}
+	}
+	fn_mutex_lock(dev->lock);
+	if (filter)
+		state->params = *filter;
+	state->enabled = filter != NULL;
+	free_state(state);
+	fn_mutex_unlock(dev->lock);
+	return 0;
+}
+
+static void free_background(background_model_state *state)
+{
+	free(state->sum);
+	free(state->count);
+	free(state->min);
+	free(state->max);
+	free(state->limit);
+	free(state->mask);
+	state->sum = NULL;
+	state->count = NULL;
+	state->min = NULL;
+	state->max = NULL;
+	state->limit = NULL;
+	state->mask = NULL;
+	state->pixels = 0;
+	state->learned = 0;
+	state->have_mask = 0;
+}
+
+static void free_learning(background_model_state *state)
+{
+	free(state->sum);
+	free(state->count);
+	free(state->min);
+	free(state->max);
+	state->sum = NULL;
+	state->count = NULL;
+	state->min = NULL;
+	state->max = NULL;
+}
+
+static int alloc_background(freenect_context *ctx, background_model_state *state, int pixels)
+{
+	free_background(state);
+	state->sum = (uint32_t*)calloc(pixels, sizeof(uint32_t));
+	state->count = (uint16_t*)calloc(pixels, sizeof(uint16_t));
+	state->min = (uint16_t*)malloc(pixels * sizeof(uint16_t));
+	state->max = (uint16_t*)calloc(pixels, sizeof(uint16_t));
+	state->limit = (uint16_t*)malloc(pixels * sizeof(uint16_t));
+	state->mask = (uint8_t*)malloc(pixels);
+	if (!state->sum || !state->count || !state->min || !state->max || !state->limit || !state->mask) {
+		FN_ERROR("Failed to allocate background model\n");
+		free_background(state);
+		return -1;
+	}
+	memset(state->min, 0xff, pixels * sizeof(uint16_t));
+	state->pixels = pixels;
+	return 0;
+}
+
+static void learn_background(uint32_t *__restrict sum, uint16_t *__restrict count,
+                             uint16_t *__restrict min, uint16_t *__restrict max,
+                             const uint16_t *__restrict frame, int n, uint16_t invalid)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		uint16_t x = frame[i];
+		uint16_t valid = x != invalid;
+		uint16_t lo = min[i];
+		uint16_t hi = max[i];
+		sum[i] += x & -(uint32_t)valid;
+		count[i] += valid;
+		min[i] = valid && x < lo ? x : lo;
+		max[i] = valid && x > hi ? x : hi;
+	}
+}
+
+static void finish_background(background_model_state *state, int threshold)
+{
+	int i;
+	for (i = 0; i < state->pixels; i++) {
+		int count = state->count[i];
+		if (!count) {
+			// Nothing was seen here, so anything that shows up is foreground
+			state->limit[i] = 0xffff;
+			continue;
+		}
+		int mean = (state->sum[i] + count / 2) / count;
+		int spread = state->max[i] - state->min[i];
+		int limit = mean - (spread > threshold ? spread : threshold);
+		state->limit[i] = limit > 0 ? limit : 0;
+	}
+	free_learning(state);
+}
+
+static void classify_8bit(const uint16_t *__restrict frame, const uint16_t *__restrict limit,
+                          uint8_t *__restrict mask, int n, uint16_t invalid)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		mask[i] = -(uint8_t)((frame[i] != invalid) & (frame[i] < limit[i]));
+}
+
+// Spelled out per bit: an inner loop over the bits is not vectorized
+#define FOREGROUND_BIT(b) (((f[b] != invalid) & (f[b] < l[b])) << (7 - (b)))
+
+static void classify_1bit(const uint16_t *__restrict frame, const uint16_t *__restrict limit,
+                          uint8_t *__restrict mask, int n, uint16_t invalid)
+{
+	int i;
+	for (i = 0; i < n / 8; i++) {
+		const uint16_t *f = frame + i * 8;
+		const uint16_t *l = limit + i * 8;
+		mask[i] = FOREGROUND_BIT(0) | FOREGROUND_BIT(1) | FOREGROUND_BIT(2) | FOREGROUND_BIT(3) |
+		          FOREGROUND_BIT(4) | FOREGROUND_BIT(5) | FOREGROUND_BIT(6) | FOREGROUND_BIT(7);
+	}
+}
+
+#undef FOREGROUND_BIT
+
+void freenect_reset_background_model(freenect_device *dev)
+{
+	free_background(&dev->background);
+}
+
+void freenect_apply_background_model(freenect_device *dev, const uint16_t *frame)
+{
+	freenect_context *ctx = dev->parent;
+	background_model_state *state = &dev->background;
+	uint16_t invalid;
+	int threshold;
+
+	state->have_mask = 0;
+	if (!state->enabled)
+		return;
+	if (depth_format_info(dev->depth_format, &invalid, &threshold) < 0)
+		return;
+
+	freenect_frame_mode mode = freenect_get_current_depth_mode(dev);
+	int pixels = mode.width * mode.height;
+	if (state->pixels != pixels && alloc_background(ctx, state, pixels) < 0)
+		return;
+
+	const freenect_background_model *p = &state->params;
+	if (state->learned < p->learn_frames) {
+		learn_background(state->sum, state->count, state->min, state->max, frame, pixels, invalid);
+		if (++state->learned < p->learn_frames)
+			return;
+		finish_background(state, p->threshold ? p->threshold : threshold);
+	}
+
+	if (p->mask_format == FREENECT_MASK_1BIT)
+		classify_1bit(frame, state->limit, state->mask, pixels, invalid);
+	else
+		classify_8bit(frame, state->limit, state->mask, pixels, invalid);
+	state->have_mask = 1;
+}
+
+int freenect_set_background_model(freenect_device *dev, const freenect_background_model *model)
+{
+	freenect_context *ctx = dev->parent;
+	background_model_state *state = &dev->background;
+
+	if (model) {
+		if (model->learn_frames < 1 || model->learn_frames > 0xffff ||
+		    model->threshold < 0 ||
+		    (model->mask_format != FREENECT_MASK_8BIT && model->mask_format != FREENECT_MASK_1BIT)) {
+			FN_ERROR("Invalid background model settings\n");
+			return -1;
+		}
+	}
+	fn_mutex_lock(dev->lock);
+	if (model)
+		state->params = *model;
+	state->enabled = model != NULL;
+	free_background(state);
+	fn_mutex_unlock(dev->lock);
+	return 0;
+}
+
+int freenect_get_foreground_mask(freenect_device *dev, const uint8_t **mask)
+{
+	background_model_state *state = &dev->background;
+	uint16_t invalid;
+	int threshold;
+
+	*mask = NULL;
+	if (!state->enabled || depth_format_info(dev->depth_format, &invalid, &threshold) < 0)
+		return -1;
+	if (state->learned < state->params.learn_frames)
+		return state->params.learn_frames - state->learned;
+	if (!state->have_mask)
+		return -1;
+	*mask = state->mask;
+	return 0;
+}
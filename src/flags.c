@@ -24,6 +24,7 @@
  * either License.
  */
 
+#include <stdlib.h>
 #include <string.h> // for memcpy
 #include <unistd.h> // for usleep
 #include "freenect_internal.h"
@@ -43,7 +44,7 @@ FN_INTERNAL int register_for_flag(int flag)
     }
 }
 
-int freenect_set_flag(freenect_device *dev, freenect_flag flag, freenect_flag_value value)
+static int set_flag(freenect_device *dev, freenect_flag flag, freenect_flag_value value)
 {
 	freenect_context *ctx = dev->parent;
 
@@ -93,6 +94,22 @@ int freenect_set_flag(freenect_device *dev, freenect_flag flag, freenect_flag_va
 	return write_cmos_register(dev, 0x0106, cmos_value);
 }
 
+int freenect_set_flag(freenect_device *dev, freenect_flag flag, freenect_flag_value value)
+{
+	int res = set_flag(dev, flag, value);
+	if (res >= 0) {
+		// Remember the setting so it can be restored after a reconnect
+		if (value == FREENECT_ON) {
+			dev->flags_on |= flag;
+			dev->flags_off &= ~flag;
+		} else {
+			dev->flags_off |= flag;
+			dev->flags_on &= ~flag;
+		}
+	}
+	return res;
+}
+
 int freenect_get_exposure(freenect_device *dev, int *time_us)
 {
 	freenect_context *ctx = dev->parent;
@@ -177,6 +194,10 @@ int freenect_set_ir_brightness(freenect_device *dev, uint16_t brightness)
 	{
 		FN_WARNING("Failed to set IR brightness");
 	}
+	else
+	{
+		dev->ir_brightness = brightness;
+	}
 
 	return ret;
 }
@@ -188,74 +209,262 @@ typedef struct {
 	uint16_t tag;
 } cam_hdr;
 
-FN_INTERNAL int send_cmd(freenect_device *dev, uint16_t cmd, void *cmdbuf, unsigned int cmd_len, void *replybuf, int reply_len)
-{
-	freenect_context *ctx = dev->parent;
-	int res, actual_len;
+/*
+ * Camera commands are queued per device and driven from the libusb event
+ * loop: the command goes out in one control transfer, then the reply is
+ * polled with control reads that are resubmitted from their completion
+ * callbacks until the camera has an answer. The camera handles one command
+ * at a time, so the next queued command is only sent once the reply to the
+ * previous one has arrived. Nothing sleeps; a thread that wants a reply
+ * handles events until it is there.
+ */
+
+// Give up on a command after this many empty replies
+#define MAX_REPLY_POLLS 10000
+
+struct _cam_cmd {
+	cam_cmd *next;
+	freenect_device *dev;
+	fn_cmd_cb cb;
+	void *user;
+	int polls;
+	unsigned int len;
 	uint8_t obuf[0x400];
-	uint8_t ibuf[0x200];
-	cam_hdr *chdr = (cam_hdr*)obuf;
-	cam_hdr *rhdr = (cam_hdr*)ibuf;
+};
 
-	if (cmd_len & 1 || cmd_len > (0x400 - sizeof(*chdr))) {
-		FN_ERROR("send_cmd: Invalid command length (0x%x)\n", cmd_len);
-		return -1;
+static void cmd_issue(cam_cmd *c);
+static void cmd_wait_done(freenect_device *dev, int res, void *reply, void *user);
+
+static void cmd_finish(cam_cmd *c, int res, uint8_t *reply)
+{
+	freenect_device *dev = c->dev;
+
+	fn_mutex_lock(dev->cmd_lock);
+	dev->cmd_head = c->next;
+	if (!dev->cmd_head)
+		dev->cmd_tail = NULL;
+	cam_cmd *next = dev->cmd_head;
+	fn_cmd_cb cb = c->cb;
+	// A send_cmd() that gave up waiting checks for completion under the
+	// lock, so its reply is stored before the lock is released
+	if (cb == cmd_wait_done) {
+		cb(dev, res, reply, c->user);
+		cb = NULL;
 	}
+	fn_mutex_unlock(dev->cmd_lock);
 
-	chdr->magic[0] = 0x47;
-	chdr->magic[1] = 0x4d;
-	chdr->cmd = fn_le16(cmd);
-	chdr->tag = fn_le16(dev->cam_tag);
-	chdr->len = fn_le16(cmd_len / 2);
+	if (cb)
+		cb(dev, res, reply, c->user);
+	free(c);
+	if (next)
+		cmd_issue(next);
+}
 
-	memcpy(obuf+sizeof(*chdr), cmdbuf, cmd_len);
+static void cmd_reply_done(fnusb_dev *usb, int res, uint8_t *data, void *user);
 
-	res = fnusb_control(&dev->usb_cam, 0x40, 0, 0, 0, obuf, cmd_len + sizeof(*chdr));
-	FN_SPEW("send_cmd: cmd=%04x tag=%04x len=%04x: %d\n", cmd, dev->cam_tag, cmd_len, res);
+static void cmd_poll(cam_cmd *c)
+{
+	int res = fnusb_control_async(&c->dev->usb_cam, 0xc0, 0, 0, 0, NULL, 0x200, cmd_reply_done, c);
 	if (res < 0) {
-		FN_ERROR("send_cmd: Output control transfer failed (%d)\n", res);
-		return res;
+		freenect_context *ctx = c->dev->parent;
+		FN_ERROR("send_cmd: Input control transfer failed (%d)\n", res);
+		cmd_finish(c, res, NULL);
 	}
+}
 
-	do {
-		actual_len = fnusb_control(&dev->usb_cam, 0xc0, 0, 0, 0, ibuf, 0x200);
-		FN_FLOOD("send_cmd: actual length = %d\n", actual_len);
-		usleep(1);
-	} while ((actual_len == 0) || (actual_len == 0x200));
+static void cmd_reply_done(fnusb_dev *usb, int res, uint8_t *data, void *user)
+{
+	cam_cmd *c = (cam_cmd*)user;
+	freenect_device *dev = c->dev;
+	freenect_context *ctx = dev->parent;
+	cam_hdr *chdr = (cam_hdr*)c->obuf;
+	cam_hdr *rhdr = (cam_hdr*)data;
+	int actual_len = res;
+
+	FN_FLOOD("send_cmd: actual length = %d\n", actual_len);
+	if (actual_len == 0 || actual_len == 0x200) {
+		// No reply yet
+		if (++c->polls < MAX_REPLY_POLLS) {
+			cmd_poll(c);
+			return;
+		}
+		FN_ERROR("send_cmd: No reply to cmd %04x\n", fn_le16(chdr->cmd));
+		cmd_finish(c, -1, NULL);
+		return;
+	}
 	FN_SPEW("Control reply: %d\n", res);
 	if (actual_len < (int)sizeof(*rhdr)) {
 		FN_ERROR("send_cmd: Input control transfer failed (%d)\n", res);
-		return res;
+		cmd_finish(c, res < 0 ? res : -1, NULL);
+		return;
 	}
 	actual_len -= sizeof(*rhdr);
 
 	if (rhdr->magic[0] != 0x52 || rhdr->magic[1] != 0x42) {
 		FN_ERROR("send_cmd: Bad magic %02x %02x\n", rhdr->magic[0], rhdr->magic[1]);
-		return -1;
+		cmd_finish(c, -1, NULL);
+		return;
 	}
 	if (rhdr->cmd != chdr->cmd) {
 		FN_ERROR("send_cmd: Bad cmd %02x != %02x\n", rhdr->cmd, chdr->cmd);
-		return -1;
+		cmd_finish(c, -1, NULL);
+		return;
 	}
 	if (rhdr->tag != chdr->tag) {
 		FN_ERROR("send_cmd: Bad tag %04x != %04x\n", rhdr->tag, chdr->tag);
-		return -1;
+		cmd_finish(c, -1, NULL);
+		return;
 	}
 	if (fn_le16(rhdr->len) != (actual_len/2)) {
 		FN_ERROR("send_cmd: Bad len %04x != %04x\n", fn_le16(rhdr->len), (int)(actual_len/2));
-		return -1;
+		cmd_finish(c, -1, NULL);
+		return;
 	}
 
-	if (actual_len > reply_len) {
-		FN_WARNING("send_cmd: Data buffer is %d bytes long, but got %d bytes\n", reply_len, actual_len);
-		memcpy(replybuf, ibuf+sizeof(*rhdr), reply_len);
-	} else {
-		memcpy(replybuf, ibuf+sizeof(*rhdr), actual_len);
+	dev->cam_tag++;
+	cmd_finish(c, actual_len, data + sizeof(*rhdr));
+}
+
+static void cmd_sent(fnusb_dev *usb, int res, uint8_t *data, void *user)
+{
+	cam_cmd *c = (cam_cmd*)user;
+	freenect_context *ctx = c->dev->parent;
+	cam_hdr *chdr = (cam_hdr*)c->obuf;
+
+	FN_SPEW("send_cmd: cmd=%04x tag=%04x len=%04x: %d\n", fn_le16(chdr->cmd), fn_le16(chdr->tag), c->len, res);
+	if (res < 0) {
+		FN_ERROR("send_cmd: Output control transfer failed (%d)\n", res);
+		cmd_finish(c, res, NULL);
+		return;
 	}
+	cmd_poll(c);
+}
 
-	dev->cam_tag++;
+static void cmd_issue(cam_cmd *c)
+{
+	freenect_device *dev = c->dev;
+	freenect_context *ctx = dev->parent;
+	cam_hdr *chdr = (cam_hdr*)c->obuf;
+
+	// Tags count replies, so they are only known once it is our turn
+	chdr->tag = fn_le16(dev->cam_tag);
+	int res = fnusb_control_async(&dev->usb_cam, 0x40, 0, 0, 0, c->obuf, c->len, cmd_sent, c);
+	if (res < 0) {
+		FN_ERROR("send_cmd: Output control transfer failed (%d)\n", res);
+		cmd_finish(c, res, NULL);
+	}
+}
 
-	return actual_len;
+static cam_cmd *queue_cmd(freenect_device *dev, uint16_t cmd, void *cmdbuf, unsigned int cmd_len, fn_cmd_cb cb, void *user)
+{
+	freenect_context *ctx = dev->parent;
+	cam_hdr *chdr;
+
+	// The camera handle is closed while a lost device waits to come back
+	if (dev->reconnect.lost)
+		return NULL;
+	if (cmd_len & 1 || cmd_len > (0x400 - sizeof(*chdr))) {
+		FN_ERROR("send_cmd: Invalid command length (0x%x)\n", cmd_len);
+		return NULL;
+	}
+	cam_cmd *c = (cam_cmd*)malloc(sizeof(cam_cmd));
+	if (!c)
+		return NULL;
+
+	chdr = (cam_hdr*)c->obuf;
+	chdr->magic[0] = 0x47;
+	chdr->magic[1] = 0x4d;
+	chdr->cmd = fn_le16(cmd);
+	chdr->len = fn_le16(cmd_len / 2);
+	memcpy(c->obuf+sizeof(*chdr), cmdbuf, cmd_len);
+	c->len = cmd_len + sizeof(*chdr);
+	c->next = NULL;
+	c->dev = dev;
+	c->cb = cb;
+	c->user = user;
+	c->polls = 0;
+
+	fn_mutex_lock(dev->cmd_lock);
+	int idle = !dev->cmd_head;
+	if (idle)
+		dev->cmd_head = c;
+	else
+		dev->cmd_tail->next = c;
+	dev->cmd_tail = c;
+	fn_mutex_unlock(dev->cmd_lock);
+
+	if (idle)
+		cmd_issue(c);
+	return c;
+}
+
+FN_INTERNAL int send_cmd_async(freenect_device *dev, uint16_t cmd, void *cmdbuf, unsigned int cmd_len, fn_cmd_cb cb, void *user)
+{
+	return queue_cmd(dev, cmd, cmdbuf, cmd_len, cb, user) ? 0 : -1;
+}
+
+FN_INTERNAL void drain_cmds(freenect_device *dev)
+{
+	struct timeval timeout = { 0, 10000 };
+	while (dev->cmd_head) {
+		if (fnusb_process_events_timeout(&dev->parent->usb, &timeout) < 0)
+			break;
+	}
+}
+
+typedef struct {
+	int done;
+	int res;
+	void *replybuf;
+	int reply_len;
+} cmd_wait;
+
+static void cmd_wait_done(freenect_device *dev, int res, void *reply, void *user)
+{
+	freenect_context *ctx = dev->parent;
+	cmd_wait *w = (cmd_wait*)user;
+
+	if (res > w->reply_len) {
+		FN_WARNING("send_cmd: Data buffer is %d bytes long, but got %d bytes\n", w->reply_len, res);
+		memcpy(w->replybuf, reply, w->reply_len);
+	} else if (res > 0) {
+		memcpy(w->replybuf, reply, res);
+	}
+	w->res = res;
+	w->done = 1;
+}
+
+FN_INTERNAL int send_cmd(freenect_device *dev, uint16_t cmd, void *cmdbuf, unsigned int cmd_len, void *replybuf, int reply_len)
+{
+	freenect_context *ctx = dev->parent;
+	cmd_wait w = { 0, 0, replybuf, reply_len };
+
+	cam_cmd *c = queue_cmd(dev, cmd, cmdbuf, cmd_len, cmd_wait_done, &w);
+	if (!c)
+		return -1;
+
+	int res = fnusb_wait_completed(&dev->usb_cam, &w.done);
+	if (res < 0) {
+		// Typically called from inside the event loop; the command stays
+		// queued but nobody is left to hear its reply
+		FN_ERROR("send_cmd: Failed to wait for reply (%d)\n", res);
+		fn_mutex_lock(dev->cmd_lock);
+		if (w.done) {
+			// Finished by another thread while we gave up. c is freed by
+			// now and its address may belong to another command already.
+			fn_mutex_unlock(dev->cmd_lock);
+			return w.res;
+		}
+		// Not finished, so c is still queued
+		cam_cmd *q;
+		for (q = dev->cmd_head; q && q != c; q = q->next)
+			;
+		if (q)
+			q->cb = NULL;
+		fn_mutex_unlock(dev->cmd_lock);
+		return res;
+	}
+	return w.res;
 }
 
 // returns UINT16_MAX on error
@@ -301,6 +510,62 @@ FN_INTERNAL int write_register(freenect_device *dev, uint16_t reg, uint16_t data
 	return 0;
 }
 
+// Register writes packed into one command; keeps the command well inside
+// the firmware's input buffer
+#define MAX_WRITES_PER_CMD 32
+
+// The firmware acknowledges register writes with a single 0000 status word;
+// anything else means the write was refused
+static int write_reply_status(freenect_context *ctx, int res, uint16_t *reply, int count)
+{
+	if (res < 0) {
+		FN_ERROR("write_registers: send_cmd() returned %d\n", res);
+		return res;
+	}
+	if (res != 2 || reply[0] != 0) {
+		if (count == 1)
+			FN_WARNING("write_registers: send_cmd() returned %d [%04x %04x], 0000 expected\n", res, reply[0], reply[1]);
+		return -1;
+	}
+	return 0;
+}
+
+FN_INTERNAL int write_registers(freenect_device *dev, reg_write *writes, int n)
+{
+	freenect_context *ctx = dev->parent;
+	uint16_t cmd[2 * MAX_WRITES_PER_CMD];
+	uint16_t reply[2];
+	int failed = 0;
+	int i, j;
+
+	for (i = 0; i < n; i += MAX_WRITES_PER_CMD) {
+		int count = n - i < MAX_WRITES_PER_CMD ? n - i : MAX_WRITES_PER_CMD;
+		for (j = 0; j < count; j++) {
+			FN_DEBUG("write_registers: 0x%04x <= 0x%02x\n", writes[i+j].reg, writes[i+j].data);
+			cmd[2*j] = fn_le16(writes[i+j].reg);
+			cmd[2*j+1] = fn_le16(writes[i+j].data);
+		}
+		reply[0] = reply[1] = 0xffff;
+		int res = write_reply_status(ctx, send_cmd(dev, 0x03, cmd, 4 * count, reply, 4), reply, count);
+		if (res == 0 || count == 1) {
+			for (j = 0; j < count; j++)
+				writes[i+j].res = res;
+			failed += res < 0 ? count : 0;
+			continue;
+		}
+		// Retry one by one to find out which registers were refused
+		FN_DEBUG("write_registers: batch of %d failed, writing one at a time\n", count);
+		for (j = 0; j < count; j++) {
+			cmd[0] = fn_le16(writes[i+j].reg);
+			cmd[1] = fn_le16(writes[i+j].data);
+			reply[0] = reply[1] = 0xffff;
+			writes[i+j].res = write_reply_status(ctx, send_cmd(dev, 0x03, cmd, 4, reply, 4), reply, 1);
+			failed += writes[i+j].res < 0;
+		}
+	}
+	return failed ? -failed : 0;
+}
+
 // returns UINT16_MAX on error
 FN_INTERNAL uint16_t read_cmos_register(freenect_device *dev, uint16_t reg)
 {
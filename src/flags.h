@@ -27,14 +27,29 @@
 #pragma once
 
 #include "libfreenect.h"
+#include "freenect_internal.h"
 
 
 int send_cmd(freenect_device *dev, uint16_t cmd, void *cmdbuf, unsigned int cmd_len, void *replybuf, int reply_len);
+// Queue a command and return right away; cb runs from the event loop with
+// the reply length (or < 0 on error) and the reply
+int send_cmd_async(freenect_device *dev, uint16_t cmd, void *cmdbuf, unsigned int cmd_len, fn_cmd_cb cb, void *user);
+// Wait for all queued commands of a device to finish
+void drain_cmds(freenect_device *dev);
 
 // returns UINT16_MAX on error
 uint16_t read_register(freenect_device *dev, uint16_t reg);
 int write_register(freenect_device *dev, uint16_t reg, uint16_t data);
 
+typedef struct {
+	uint16_t reg;
+	uint16_t data;
+	int res; // Set by write_registers(): 0 on success, < 0 on error
+} reg_write;
+// Write registers in order, several per command. Returns 0 if all writes
+// succeeded, otherwise minus the number of failed writes.
+int write_registers(freenect_device *dev, reg_write *writes, int n);
+
 // returns UINT16_MAX on error
 uint16_t read_cmos_register(freenect_device *dev, uint16_t reg);
 int write_cmos_register(freenect_device *dev, uint16_t reg, uint16_t value);
@@ -29,6 +29,7 @@
 
 #include "libfreenect.h"
 #include "libfreenect_registration.h"
+#include "libfreenect_filter.h"
 #include "libfreenect_audio.h"
 
 #ifdef __ELF__
@@ -41,17 +42,29 @@
 typedef void (*fnusb_iso_cb)(freenect_device *dev, uint8_t *buf, int len);
 
 #include "usb_libusb10.h"
+#include "lock.h"
 
 // needed to set the led state for non 1414 devices
 FN_INTERNAL int fnusb_set_led_alt(libusb_device_handle * dev, freenect_context * ctx, freenect_led_options state);
 
+typedef struct _fn_event_thread fn_event_thread;
+
 struct _freenect_context {
+	fn_mutex *lock; // device list and registry
 	freenect_loglevel log_level;
 	freenect_log_cb log_cb;
 	fnusb_ctx usb;
 	freenect_device_flags enabled_subdevices;
 	freenect_device *first;
-	int zero_plane_res;
+	freenect_hotplug_cb hotplug_cb;
+	void *hotplug_user;
+	freenect_pollfd_added_cb pollfd_added_cb;
+	freenect_pollfd_removed_cb pollfd_removed_cb;
+	void *pollfd_user;
+	freenect_thread_params event_params;
+	int event_params_set; // otherwise read from the environment on first use
+	fn_event_thread *event_thread; // started by freenect_start_event_thread()
+	uint32_t motor_tag; // next tag of an audio-based motor command, under lock
     
     // if you want to load firmware from memory rather than disk
     unsigned char *     fn_fw_nui_ptr;
@@ -176,6 +189,14 @@ typedef struct {
 	void *usr_buf;
 	uint8_t *raw_buf;
 	void *proc_buf;
+	// History of the last hist_len converted frames. One slot more than that
+	// is allocated, the extra one receiving the frame in progress.
+	int hist_len;
+	int hist_count;
+	int hist_head;
+	int hist_frame_size;
+	uint8_t *hist_buf;
+	uint32_t *hist_timestamps;
 } packet_stream;
 
 typedef struct {
@@ -217,10 +238,50 @@ typedef struct {
 	freenect_sample_51 samples[6];  // Audio samples - 6 samples per transfer
 } audio_out_block;
 
+typedef struct {
+	int enabled;
+	freenect_depth_filter params;
+	int pixels;      // Size of the state below, 0 until the first frame
+	uint16_t *value; // Filtered depth per pixel
+	uint8_t *age;    // Frames since the pixel last had a valid sample
+} depth_filter_state;
+
+typedef struct {
+	int enabled;
+	freenect_background_model params;
+	int pixels;      // Size of the state below, 0 until the first frame
+	int learned;     // Frames learned so far, up to params.learn_frames
+	int have_mask;   // Whether mask belongs to the current frame
+	// Learning statistics, freed once the background is learned
+	uint32_t *sum;
+	uint16_t *count;
+	uint16_t *min;
+	uint16_t *max;
+	uint16_t *limit; // Samples below this are foreground
+	uint8_t *mask;
+} background_model_state;
+
+typedef struct {
+	int enabled;
+	freenect_device_state_cb cb;
+	char *serial;            // Camera serial to look for after the device is lost
+	int lost;
+	unsigned int generation; // Registry generation of the last reconnect attempt
+	int depth_running;       // Streams to restart
+	int video_running;
+	int audio_running;
+} reconnect_state;
+
+// Queued camera command, see flags.c
+typedef struct _cam_cmd cam_cmd;
+typedef void (*fn_cmd_cb)(freenect_device *dev, int res, void *reply, void *user);
+
 struct _freenect_device {
 	freenect_context *parent;
 	freenect_device *next;
 	void *user_data;
+	fn_mutex *lock;       // stream buffers and frame processing state
+	fn_mutex *motor_lock; // motor and LED commands
 
 	// Cameras
 	fnusb_dev usb_cam;
@@ -235,9 +296,14 @@ struct _freenect_device {
 	freenect_depth_format depth_format;
 	freenect_resolution video_resolution;
 	freenect_resolution depth_resolution;
+	freenect_depth_binning depth_binning;
 
 	int cam_inited;
 	uint16_t cam_tag;
+	int zero_plane_res; // size of the fixed params reply, which differs between models
+	cam_cmd *cmd_head;
+	cam_cmd *cmd_tail;
+	fn_mutex *cmd_lock; // command queue
 
 	packet_stream depth;
 	packet_stream video;
@@ -245,6 +311,16 @@ struct _freenect_device {
 	// Registration
 	freenect_registration registration;
 
+	// Depth filtering
+	depth_filter_state depth_filter;
+	background_model_state background;
+
+	// Settings re-applied after reconnecting
+	uint32_t flags_on;
+	uint32_t flags_off;
+	uint16_t ir_brightness; // 0 if never set
+	reconnect_state reconnect;
+
 	// Audio
 	fnusb_dev usb_audio;
 	fnusb_isoc_stream audio_out_isoc;
@@ -0,0 +1,94 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2011 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "freenect_internal.h"
+#include "lock.h"
+
+struct _fn_mutex {
+#ifdef _WIN32
+	CRITICAL_SECTION cs; // Always recursive
+#else
+	pthread_mutex_t mutex;
+#endif
+};
+
+FN_INTERNAL fn_mutex *fn_mutex_create(void)
+{
+	fn_mutex *mutex = (fn_mutex*)malloc(sizeof(fn_mutex));
+	if (!mutex)
+		return NULL;
+#ifdef _WIN32
+	InitializeCriticalSection(&mutex->cs);
+#else
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	int res = pthread_mutex_init(&mutex->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (res != 0) {
+		free(mutex);
+		return NULL;
+	}
+#endif
+	return mutex;
+}
+
+FN_INTERNAL void fn_mutex_destroy(fn_mutex *mutex)
+{
+	if (!mutex)
+		return;
+#ifdef _WIN32
+	DeleteCriticalSection(&mutex->cs);
+#else
+	pthread_mutex_destroy(&mutex->mutex);
+#endif
+	free(mutex);
+}
+
+FN_INTERNAL void fn_mutex_lock(fn_mutex *mutex)
+{
+#ifdef _WIN32
+	EnterCriticalSection(&mutex->cs);
+#else
+	pthread_mutex_lock(&mutex->mutex);
+#endif
+}
+
+FN_INTERNAL void fn_mutex_unlock(fn_mutex *mutex)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(&mutex->cs);
+#else
+	pthread_mutex_unlock(&mutex->mutex);
+#endif
+}
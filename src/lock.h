@@ -0,0 +1,39 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2011 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+#pragma once
+
+// Recursive mutexes for the internal locks, see the thread safety notes in
+// libfreenect.h. The context, device and command queue locks are never held
+// while waiting on USB. The motor lock is held across the synchronous
+// control and bulk transfers of a motor or LED request, so that requests
+// from several threads cannot interleave.
+typedef struct _fn_mutex fn_mutex;
+
+fn_mutex *fn_mutex_create(void);
+void fn_mutex_destroy(fn_mutex *mutex);
+void fn_mutex_lock(fn_mutex *mutex);
+void fn_mutex_unlock(fn_mutex *mutex);
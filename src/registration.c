@@ -213,6 +213,18 @@ FN_INTERNAL int freenect_apply_depth_unpacked_to_mm(freenect_device* dev, uint16
 	return 0;
 }
 
+// Convert a frame of n binned 11 bit depth values to millimeters in place
+FN_INTERNAL int freenect_apply_binned_depth_to_mm(freenect_device* dev, uint16_t* frame, int n)
+{
+	freenect_registration* reg = &(dev->registration);
+	int i;
+	for (i = 0; i < n; i++) {
+		uint16_t metric_depth = reg->raw_to_mm_shift[frame[i]];
+		frame[i] = metric_depth < DEPTH_MAX_METRIC_VALUE ? metric_depth : DEPTH_MAX_METRIC_VALUE;
+	}
+	return 0;
+}
+
 // create temporary x/y shift tables
 static void freenect_create_dxdy_tables(double* reg_x_table, double* reg_y_table, int32_t resolution_x, int32_t resolution_y, freenect_reg_info* regdata )
 {
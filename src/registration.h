@@ -34,3 +34,4 @@ int freenect_init_registration(freenect_device* dev);
 int freenect_apply_registration(freenect_device* dev, uint8_t* input, uint16_t* output_mm, bool unpacked);
 int freenect_apply_depth_to_mm(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm);
 int freenect_apply_depth_unpacked_to_mm(freenect_device* dev, uint16_t* input, uint16_t* output_mm);
+int freenect_apply_binned_depth_to_mm(freenect_device* dev, uint16_t* frame, int n);
@@ -54,8 +54,15 @@ typedef struct {
 	uint32_t status;
 }fn_alt_motor_reply;
 
-static int tag_seq = 0;
-static int tag_next_ack = 0;
+// Devices of a context number their audio-based motor commands from one
+// counter, so take it under the context lock
+static uint32_t next_motor_tag(freenect_context *ctx)
+{
+	fn_mutex_lock(ctx->lock);
+	uint32_t tag = ctx->motor_tag++;
+	fn_mutex_unlock(ctx->lock);
+	return tag;
+}
 
 int get_reply(libusb_device_handle* dev, freenect_context *ctx){
 	unsigned char buffer[512];
@@ -75,18 +82,13 @@ int get_reply(libusb_device_handle* dev, freenect_context *ctx){
 			res = -1;
 		}
 
-        //can't really do this as tag_seq is static. with two cameras this is not going to match. could put in as part of libusb_device but I don't think it really matters.
-//		if (reply.tag != tag_next_ack) {
-//			FN_ERROR("Reply tag out of order: expected %d, got %d\n", tag_next_ack, reply.tag);
-//			res = -1;
-//		}
+		// reply.tag is not checked; each reply is read right after its
+		// command, with the motor lock held
 
 		if (reply.status != 0) {
 			FN_ERROR("reply status != 0: failure?\n");
 			res = -1;
 		}
-		
-        tag_next_ack++;
 	}
 	return res;
 }
@@ -111,7 +113,7 @@ int update_tilt_state_alt(freenect_device *dev)
 	int res = 0;
 	fn_alt_motor_command cmd;
 	cmd.magic = fn_le32(0x06022009);
-	cmd.tag = fn_le32(tag_seq++);
+	cmd.tag = fn_le32(next_motor_tag(ctx));
 	cmd.arg1 = fn_le32(0x68); // 104.  Incidentally, the number of bytes that we expect in the reply.
 	cmd.cmd = fn_le32(0x8032);
     
@@ -152,7 +154,7 @@ int update_tilt_state_alt(freenect_device *dev)
 	return get_reply(dev->usb_audio.dev, ctx);
 }
 
-int freenect_update_tilt_state(freenect_device *dev)
+static int update_tilt_state(freenect_device *dev)
 {
 	freenect_context *ctx = dev->parent;
 	
@@ -186,6 +188,16 @@ int freenect_update_tilt_state(freenect_device *dev)
 	return ret;
 }
 
+int freenect_update_tilt_state(freenect_device *dev)
+{
+	if (dev->reconnect.lost)
+		return -1;
+	fn_mutex_lock(dev->motor_lock);
+	int res = update_tilt_state(dev);
+	fn_mutex_unlock(dev->motor_lock);
+	return res;
+}
+
 int freenect_set_tilt_degs_alt(freenect_device *dev, int tilt_degrees)
 {
 	freenect_context *ctx = dev->parent;
@@ -203,7 +215,7 @@ int freenect_set_tilt_degs_alt(freenect_device *dev, int tilt_degrees)
 
 	fn_alt_motor_command cmd;
 	cmd.magic = fn_le32(0x06022009);
-	cmd.tag = fn_le32(tag_seq++);
+	cmd.tag = fn_le32(next_motor_tag(ctx));
 	cmd.arg1 = fn_le32(0);
 	cmd.cmd = fn_le32(0x803b);
 	cmd.arg2 = (uint32_t)(fn_le32((int32_t)tilt_degrees));
@@ -221,7 +233,7 @@ int freenect_set_tilt_degs_alt(freenect_device *dev, int tilt_degrees)
 	return get_reply(dev->usb_audio.dev, ctx);
 }
 
-int freenect_set_tilt_degs(freenect_device *dev, double angle)
+static int set_tilt_degs(freenect_device *dev, double angle)
 {
 	freenect_context *ctx = dev->parent;
     
@@ -243,6 +255,16 @@ int freenect_set_tilt_degs(freenect_device *dev, double angle)
 	return ret;
 }
 
+int freenect_set_tilt_degs(freenect_device *dev, double angle)
+{
+	if (dev->reconnect.lost)
+		return -1;
+	fn_mutex_lock(dev->motor_lock);
+	int res = set_tilt_degs(dev, angle);
+	fn_mutex_unlock(dev->motor_lock);
+	return res;
+}
+
 FN_INTERNAL int fnusb_set_led_alt(libusb_device_handle * dev, freenect_context * ctx, freenect_led_options state)
 {
 	enum
@@ -270,7 +292,7 @@ FN_INTERNAL int fnusb_set_led_alt(libusb_device_handle * dev, freenect_context *
     
 	fn_alt_motor_command cmd;
 	cmd.magic = fn_le32(0x06022009);
-	cmd.tag = fn_le32(tag_seq++);
+	cmd.tag = fn_le32(next_motor_tag(ctx));
 	cmd.arg1 = fn_le32(0);
 	cmd.cmd = fn_le32(0x10);
 	cmd.arg2 = (uint32_t)(fn_le32((int32_t)state));
@@ -300,7 +322,7 @@ int freenect_set_led_alt(freenect_device *dev, freenect_led_options state)
 	return fnusb_set_led_alt(dev->usb_audio.dev, ctx, state);
 }
 
-int freenect_set_led(freenect_device *dev, freenect_led_options option)
+static int set_led(freenect_device *dev, freenect_led_options option)
 {
 	freenect_context *ctx = dev->parent;
 
@@ -336,3 +358,13 @@ void freenect_get_mks_accel(freenect_raw_tilt_state *state, double* x, double* y
 	*y = (double)state->accelerometer_y/FREENECT_COUNTS_PER_G*GRAVITY;
 	*z = (double)state->accelerometer_z/FREENECT_COUNTS_PER_G*GRAVITY;
 }
+
+int freenect_set_led(freenect_device *dev, freenect_led_options option)
+{
+	if (dev->reconnect.lost)
+		return -1;
+	fn_mutex_lock(dev->motor_lock);
+	int res = set_led(dev, option);
+	fn_mutex_unlock(dev->motor_lock);
+	return res;
+}
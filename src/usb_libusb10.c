@@ -36,41 +36,13 @@
 	# define sleep(x) Sleep((x)*1000) 
 #endif 
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#define FNUSB_HUGEPAGES
+// Huge page size transfer buffers are rounded up to
+#define FNUSB_HUGEPAGE_SIZE (2 << 20)
+#endif
 
-FN_INTERNAL int fnusb_num_devices(freenect_context *ctx)
-{
-	libusb_device **devs; // pointer to pointer of device, used to retrieve a list of devices
-	ssize_t count = libusb_get_device_list (ctx->usb.ctx, &devs);
-	if (count < 0)
-		return (count >= INT_MIN) ? (int)count : -1;
-
-	int number_found = 0, i = 0;
-	struct libusb_device_descriptor desc;
-	for (i = 0; i < count; ++i)
-	{
-		int r = libusb_get_device_descriptor (devs[i], &desc);
-		if (r < 0)
-		{
-			FN_WARNING("Failed to query USB device descriptor.\n");
-			continue;
-		}
-
-		if (desc.idVendor == VID_MICROSOFT)
-		{
-			if (desc.idProduct == PID_NUI_CAMERA || desc.idProduct == PID_K4W_CAMERA)
-			{
-				number_found++;
-			}
-			else if (desc.idProduct == PID_KV2_CAMERA)
-			{
-				FN_NOTICE("Skipping Kinect v2 device (needs https://github.com/OpenKinect/libfreenect2).\n");
-			}
-		}
-	}
-
-	libusb_free_device_list (devs, 1);
-	return number_found;
-}
 
 FN_INTERNAL short fnusb_is_camera(struct libusb_device_descriptor desc)
 {
@@ -151,11 +123,398 @@ FN_INTERNAL libusb_device * fnusb_find_sibling_device(freenect_context* ctx, lib
 	return NULL;
 }
 
+// The registry is guarded by the context lock. The registry_* helpers below
+// expect it to be held, except registry_refresh and registry_camera_serial,
+// which take it themselves around everything but USB I/O.
+static int registry_find(fnusb_ctx *usb, libusb_device *device)
+{
+	int i;
+	for (i = 0; i < usb->num_known; i++) {
+		if (usb->known[i].dev == device)
+			return i;
+	}
+	return -1;
+}
+
+// Add a device to the registry if it is part of a Kinect. Returns 1 if a
+// camera was added, 0 otherwise.
+static int registry_add(freenect_context *ctx, libusb_device *device)
+{
+	fnusb_ctx *usb = &ctx->usb;
+	struct libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(device, &desc) < 0) {
+		FN_WARNING("Failed to query USB device descriptor.\n");
+		return 0;
+	}
+	if (desc.idVendor == VID_MICROSOFT && desc.idProduct == PID_KV2_CAMERA) {
+		FN_NOTICE("Skipping Kinect v2 device (needs https://github.com/OpenKinect/libfreenect2).\n");
+		return 0;
+	}
+	if (!fnusb_is_camera(desc) && !fnusb_is_motor(desc) && !fnusb_is_audio(desc))
+		return 0;
+	if (registry_find(usb, device) >= 0)
+		return 0;
+
+	if (usb->num_known == usb->max_known) {
+		int max_known = usb->max_known ? usb->max_known * 2 : 8;
+		fnusb_known_dev *known = (fnusb_known_dev*)realloc(usb->known, max_known * sizeof(fnusb_known_dev));
+		if (!known)
+			return 0;
+		usb->known = known;
+		usb->max_known = max_known;
+	}
+	fnusb_known_dev *entry = &usb->known[usb->num_known++];
+	memset(entry, 0, sizeof(*entry));
+	entry->dev = libusb_ref_device(device);
+	entry->desc = desc;
+	usb->siblings_valid = 0;
+	usb->generation++;
+	return fnusb_is_camera(desc) ? 1 : 0;
+}
+
+// Returns 1 if the removed device was a camera, 0 otherwise
+static int registry_remove(fnusb_ctx *usb, int i)
+{
+	int camera = fnusb_is_camera(usb->known[i].desc);
+	libusb_unref_device(usb->known[i].dev);
+	free(usb->known[i].serial);
+	memmove(&usb->known[i], &usb->known[i + 1], (usb->num_known - i - 1) * sizeof(fnusb_known_dev));
+	usb->num_known--;
+	usb->siblings_valid = 0;
+	usb->generation++;
+	return camera;
+}
+
+// Bring the registry up to date with the bus
+static int registry_refresh(freenect_context *ctx)
+{
+	fnusb_ctx *usb = &ctx->usb;
+	int i;
+
+	if (usb->hotplug) {
+		// Hotplug events are handled along with transfers. While no device
+		// is open there are no transfers, so handle any pending events here
+		// for applications that poll without running an event loop.
+		if (!ctx->first) {
+			struct timeval timeout = { 0, 0 };
+			libusb_handle_events_timeout_completed(usb->ctx, &timeout, NULL);
+		}
+		return 0;
+	}
+
+	libusb_device **devs;
+	ssize_t count = libusb_get_device_list(usb->ctx, &devs);
+	if (count < 0)
+		return (count >= INT_MIN) ? (int)count : -1;
+
+	fn_mutex_lock(ctx->lock);
+	for (i = usb->num_known - 1; i >= 0; i--) {
+		ssize_t j;
+		for (j = 0; j < count; j++) {
+			if (devs[j] == usb->known[i].dev)
+				break;
+		}
+		if (j == count)
+			registry_remove(usb, i);
+	}
+	for (i = 0; i < count; i++)
+		registry_add(ctx, devs[i]);
+	fn_mutex_unlock(ctx->lock);
+
+	libusb_free_device_list(devs, 1);
+	return 0;
+}
+
+static void registry_find_siblings(freenect_context *ctx)
+{
+	fnusb_ctx *usb = &ctx->usb;
+	int i;
+	if (usb->siblings_valid)
+		return;
+
+	libusb_device **devs = (libusb_device**)malloc((usb->num_known + 1) * sizeof(libusb_device*));
+	if (!devs)
+		return;
+	for (i = 0; i < usb->num_known; i++)
+		devs[i] = usb->known[i].dev;
+
+	for (i = 0; i < usb->num_known; i++) {
+		fnusb_known_dev *entry = &usb->known[i];
+		if (!fnusb_is_camera(entry->desc))
+			continue;
+		entry->motor = fnusb_find_sibling_device(ctx, entry->dev, devs, usb->num_known, &fnusb_is_motor);
+		entry->audio = fnusb_find_sibling_device(ctx, entry->dev, devs, usb->num_known, &fnusb_is_audio);
+	}
+
+	free(devs);
+	usb->siblings_valid = 1;
+}
+
+// Read the serial of a registered camera into serial, which must hold 256
+// bytes. The serial is cached once it is final. Reading the descriptors may
+// handle hotplug events, so the registry entry is looked up again afterwards.
+static int registry_camera_serial(freenect_context *ctx, libusb_device *camera, unsigned char *serial)
+{
+	fnusb_ctx *usb = &ctx->usb;
+	fn_mutex_lock(ctx->lock);
+	int i = registry_find(usb, camera);
+	if (i < 0 || usb->known[i].serial) {
+		if (i >= 0)
+			strcpy((char*)serial, usb->known[i].serial);
+		fn_mutex_unlock(ctx->lock);
+		return i < 0 ? -1 : 0;
+	}
+	struct libusb_device_descriptor desc = usb->known[i].desc;
+	fn_mutex_unlock(ctx->lock);
+
+	// Verify that a serial number exists to query.  If not, don't touch the device.
+	if (desc.iSerialNumber == 0)
+		return -1;
+
+	libusb_device_handle *camera_handle;
+	int res = libusb_open(camera, &camera_handle);
+	if (res != 0)
+		return -1;
+
+	// Read string descriptor referring to serial number.
+	res = libusb_get_string_descriptor_ascii(camera_handle, desc.iSerialNumber, serial, 256);
+	libusb_close(camera_handle);
+	if (res < 0)
+		return -1;
+
+	// K4W and 1473 don't provide a camera serial; use audio serial instead.
+	const char* const K4W_1473_SERIAL = "0000000000000000";
+	if (strncmp((const char*)serial, K4W_1473_SERIAL, 16) == 0)
+	{
+		fn_mutex_lock(ctx->lock);
+		registry_find_siblings(ctx);
+		i = registry_find(usb, camera);
+		libusb_device* audio_device = (i >= 0 && usb->known[i].audio) ? libusb_ref_device(usb->known[i].audio) : NULL;
+		fn_mutex_unlock(ctx->lock);
+		if (audio_device == NULL)
+		{
+			// The audio device may not be up yet, so ask again next time.
+			return 0;
+		}
+
+		struct libusb_device_descriptor audio_desc;
+		libusb_device_handle * audio_handle = NULL;
+		unsigned char audio_serial[256];
+		res = libusb_get_device_descriptor(audio_device, &audio_desc);
+		if (res == 0)
+			res = libusb_open(audio_device, &audio_handle);
+		if (res == 0)
+		{
+			res = libusb_get_string_descriptor_ascii(audio_handle, audio_desc.iSerialNumber, audio_serial, 256);
+			libusb_close(audio_handle);
+		}
+		libusb_unref_device(audio_device);
+		if (res <= 0)
+		{
+			FN_WARNING("Failed to get audio serial of K4W or 1473 device: %s\n", libusb_error_name(res));
+			return 0;
+		}
+		strcpy((char*)serial, (char*)audio_serial);
+	}
+
+	fn_mutex_lock(ctx->lock);
+	i = registry_find(usb, camera);
+	if (i >= 0 && !usb->known[i].serial)
+		usb->known[i].serial = strdup((char*)serial);
+	fn_mutex_unlock(ctx->lock);
+	return 0;
+}
+
+#ifdef FNUSB_HOTPLUG
+static void queue_hotplug_event(fnusb_ctx *usb, freenect_hotplug_event event)
+{
+	if (usb->num_hotplug_events == usb->max_hotplug_events) {
+		int max_events = usb->max_hotplug_events ? usb->max_hotplug_events * 2 : 8;
+		freenect_hotplug_event *events = (freenect_hotplug_event*)realloc(usb->hotplug_events, max_events * sizeof(freenect_hotplug_event));
+		if (!events)
+			return;
+		usb->hotplug_events = events;
+		usb->max_hotplug_events = max_events;
+	}
+	usb->hotplug_events[usb->num_hotplug_events++] = event;
+}
+
+static int LIBUSB_CALL hotplug_callback(libusb_context *usb_ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
+{
+	freenect_context *ctx = (freenect_context*)user_data;
+	int camera = 0;
+
+	fn_mutex_lock(ctx->lock);
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		camera = registry_add(ctx, device);
+		FN_SPEW("Hotplug: device %p arrived\n", device);
+	} else {
+		int i = registry_find(&ctx->usb, device);
+		if (i >= 0)
+			camera = registry_remove(&ctx->usb, i);
+		FN_SPEW("Hotplug: device %p left\n", device);
+	}
+
+	// This runs inside libusb event handling, possibly while a camera command
+	// waits for its reply, so the callback is left to freenect_process_events()
+	if (camera && ctx->hotplug_cb)
+		queue_hotplug_event(&ctx->usb, event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? FREENECT_HOTPLUG_ARRIVED : FREENECT_HOTPLUG_LEFT);
+	fn_mutex_unlock(ctx->lock);
+	return 0;
+}
+#endif
+
+FN_INTERNAL int fnusb_next_hotplug_event(freenect_context *ctx, freenect_hotplug_event *event)
+{
+	fnusb_ctx *usb = &ctx->usb;
+	int found = 0;
+
+	fn_mutex_lock(ctx->lock);
+	if (usb->num_hotplug_events > 0) {
+		*event = usb->hotplug_events[0];
+		usb->num_hotplug_events--;
+		memmove(usb->hotplug_events, usb->hotplug_events + 1, usb->num_hotplug_events * sizeof(freenect_hotplug_event));
+		found = 1;
+	}
+	fn_mutex_unlock(ctx->lock);
+	return found;
+}
+
+FN_INTERNAL int fnusb_registry_init(freenect_context *ctx)
+{
+	fnusb_ctx *usb = &ctx->usb;
+	usb->hotplug = 0;
+#ifdef FNUSB_HOTPLUG
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		// Registering enumerates the devices already present
+		int res = libusb_hotplug_register_callback(usb->ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE,
+			VID_MICROSOFT, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			hotplug_callback, ctx, &usb->hotplug_handle);
+		if (res == LIBUSB_SUCCESS) {
+			usb->hotplug = 1;
+			return 0;
+		}
+		FN_WARNING("Failed to register for hotplug events, scanning the bus instead: %s\n", libusb_error_name(res));
+	}
+#endif
+	return registry_refresh(ctx);
+}
+
+FN_INTERNAL void fnusb_registry_free(freenect_context *ctx)
+{
+	fnusb_ctx *usb = &ctx->usb;
+#ifdef FNUSB_HOTPLUG
+	if (usb->hotplug)
+		libusb_hotplug_deregister_callback(usb->ctx, usb->hotplug_handle);
+#endif
+	usb->hotplug = 0;
+	fn_mutex_lock(ctx->lock);
+	while (usb->num_known > 0)
+		registry_remove(usb, usb->num_known - 1);
+	free(usb->known);
+	usb->known = NULL;
+	usb->max_known = 0;
+	free(usb->hotplug_events);
+	usb->hotplug_events = NULL;
+	usb->num_hotplug_events = 0;
+	usb->max_hotplug_events = 0;
+	fn_mutex_unlock(ctx->lock);
+}
+
+FN_INTERNAL ssize_t fnusb_get_device_list(freenect_context *ctx, libusb_device ***list)
+{
+	fnusb_ctx *usb = &ctx->usb;
+	int res = registry_refresh(ctx);
+	if (res < 0)
+		return res;
+
+	fn_mutex_lock(ctx->lock);
+	int i, count = usb->num_known;
+	*list = (libusb_device**)malloc((count + 1) * sizeof(libusb_device*));
+	if (*list) {
+		for (i = 0; i < count; i++)
+			(*list)[i] = libusb_ref_device(usb->known[i].dev);
+		(*list)[count] = NULL;
+	}
+	fn_mutex_unlock(ctx->lock);
+	return *list ? count : -1;
+}
+
+FN_INTERNAL void fnusb_free_device_list(libusb_device **list)
+{
+	int i;
+	for (i = 0; list[i]; i++)
+		libusb_unref_device(list[i]);
+	free(list);
+}
+
+FN_INTERNAL unsigned int fnusb_registry_generation(freenect_context *ctx)
+{
+	registry_refresh(ctx);
+	fn_mutex_lock(ctx->lock);
+	unsigned int generation = ctx->usb.generation;
+	fn_mutex_unlock(ctx->lock);
+	return generation;
+}
+
+FN_INTERNAL int fnusb_camera_serial(freenect_device *dev, char *serial)
+{
+	if (!dev->usb_cam.dev)
+		return -1;
+	return registry_camera_serial(dev->parent, libusb_get_device(dev->usb_cam.dev), (unsigned char*)serial);
+}
+
+FN_INTERNAL int fnusb_reopen_subdevices(freenect_device *dev, const char *serial)
+{
+	libusb_device **devs;
+	ssize_t count = fnusb_get_device_list(dev->parent, &devs);
+	if (count < 0)
+		return -1;
+
+	int res = -1;
+	int i, index = 0;
+	for (i = 0; i < count; i++)
+	{
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(devs[i], &desc) < 0 || !fnusb_is_camera(desc))
+			continue;
+
+		unsigned char camera_serial[256];
+		if (registry_camera_serial(dev->parent, devs[i], camera_serial) == 0 && strcmp((char*)camera_serial, serial) == 0)
+		{
+			res = fnusb_open_listed_subdevices(dev, index, devs, count, NULL);
+			break;
+		}
+		index++;
+	}
+
+	fnusb_free_device_list(devs);
+	return res;
+}
+
+FN_INTERNAL int fnusb_num_devices(freenect_context *ctx)
+{
+	fnusb_ctx *usb = &ctx->usb;
+	int res = registry_refresh(ctx);
+	if (res < 0)
+		return res;
+
+	int number_found = 0, i = 0;
+	fn_mutex_lock(ctx->lock);
+	for (i = 0; i < usb->num_known; i++) {
+		if (fnusb_is_camera(usb->known[i].desc))
+			number_found++;
+	}
+	fn_mutex_unlock(ctx->lock);
+	return number_found;
+}
+
 FN_INTERNAL int fnusb_list_device_attributes(freenect_context *ctx, struct freenect_device_attributes** attribute_list)
 {
 	*attribute_list = NULL; // initialize some return value in case the user is careless.
-	libusb_device **devs;   // pointer to pointer of device, used to retrieve a list of devices
-	ssize_t count = libusb_get_device_list (ctx->usb.ctx, &devs);
+	libusb_device **devs;
+	ssize_t count = fnusb_get_device_list(ctx, &devs);
 	if (count < 0)
 	{
 		return (count >= INT_MIN) ? (int)count : -1;
@@ -163,93 +522,141 @@ FN_INTERNAL int fnusb_list_device_attributes(freenect_context *ctx, struct freen
 
 	struct freenect_device_attributes** next_attr = attribute_list;
 
-	// Pass over the list.  For each camera seen, if we already have a camera
-	// for the newest_camera device, allocate a new one and append it to the list,
-	// incrementing num_cams.
 	int num_cams = 0;
 	int i;
 	for (i = 0; i < count; i++)
 	{
-		libusb_device* camera_device = devs[i];
-
 		struct libusb_device_descriptor desc;
-		int res = libusb_get_device_descriptor (camera_device, &desc);
-		if (res < 0)
+		int res = libusb_get_device_descriptor (devs[i], &desc);
+		if (res < 0 || !fnusb_is_camera(desc))
 		{
 			continue;
 		}
 
-		if (desc.idVendor == VID_MICROSOFT && (desc.idProduct == PID_NUI_CAMERA || desc.idProduct == PID_K4W_CAMERA))
+		unsigned char serial[256]; // String descriptors are at most 256 bytes.
+		if (registry_camera_serial(ctx, devs[i], serial) < 0)
 		{
-			// Verify that a serial number exists to query.  If not, don't touch the device.
-			if (desc.iSerialNumber == 0)
-			{
-				continue;
-			}
+			continue;
+		}
 
-			libusb_device_handle *camera_handle;
-			res = libusb_open(camera_device, &camera_handle);
-			if (res != 0)
-			{
-				continue;
-			}
+		// Add item to linked list.
+		struct freenect_device_attributes* current_attr = (struct freenect_device_attributes*)malloc(sizeof(struct freenect_device_attributes));
+		memset(current_attr, 0, sizeof(*current_attr));
 
-			// Read string descriptor referring to serial number.
-			unsigned char serial[256]; // String descriptors are at most 256 bytes.
-			res = libusb_get_string_descriptor_ascii(camera_handle, desc.iSerialNumber, serial, 256);
-			libusb_close(camera_handle);
-			if (res < 0)
-			{
-				continue;
-			}
+		current_attr->camera_serial = strdup((char*)serial);
+		*next_attr = current_attr;
+		next_attr = &(current_attr->next);
+		num_cams++;
+	}
 
-			// K4W and 1473 don't provide a camera serial; use audio serial instead.
-			const char* const K4W_1473_SERIAL = "0000000000000000";
-			if (strncmp((const char*)serial, K4W_1473_SERIAL, 16) == 0)
-			{
-				libusb_device* audio_device = fnusb_find_sibling_device(ctx, camera_device, devs, count, &fnusb_is_audio);
-				if (audio_device != NULL)
-				{
-					struct libusb_device_descriptor audio_desc;
-					res = libusb_get_device_descriptor(audio_device, &audio_desc);
-					if (res != 0)
-					{
-						FN_WARNING("Failed to get audio serial descriptors of K4W or 1473 device: %s\n", libusb_error_name(res));
-					}
-					else
-					{
-						libusb_device_handle * audio_handle = NULL;
-						res = libusb_open(audio_device, &audio_handle);
-						if (res != 0)
-						{
-							FN_WARNING("Failed to open audio device for serial of K4W or 1473 device: %s\n", libusb_error_name(res));
-						}
-						else
-						{
-							res = libusb_get_string_descriptor_ascii(audio_handle, audio_desc.iSerialNumber, serial, 256);
-							libusb_close(audio_handle);
-							if (res <= 0)
-							{
-								FN_WARNING("Failed to get audio serial of K4W or 1473 device: %s\n", libusb_error_name(res));
-							}
-						}
-					}
+	fnusb_free_device_list(devs);
+	return num_cams;
+}
+
+// Allocate a transfer buffer of the given kind of memory, falling back to
+// the heap if that fails
+static int buffer_alloc(fnusb_dev *dev, fnusb_buffer *buf, freenect_transfer_memory memory, size_t size)
+{
+	freenect_context *ctx = dev->parent->parent;
+
+	buf->data = NULL;
+	buf->size = size;
+	buf->memory = memory;
+	buf->owner = NULL;
+
+	switch (memory) {
+#ifdef FNUSB_DEV_MEM
+		case FREENECT_TRANSFER_MEM_DEVICE:
+			buf->data = libusb_dev_mem_alloc(dev->dev, size);
+			buf->owner = dev->dev;
+			break;
+#endif
+#ifdef FNUSB_HUGEPAGES
+		case FREENECT_TRANSFER_MEM_HUGEPAGES:
+		{
+			void *data = MAP_FAILED;
+			buf->size = (size + FNUSB_HUGEPAGE_SIZE - 1) & ~(size_t)(FNUSB_HUGEPAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+			data = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+#endif
+			if (data == MAP_FAILED) {
+				// No huge pages reserved, ask for transparent ones instead
+				data = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (data != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+					madvise(data, buf->size, MADV_HUGEPAGE);
+#endif
+					memset(data, 0, buf->size); // fault the pages in now
 				}
 			}
+			if (data != MAP_FAILED)
+				buf->data = (uint8_t*)data;
+			break;
+		}
+#endif
+		default:
+			break;
+	}
 
-			// Add item to linked list.
-			struct freenect_device_attributes* current_attr = (struct freenect_device_attributes*)malloc(sizeof(struct freenect_device_attributes));
-			memset(current_attr, 0, sizeof(*current_attr));
+	if (!buf->data) {
+		if (memory != FREENECT_TRANSFER_MEM_HEAP)
+			FN_WARNING("Failed to allocate %u byte transfer buffer of memory kind %d, using the heap\n", (unsigned int)size, memory);
+		buf->size = size;
+		buf->memory = FREENECT_TRANSFER_MEM_HEAP;
+		buf->owner = NULL;
+		buf->data = (uint8_t*)malloc(size);
+	}
+	return buf->data ? 0 : -1;
+}
 
-			current_attr->camera_serial = strdup((char*)serial);
-			*next_attr = current_attr;
-			next_attr = &(current_attr->next);
-			num_cams++;
-		}
+static void buffer_free(fnusb_buffer *buf)
+{
+	switch (buf->memory) {
+#ifdef FNUSB_DEV_MEM
+		case FREENECT_TRANSFER_MEM_DEVICE:
+			libusb_dev_mem_free(buf->owner, buf->data, buf->size);
+			break;
+#endif
+#ifdef FNUSB_HUGEPAGES
+		case FREENECT_TRANSFER_MEM_HUGEPAGES:
+			munmap(buf->data, buf->size);
+			break;
+#endif
+		default:
+			free(buf->data);
+			break;
 	}
+	buf->data = NULL;
+}
 
-	libusb_free_device_list(devs, 1);
-	return num_cams;
+FN_INTERNAL int fnusb_set_transfer_memory(freenect_context *ctx, freenect_transfer_memory mem)
+{
+	fnusb_ctx *usb = &ctx->usb;
+	int i;
+
+	switch (mem) {
+		case FREENECT_TRANSFER_MEM_HEAP:
+#ifdef FNUSB_DEV_MEM
+		case FREENECT_TRANSFER_MEM_DEVICE:
+#endif
+#ifdef FNUSB_HUGEPAGES
+		case FREENECT_TRANSFER_MEM_HUGEPAGES:
+#endif
+			break;
+		default:
+			FN_ERROR("Transfer memory kind %d is not supported by this build\n", mem);
+			return -1;
+	}
+
+	// Spare buffers of another kind would never be handed out again
+	fn_mutex_lock(ctx->lock);
+	usb->transfer_memory = mem;
+	for (i = 0; i < FNUSB_SPARE_BUFFERS; i++) {
+		if (usb->spare[i].data && usb->spare[i].memory != mem)
+			buffer_free(&usb->spare[i]);
+	}
+	fn_mutex_unlock(ctx->lock);
+	return 0;
 }
 
 FN_INTERNAL int fnusb_init(fnusb_ctx *ctx, freenect_usb_context *usb_ctx)
@@ -276,6 +683,11 @@ FN_INTERNAL int fnusb_init(fnusb_ctx *ctx, freenect_usb_context *usb_ctx)
 FN_INTERNAL int fnusb_shutdown(fnusb_ctx *ctx)
 {
 	//int res;
+	int i;
+	for (i = 0; i < FNUSB_SPARE_BUFFERS; i++) {
+		if (ctx->spare[i].data)
+			buffer_free(&ctx->spare[i]);
+	}
 	if (ctx->should_free_ctx) {
 		libusb_exit(ctx->ctx);
 		ctx->ctx = NULL;
@@ -293,6 +705,58 @@ FN_INTERNAL int fnusb_process_events_timeout(fnusb_ctx *ctx, struct timeval* tim
 	return libusb_handle_events_timeout(ctx->ctx, timeout);
 }
 
+FN_INTERNAL int fnusb_get_pollfds(freenect_context *ctx, freenect_pollfd **fds)
+{
+	*fds = NULL;
+	const struct libusb_pollfd **usb_fds = libusb_get_pollfds(ctx->usb.ctx);
+	if (!usb_fds)
+		return -1;
+
+	int i, count = 0;
+	while (usb_fds[count])
+		count++;
+	*fds = (freenect_pollfd*)malloc((count ? count : 1) * sizeof(freenect_pollfd));
+	if (!*fds) {
+		libusb_free_pollfds(usb_fds);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		(*fds)[i].fd = usb_fds[i]->fd;
+		(*fds)[i].events = usb_fds[i]->events;
+	}
+	libusb_free_pollfds(usb_fds);
+	return count;
+}
+
+static void LIBUSB_CALL pollfd_added(int fd, short events, void *user_data)
+{
+	freenect_context *ctx = (freenect_context*)user_data;
+	if (ctx->pollfd_added_cb)
+		ctx->pollfd_added_cb(fd, events, ctx->pollfd_user);
+}
+
+static void LIBUSB_CALL pollfd_removed(int fd, void *user_data)
+{
+	freenect_context *ctx = (freenect_context*)user_data;
+	if (ctx->pollfd_removed_cb)
+		ctx->pollfd_removed_cb(fd, ctx->pollfd_user);
+}
+
+FN_INTERNAL void fnusb_set_pollfd_notifiers(freenect_context *ctx, int enable)
+{
+	if (enable)
+		libusb_set_pollfd_notifiers(ctx->usb.ctx, pollfd_added, pollfd_removed, ctx);
+	else
+		libusb_set_pollfd_notifiers(ctx->usb.ctx, NULL, NULL, NULL);
+}
+
+FN_INTERNAL int fnusb_get_next_timeout(fnusb_ctx *ctx, struct timeval* timeout)
+{
+	if (libusb_pollfds_handle_timeouts(ctx->ctx))
+		return 0;
+	return libusb_get_next_timeout(ctx->ctx, timeout);
+}
+
 FN_INTERNAL int fnusb_claim_camera(freenect_device* dev)
 {
 	freenect_context *ctx = dev->parent;
@@ -378,7 +842,28 @@ FN_INTERNAL int fnusb_keep_alive_led(freenect_context* ctx, libusb_device* audio
 	return res;
 }
 
+// Whether every subdevice enabled in the context has been opened
+static int fnusb_subdevices_open(freenect_device *dev)
+{
+	freenect_context *ctx = dev->parent;
+	return (dev->usb_cam.dev || !(ctx->enabled_subdevices & FREENECT_DEVICE_CAMERA))
+	    && (dev->usb_motor.dev || !(ctx->enabled_subdevices & FREENECT_DEVICE_MOTOR))
+	    && (dev->usb_audio.dev || !(ctx->enabled_subdevices & FREENECT_DEVICE_AUDIO));
+}
+
 FN_INTERNAL int fnusb_open_subdevices(freenect_device *dev, int index)
+{
+	libusb_device **devs; // pointer to pointer of device, used to retrieve a list of devices
+	ssize_t count = fnusb_get_device_list(dev->parent, &devs); //get the list of devices
+	if (count < 0)
+		return -1;
+
+	int res = fnusb_open_listed_subdevices(dev, index, devs, count, NULL);
+	fnusb_free_device_list(devs); // free the list, unref the devices in it
+	return res;
+}
+
+FN_INTERNAL int fnusb_open_listed_subdevices(freenect_device *dev, int index, libusb_device **devs, ssize_t count, char **audio_serial_out)
 {
 	freenect_context *ctx = dev->parent;
 
@@ -392,10 +877,8 @@ FN_INTERNAL int fnusb_open_subdevices(freenect_device *dev, int index)
 	dev->usb_audio.parent = dev;
 	dev->usb_audio.dev = NULL;
 
-	libusb_device **devs; // pointer to pointer of device, used to retrieve a list of devices
-	ssize_t count = libusb_get_device_list (dev->parent->usb.ctx, &devs); //get the list of devices
-	if (count < 0)
-		return -1;
+	if (audio_serial_out)
+		*audio_serial_out = NULL;
 
 	libusb_device* camera = NULL;
 
@@ -435,7 +918,7 @@ FN_INTERNAL int fnusb_open_subdevices(freenect_device *dev, int index)
 				// Not the 1414 kinect so remove the motor flag, this should preserve the audio flag if set
 				ctx->enabled_subdevices = (freenect_device_flags)(ctx->enabled_subdevices & ~FREENECT_DEVICE_MOTOR);
 
-				ctx->zero_plane_res = 334;
+				dev->zero_plane_res = 334;
 				dev->device_does_motor_control_with_audio = 1;
 
 				// set the LED for non 1414 devices to keep the camera alive for some systems which get freezes
@@ -452,7 +935,7 @@ FN_INTERNAL int fnusb_open_subdevices(freenect_device *dev, int index)
 			else
 			{
 				// The good old kinect that tilts and tweets
-				ctx->zero_plane_res = 322;
+				dev->zero_plane_res = 322;
 			}
 
 			dev->usb_cam.VID = desc.idVendor;
@@ -597,112 +1080,145 @@ FN_INTERNAL int fnusb_open_subdevices(freenect_device *dev, int index)
 			libusb_close(dev->usb_audio.dev);
 			dev->usb_audio.dev = NULL;
 
-			// Wait for the device to reappear.
-			int loops = 0;
-			for (loops = 0; loops < 10; loops++)
-			{
-				FN_SPEW("Try %d: Looking for new audio device matching serial %s\n", loops, audio_serial);
-				libusb_device **new_dev_list;
-				int dev_index;
-				ssize_t num_new_devs = libusb_get_device_list(ctx->usb.ctx, &new_dev_list);
+			// Wait for the device to reappear, or leave that to the caller so
+			// several devices can wait at once.
+			if (audio_serial_out) {
+				*audio_serial_out = audio_serial;
+				return 0;
+			}
+			return fnusb_wait_audio_firmware(dev, audio_serial);
+		}
+	}
+
+	if (fnusb_subdevices_open(dev))
+		return res;
 
-				for (dev_index = 0; dev_index < num_new_devs; ++dev_index)
+failure:
+	fnusb_close_subdevices(dev);
+	return res;
+}
+
+FN_INTERNAL int fnusb_wait_audio_firmware(freenect_device *dev, char *audio_serial)
+{
+	freenect_context *ctx = dev->parent;
+	unsigned char string_desc[256];
+	int num_interfaces;
+	int loops = 0;
+	for (loops = 0; loops < 10; loops++)
+	{
+		FN_SPEW("Try %d: Looking for new audio device matching serial %s\n", loops, audio_serial);
+		libusb_device **new_dev_list;
+		int dev_index;
+		ssize_t num_new_devs = libusb_get_device_list(ctx->usb.ctx, &new_dev_list);
+
+		for (dev_index = 0; dev_index < num_new_devs; ++dev_index)
+		{
+			struct libusb_device_descriptor new_dev_desc;
+			int r;
+			r = libusb_get_device_descriptor (new_dev_list[dev_index], &new_dev_desc);
+			if (r < 0)
+				continue;
+			// If this dev is a Kinect audio device, open device, read serial, and compare.
+			if (fnusb_is_audio(new_dev_desc))
+			{
+				FN_SPEW("Matched VID/PID!\n");
+				libusb_device_handle* new_dev_handle;
+				// Open device
+				r = libusb_open(new_dev_list[dev_index], &new_dev_handle);
+				if (r < 0)
+					continue;
+				// Read serial
+				r = libusb_get_string_descriptor_ascii(new_dev_handle, new_dev_desc.iSerialNumber, string_desc, 256);
+				if (r < 0)
+				{
+					FN_SPEW("Lost new audio device while fetching serial number.\n");
+					libusb_close(new_dev_handle);
+					continue;
+				}
+				// Compare to expected serial
+				if (r == strlen(audio_serial) && strcmp((char*)string_desc, audio_serial) == 0)
 				{
-					struct libusb_device_descriptor new_dev_desc;
-					int r;
-					r = libusb_get_device_descriptor (new_dev_list[dev_index], &new_dev_desc);
-					if (r < 0)
+					// We found it!
+					r = libusb_claim_interface(new_dev_handle, 0);
+					if (r != 0)
+					{
+						// Ouch, found the device but couldn't claim the interface.
+						FN_SPEW("Device with serial %s reappeared but couldn't claim interface 0\n", audio_serial);
+						libusb_close(new_dev_handle);
 						continue;
-					// If this dev is a Kinect audio device, open device, read serial, and compare.
-					if (fnusb_is_audio(new_dev_desc))
+					}
+					// Save the device handle.
+					dev->usb_audio.dev = new_dev_handle;
+
+					// Verify that we've actually found a device running the right firmware.
+					num_interfaces = fnusb_num_interfaces(&dev->usb_audio);
+
+					if (num_interfaces >= 2)
 					{
-						FN_SPEW("Matched VID/PID!\n");
-						libusb_device_handle* new_dev_handle;
-						// Open device
-						r = libusb_open(new_dev_list[dev_index], &new_dev_handle);
-						if (r < 0)
-							continue;
-						// Read serial
-						r = libusb_get_string_descriptor_ascii(new_dev_handle, new_dev_desc.iSerialNumber, string_desc, 256);
-						if (r < 0)
-						{
-							FN_SPEW("Lost new audio device while fetching serial number.\n");
-							libusb_close(new_dev_handle);
-							continue;
-						}
-						// Compare to expected serial
-						if (r == strlen(audio_serial) && strcmp((char*)string_desc, audio_serial) == 0)
-						{
-							// We found it!
-							r = libusb_claim_interface(new_dev_handle, 0);
-							if (r != 0)
-							{
-								// Ouch, found the device but couldn't claim the interface.
-								FN_SPEW("Device with serial %s reappeared but couldn't claim interface 0\n", audio_serial);
-								libusb_close(new_dev_handle);
-								continue;
-							}
-							// Save the device handle.
-							dev->usb_audio.dev = new_dev_handle;
-
-							// Verify that we've actually found a device running the right firmware.
-							num_interfaces = fnusb_num_interfaces(&dev->usb_audio);
-
-							if (num_interfaces >= 2)
-							{
-								if (dev->device_does_motor_control_with_audio)
-								{
-									dev->motor_control_with_audio_enabled = 1;
-								}
-							}
-							else
-							{
-								FN_SPEW("Opened audio with matching serial but too few interfaces.\n");
-								dev->usb_audio.dev = NULL;
-								libusb_close(new_dev_handle);
-								continue;
-							}
-
-							break;
-						}
-						else
+						if (dev->device_does_motor_control_with_audio)
 						{
-							FN_SPEW("Got serial %s, expected serial %s\n", (char*)string_desc, audio_serial);
+							dev->motor_control_with_audio_enabled = 1;
 						}
 					}
-				}
+					else
+					{
+						FN_SPEW("Opened audio with matching serial but too few interfaces.\n");
+						dev->usb_audio.dev = NULL;
+						libusb_close(new_dev_handle);
+						continue;
+					}
 
-				libusb_free_device_list(new_dev_list, 1);
-				// If we found the right device, break out of this loop.
-				if (dev->usb_audio.dev)
 					break;
-				// Sleep for a second to give the device more time to reenumerate.
-				sleep(1);
+				}
+				else
+				{
+					FN_SPEW("Got serial %s, expected serial %s\n", (char*)string_desc, audio_serial);
+				}
 			}
-
-			free(audio_serial);
 		}
-	}
 
-	if ((dev->usb_cam.dev || !(ctx->enabled_subdevices & FREENECT_DEVICE_CAMERA))
-   && (dev->usb_motor.dev || !(ctx->enabled_subdevices & FREENECT_DEVICE_MOTOR))
-   && (dev->usb_audio.dev || !(ctx->enabled_subdevices & FREENECT_DEVICE_AUDIO)))
-	{
-		// Each requested subdevice is open.
-		goto finally;
+		libusb_free_device_list(new_dev_list, 1);
+		// If we found the right device, break out of this loop.
+		if (dev->usb_audio.dev)
+			break;
+		// Sleep for a second to give the device more time to reenumerate.
+		sleep(1);
 	}
 
-failure:
+	free(audio_serial);
+
+	if (fnusb_subdevices_open(dev))
+		return 0;
+
 	fnusb_close_subdevices(dev);
+	return -1;
+}
 
-finally:
-	libusb_free_device_list(devs, 1); // free the list, unref the devices in it
-	return res;
+// Let the transfers of stopped streams come back before the handle they
+// were submitted on is closed, and release the spare buffers mapped from it
+static void wait_retired(fnusb_dev *dev)
+{
+	freenect_context *ctx = dev->parent->parent;
+	int i;
+
+	fn_mutex_lock(ctx->lock);
+	while (dev->retiring > 0) {
+		fn_mutex_unlock(ctx->lock);
+		libusb_handle_events(ctx->usb.ctx);
+		fn_mutex_lock(ctx->lock);
+	}
+	// Device memory goes away with the handle
+	for (i = 0; i < FNUSB_SPARE_BUFFERS; i++) {
+		if (ctx->usb.spare[i].data && ctx->usb.spare[i].owner == dev->dev)
+			buffer_free(&ctx->usb.spare[i]);
+	}
+	fn_mutex_unlock(ctx->lock);
 }
 
 FN_INTERNAL int fnusb_close_subdevices(freenect_device *dev)
 {
 	if (dev->usb_cam.dev) {
+		wait_retired(&dev->usb_cam);
 		libusb_release_interface(dev->usb_cam.dev, 0);
 #ifndef _WIN32
 		libusb_attach_kernel_driver(dev->usb_cam.dev, 0);
@@ -716,6 +1232,7 @@ FN_INTERNAL int fnusb_close_subdevices(freenect_device *dev)
 		dev->usb_motor.dev = NULL;
 	}
 	if (dev->usb_audio.dev) {
+		wait_retired(&dev->usb_audio);
 		libusb_release_interface(dev->usb_audio.dev, 0);
 		libusb_close(dev->usb_audio.dev);
 		dev->usb_audio.dev = NULL;
@@ -723,15 +1240,112 @@ FN_INTERNAL int fnusb_close_subdevices(freenect_device *dev)
 	return 0;
 }
 
+// Take a spare transfer buffer of at least size bytes that can be used on
+// the device, or allocate one
+static int iso_buffer_get(fnusb_dev *dev, fnusb_buffer *buf, size_t size)
+{
+	freenect_context *ctx = dev->parent->parent;
+	fnusb_ctx *usb = &ctx->usb;
+	freenect_transfer_memory memory;
+	int i, best = -1;
+
+	fn_mutex_lock(ctx->lock);
+	memory = usb->transfer_memory;
+	for (i = 0; i < FNUSB_SPARE_BUFFERS; i++) {
+		fnusb_buffer *spare = &usb->spare[i];
+		if (!spare->data || spare->size < size || spare->memory != memory)
+			continue;
+		if (spare->owner && spare->owner != dev->dev)
+			continue;
+		if (best < 0 || spare->size < usb->spare[best].size)
+			best = i;
+	}
+	if (best >= 0) {
+		*buf = usb->spare[best];
+		usb->spare[best].data = NULL;
+	}
+	fn_mutex_unlock(ctx->lock);
+
+	if (best >= 0)
+		return 0;
+	return buffer_alloc(dev, buf, memory, size);
+}
+
+// Keep a transfer buffer for reuse, dropping the smallest one if all slots
+// are taken
+static void iso_buffer_put(freenect_context *ctx, fnusb_buffer *buf)
+{
+	fnusb_ctx *usb = &ctx->usb;
+	int i, slot = 0;
+
+	fn_mutex_lock(ctx->lock);
+	if (buf->memory != usb->transfer_memory) {
+		buffer_free(buf);
+		fn_mutex_unlock(ctx->lock);
+		return;
+	}
+	for (i = 0; i < FNUSB_SPARE_BUFFERS; i++) {
+		if (!usb->spare[i].data) {
+			slot = i;
+			break;
+		}
+		if (usb->spare[i].size < usb->spare[slot].size)
+			slot = i;
+	}
+	if (usb->spare[slot].data && usb->spare[slot].size >= buf->size) {
+		buffer_free(buf);
+	} else {
+		if (usb->spare[slot].data)
+			buffer_free(&usb->spare[slot]);
+		usb->spare[slot] = *buf;
+	}
+	buf->data = NULL;
+	fn_mutex_unlock(ctx->lock);
+}
+
+// Count a transfer that will not be resubmitted; returns 1 if the run was
+// stopped and this was its last transfer in flight
+static int iso_xfer_done(fnusb_iso_run *run)
+{
+	freenect_context *ctx = run->parent->parent->parent;
+	int last;
+
+	fn_mutex_lock(ctx->lock);
+	run->dead_xfers++;
+	last = run->dead && run->dead_xfers == run->num_xfers;
+	fn_mutex_unlock(ctx->lock);
+	return last;
+}
+
+static void iso_run_reclaim(fnusb_iso_run *run)
+{
+	fnusb_dev *dev = run->parent;
+	freenect_context *ctx = dev->parent->parent;
+	int i;
+
+	for (i = 0; i < run->num_xfers; i++)
+		libusb_free_transfer(run->xfers[i]);
+	free(run->xfers);
+	iso_buffer_put(ctx, &run->buffer);
+	FN_FLOOD("Reclaimed stopped isochronous stream\n");
+	free(run);
+
+	fn_mutex_lock(ctx->lock);
+	dev->retiring--;
+	fn_mutex_unlock(ctx->lock);
+}
+
 static void LIBUSB_CALL iso_callback(struct libusb_transfer *xfer)
 {
 	int i;
-	fnusb_isoc_stream *strm = (fnusb_isoc_stream*)xfer->user_data;
+	fnusb_iso_run *strm = (fnusb_iso_run*)xfer->user_data;
 	freenect_context *ctx = strm->parent->parent->parent;
+	int last = 0;
 
 	if (strm->dead) {
-		strm->dead_xfers++;
-		FN_SPEW("EP %02x transfer complete, %d left\n", xfer->endpoint, strm->num_xfers - strm->dead_xfers);
+		FN_SPEW("EP %02x transfer complete\n", xfer->endpoint);
+		if (iso_xfer_done(strm))
+			iso_run_reclaim(strm);
 		return;
 	}
 
@@ -747,10 +1361,10 @@ static void LIBUSB_CALL iso_callback(struct libusb_transfer *xfer)
 			res = libusb_submit_transfer(xfer);
 			if (res != 0) {
 				FN_ERROR("iso_callback(): failed to resubmit transfer after successful completion: %s\n", libusb_error_name(res));
-				strm->dead_xfers++;
 				if (res == LIBUSB_ERROR_NO_DEVICE) {
 					strm->parent->device_dead = 1;
 				}
+				last = iso_xfer_done(strm);
 			}
 			break;
 		}
@@ -762,8 +1376,8 @@ static void LIBUSB_CALL iso_callback(struct libusb_transfer *xfer)
 			if(!strm->parent->device_dead) {
 				FN_ERROR("USB device disappeared, cancelling stream %02x :(\n", xfer->endpoint);
 			}
-			strm->dead_xfers++;
 			strm->parent->device_dead = 1;
+			last = iso_xfer_done(strm);
 			break;
 		}
 		case LIBUSB_TRANSFER_CANCELLED:
@@ -781,7 +1395,7 @@ static void LIBUSB_CALL iso_callback(struct libusb_transfer *xfer)
 				}
 				strm->parent->device_dead = 1;
 			}
-			strm->dead_xfers++;
+			last = iso_xfer_done(strm);
 			break;
 		}
 		default:
@@ -795,14 +1409,18 @@ static void LIBUSB_CALL iso_callback(struct libusb_transfer *xfer)
 			res = libusb_submit_transfer(xfer);
 			if (res != 0) {
 				FN_ERROR("Isochronous transfer resubmission failed after unknown error: %s\n", libusb_error_name(res));
-				strm->dead_xfers++;
 				if (res == LIBUSB_ERROR_NO_DEVICE) {
 					strm->parent->device_dead = 1;
 				}
+				last = iso_xfer_done(strm);
 			}
 			break;
 		}
 	}
+
+	// A stream stopped while this transfer was being handled
+	if (last)
+		iso_run_reclaim(strm);
 }
 
 FN_INTERNAL int fnusb_get_max_iso_packet_size(fnusb_dev *dev, unsigned char endpoint, int default_size)
@@ -822,39 +1440,50 @@ FN_INTERNAL int fnusb_start_iso(fnusb_dev *dev, fnusb_isoc_stream *strm, fnusb_i
 {
 	freenect_context *ctx = dev->parent->parent;
 
-	strm->parent = dev;
-	strm->cb = cb;
-	strm->num_xfers = xfers;
-	strm->pkts = pkts;
-	strm->len = len;
-	strm->buffer = (uint8_t*)malloc(xfers * pkts * len);
-	strm->xfers = (struct libusb_transfer**)malloc(sizeof(struct libusb_transfer*) * xfers);
-	strm->dead = 0;
-	strm->dead_xfers = 0;
+	fnusb_iso_run *run = (fnusb_iso_run*)malloc(sizeof(fnusb_iso_run));
+	if (!run)
+		return -1;
+	run->parent = dev;
+	run->cb = cb;
+	run->num_xfers = xfers;
+	run->pkts = pkts;
+	run->len = len;
+	run->xfers = (struct libusb_transfer**)calloc(xfers, sizeof(struct libusb_transfer*));
+	run->dead = 0;
+	run->dead_xfers = 0;
+	if (iso_buffer_get(dev, &run->buffer, (size_t)xfers * pkts * len) < 0 || !run->xfers) {
+		FN_ERROR("Failed to allocate isochronous stream buffers\n");
+		if (run->buffer.data)
+			buffer_free(&run->buffer);
+		free(run->xfers);
+		free(run);
+		return -1;
+	}
+	strm->run = run;
 
 	int i;
-	uint8_t *bufp = strm->buffer;
+	uint8_t *bufp = run->buffer.data;
 
 	for (i = 0; i < xfers; i++)
 	{
 		FN_SPEW("Creating endpoint %02x transfer #%d\n", endpoint, i);
 
-		strm->xfers[i] = libusb_alloc_transfer(pkts);
-		if (strm->xfers[i] == NULL)
+		run->xfers[i] = libusb_alloc_transfer(pkts);
+		if (run->xfers[i] == NULL)
 		{
 			FN_WARNING("Failed to allocate transfer\n");
-			strm->dead_xfers++;
+			iso_xfer_done(run);
 		}
 		else
 		{
-			libusb_fill_iso_transfer(strm->xfers[i], dev->dev, endpoint, bufp, pkts * len, pkts, iso_callback, strm, 0);
-			libusb_set_iso_packet_lengths(strm->xfers[i], len);
+			libusb_fill_iso_transfer(run->xfers[i], dev->dev, endpoint, bufp, pkts * len, pkts, iso_callback, run, 0);
+			libusb_set_iso_packet_lengths(run->xfers[i], len);
 
-			int ret = libusb_submit_transfer(strm->xfers[i]);
+			int ret = libusb_submit_transfer(run->xfers[i]);
 			if (ret < 0)
 			{
 				FN_WARNING("Failed to submit isochronous transfer %d: %s\n", i, libusb_error_name(ret));
-				strm->dead_xfers++;
+				iso_xfer_done(run);
 			}
 		}
 
@@ -867,29 +1496,34 @@ FN_INTERNAL int fnusb_start_iso(fnusb_dev *dev, fnusb_isoc_stream *strm, fnusb_i
 FN_INTERNAL int fnusb_stop_iso(fnusb_dev *dev, fnusb_isoc_stream *strm)
 {
 	freenect_context *ctx = dev->parent->parent;
-	int i;
+	fnusb_iso_run *run = strm->run;
+	int i, idle;
 
 	FN_FLOOD("fnusb_stop_iso() called\n");
 
-	strm->dead = 1;
-
-	for (i=0; i<strm->num_xfers; i++)
-		libusb_cancel_transfer(strm->xfers[i]);
-	FN_FLOOD("fnusb_stop_iso() cancelled all transfers\n");
-
-	while (strm->dead_xfers < strm->num_xfers) {
-		FN_FLOOD("fnusb_stop_iso() dead = %d\tnum = %d\n", strm->dead_xfers, strm->num_xfers);
-		libusb_handle_events(ctx->usb.ctx);
+	if (!run)
+		return -1;
+	strm->run = NULL;
+
+	// Cancel without waiting: iso_callback() reclaims the run as the last
+	// transfer comes back, and its buffer is kept for the next stream start.
+	// The lock keeps the run alive until every transfer has been cancelled.
+	fn_mutex_lock(ctx->lock);
+	run->dead = 1;
+	dev->retiring++;
+	idle = run->dead_xfers == run->num_xfers;
+	if (!idle) {
+		for (i=0; i<run->num_xfers; i++) {
+			if (run->xfers[i])
+				libusb_cancel_transfer(run->xfers[i]);
+		}
 	}
+	fn_mutex_unlock(ctx->lock);
+	FN_FLOOD("fnusb_stop_iso() cancelled all transfers\n");
 
-	for (i=0; i<strm->num_xfers; i++)
-		libusb_free_transfer(strm->xfers[i]);
-	FN_FLOOD("fnusb_stop_iso() freed all transfers\n");
-
-	free(strm->buffer);
-	free(strm->xfers);
+	if (idle)
+		iso_run_reclaim(run);
 
-	FN_FLOOD("fnusb_stop_iso() freed buffers and stream\n");
 	FN_FLOOD("fnusb_stop_iso() done\n");
 	return 0;
 }
@@ -899,6 +1533,84 @@ FN_INTERNAL int fnusb_control(fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRe
 	return libusb_control_transfer(dev->dev, bmRequestType, bRequest, wValue, wIndex, data, wLength, 0);
 }
 
+typedef struct {
+	fnusb_dev *dev;
+	fnusb_control_cb cb;
+	void *user;
+} fnusb_control_xfer;
+
+static void LIBUSB_CALL control_callback(struct libusb_transfer *xfer)
+{
+	fnusb_control_xfer *ctl = (fnusb_control_xfer*)xfer->user_data;
+	int res;
+
+	switch (xfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			res = xfer->actual_length;
+			break;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			res = LIBUSB_ERROR_TIMEOUT;
+			break;
+		case LIBUSB_TRANSFER_STALL:
+			res = LIBUSB_ERROR_PIPE;
+			break;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			ctl->dev->device_dead = 1;
+			res = LIBUSB_ERROR_NO_DEVICE;
+			break;
+		case LIBUSB_TRANSFER_CANCELLED:
+			res = LIBUSB_ERROR_INTERRUPTED;
+			break;
+		default:
+			res = LIBUSB_ERROR_IO;
+			break;
+	}
+	ctl->cb(ctl->dev, res, libusb_control_transfer_get_data(xfer), ctl->user);
+	libusb_free_transfer(xfer);
+	free(ctl);
+}
+
+FN_INTERNAL int fnusb_control_async(fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t *data, uint16_t wLength, fnusb_control_cb cb, void *user)
+{
+	// The setup packet and data follow the bookkeeping in one allocation
+	uint8_t *buffer = (uint8_t*)malloc(sizeof(fnusb_control_xfer) + LIBUSB_CONTROL_SETUP_SIZE + wLength);
+	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
+	if (!buffer || !xfer) {
+		free(buffer);
+		libusb_free_transfer(xfer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	fnusb_control_xfer *ctl = (fnusb_control_xfer*)buffer;
+	ctl->dev = dev;
+	ctl->cb = cb;
+	ctl->user = user;
+
+	uint8_t *setup = buffer + sizeof(fnusb_control_xfer);
+	libusb_fill_control_setup(setup, bmRequestType, bRequest, wValue, wIndex, wLength);
+	if (!(bmRequestType & LIBUSB_ENDPOINT_IN) && wLength)
+		memcpy(setup + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+	libusb_fill_control_transfer(xfer, dev->dev, setup, control_callback, ctl, 0);
+
+	int res = libusb_submit_transfer(xfer);
+	if (res < 0) {
+		free(buffer);
+		libusb_free_transfer(xfer);
+	}
+	return res;
+}
+
+FN_INTERNAL int fnusb_wait_completed(fnusb_dev *dev, int *completed)
+{
+	libusb_context *ctx = dev->parent->parent->usb.ctx;
+	while (!*completed) {
+		int res = libusb_handle_events_completed(ctx, completed);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED)
+			return res;
+	}
+	return 0;
+}
+
 FN_INTERNAL int fnusb_bulk(fnusb_dev *dev, uint8_t endpoint, uint8_t *data, int len, int *transferred) {
 	*transferred = 0;
 	return libusb_bulk_transfer(dev->dev, endpoint, data, len, transferred, 0);
@@ -49,29 +49,86 @@
   #endif
 #endif
 
+// Hotplug notification appeared in libusb 1.0.16
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+#define FNUSB_HOTPLUG
+#endif
+
+// Zero-copy transfer buffers appeared in libusb 1.0.21
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define FNUSB_DEV_MEM
+#endif
+
+// A Kinect camera, motor or audio device seen on the bus
+typedef struct {
+	libusb_device *dev; // referenced while in the registry
+	struct libusb_device_descriptor desc;
+	// Cameras only
+	char *serial; // serial reported by freenect_list_device_attributes(), once read
+	libusb_device *motor; // sibling subdevices, NULL if absent
+	libusb_device *audio;
+} fnusb_known_dev;
+
+// Transfer buffers of stopped streams kept for the next fnusb_start_iso()
+#define FNUSB_SPARE_BUFFERS 8
+
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	freenect_transfer_memory memory;
+	libusb_device_handle *owner; // handle device memory was mapped from
+} fnusb_buffer;
+
 typedef struct {
 	libusb_context *ctx;
 	int should_free_ctx;
+
+	// Registry of the Kinect devices on the bus, in enumeration order. With
+	// hotplug support it is kept current by hotplug events, otherwise it is
+	// brought up to date on every query.
+	fnusb_known_dev *known;
+	int num_known;
+	int max_known;
+	int siblings_valid;
+	unsigned int generation; // changes whenever a device comes or goes
+	int hotplug;
+#ifdef FNUSB_HOTPLUG
+	libusb_hotplug_callback_handle hotplug_handle;
+#endif
+	// Camera arrivals and departures not yet passed to the hotplug callback
+	freenect_hotplug_event *hotplug_events;
+	int num_hotplug_events;
+	int max_hotplug_events;
+	fnusb_buffer spare[FNUSB_SPARE_BUFFERS];
+	freenect_transfer_memory transfer_memory; // for buffers allocated from now on
 } fnusb_ctx;
 
 typedef struct {
 	freenect_device *parent; //so we can go up from the libusb userdata
 	libusb_device_handle *dev;
 	int device_dead; // set to 1 when the underlying libusb_device_handle vanishes (ie, Kinect was unplugged)
+	int retiring; // stopped streams with transfers still in flight
 	int VID;
 	int PID;
 } fnusb_dev;
 
+// Transfers and buffer of one fnusb_start_iso() call. Stopping the stream
+// cancels the transfers without waiting for them; the run is reclaimed once
+// the last one comes back.
 typedef struct {
 	fnusb_dev *parent; //so we can go up from the libusb userdata
 	struct libusb_transfer **xfers;
-	uint8_t *buffer;
+	fnusb_buffer buffer;
 	fnusb_iso_cb cb;
 	int num_xfers;
 	int pkts;
 	int len;
 	int dead;
 	int dead_xfers;
+} fnusb_iso_run;
+
+typedef struct {
+	fnusb_iso_run *run; // NULL while stopped
 } fnusb_isoc_stream;
 
 int fnusb_num_devices(freenect_context *ctx);
@@ -79,10 +136,35 @@ int fnusb_list_device_attributes(freenect_context *ctx, struct freenect_device_a
 
 int fnusb_init(fnusb_ctx *ctx, freenect_usb_context *usb_ctx);
 int fnusb_shutdown(fnusb_ctx *ctx);
+int fnusb_registry_init(freenect_context *ctx);
+void fnusb_registry_free(freenect_context *ctx);
+// Referenced copy of the registered devices, NULL terminated like
+// libusb_get_device_list(); release with fnusb_free_device_list()
+ssize_t fnusb_get_device_list(freenect_context *ctx, libusb_device ***list);
+void fnusb_free_device_list(libusb_device **list);
+// Update the registry if it is not driven by hotplug and return its generation
+unsigned int fnusb_registry_generation(freenect_context *ctx);
+// Take the oldest queued hotplug event; returns 0 if there is none
+int fnusb_next_hotplug_event(freenect_context *ctx, freenect_hotplug_event *event);
+// Serial of the open camera as listed by freenect_list_device_attributes(),
+// into a buffer of 256 bytes
+int fnusb_camera_serial(freenect_device *dev, char *serial);
+// Open the subdevices of the camera with the given serial
+int fnusb_reopen_subdevices(freenect_device *dev, const char *serial);
 int fnusb_process_events(fnusb_ctx *ctx);
 int fnusb_process_events_timeout(fnusb_ctx *ctx, struct timeval* timeout);
+int fnusb_get_pollfds(freenect_context *ctx, freenect_pollfd **fds);
+void fnusb_set_pollfd_notifiers(freenect_context *ctx, int enable);
+int fnusb_set_transfer_memory(freenect_context *ctx, freenect_transfer_memory mem);
+int fnusb_get_next_timeout(fnusb_ctx *ctx, struct timeval* timeout);
 
 int fnusb_open_subdevices(freenect_device *dev, int index);
+// Open the subdevices of the index'th camera in an already fetched device
+// list. If audio_serial is not NULL and the audio firmware had to be
+// uploaded, the audio serial is returned there and the caller must finish
+// with fnusb_wait_audio_firmware(), which frees it.
+int fnusb_open_listed_subdevices(freenect_device *dev, int index, libusb_device **devs, ssize_t count, char **audio_serial);
+int fnusb_wait_audio_firmware(freenect_device *dev, char *audio_serial);
 int fnusb_close_subdevices(freenect_device *dev);
 
 int fnusb_start_iso(fnusb_dev *dev, fnusb_isoc_stream *strm, fnusb_iso_cb cb, unsigned char endpoint, int xfers, int pkts, int len);
@@ -90,5 +172,11 @@ int fnusb_stop_iso(fnusb_dev *dev, fnusb_isoc_stream *strm);
 int fnusb_get_max_iso_packet_size(fnusb_dev *dev, unsigned char endpoint, int default_size);
 
 int fnusb_control(fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t *data, uint16_t wLength);
+// Called from the event loop with the transferred length or a libusb error;
+// data holds the reply of device to host transfers
+typedef void (*fnusb_control_cb)(fnusb_dev *dev, int res, uint8_t *data, void *user);
+int fnusb_control_async(fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t *data, uint16_t wLength, fnusb_control_cb cb, void *user);
+// Handle events until *completed becomes nonzero
+int fnusb_wait_completed(fnusb_dev *dev, int *completed);
 int fnusb_bulk(fnusb_dev *dev, uint8_t endpoint, uint8_t *data, int len, int *transferred);
 int fnusb_num_interfaces(fnusb_dev *dev);
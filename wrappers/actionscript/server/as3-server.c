@@ -46,6 +46,7 @@
 #include <string.h>
 #include "libfreenect_sync.h"
 #include "libfreenect.h"
+#include "libfreenect_codec.h"
 #include <pthread.h>
 #include <math.h>
 
@@ -199,6 +200,38 @@ void sendRawDepth(){
 	free(tmp_depth);
 }
 
+//send losslessly compressed raw depth to client
+void sendCompressedRawDepth(){
+	uint32_t ts, x, y, i, j;
+	freenect_sync_get_depth(&buf_depth_temp, &ts, 0, FREENECT_DEPTH_11BIT);
+	uint16_t *depth = (uint16_t*) buf_depth_temp;
+	freenect_frame_mode depth_mode = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT);
+	uint16_t *tmp_depth = (uint16_t*) malloc(depth_mode.bytes);
+	size_t compressed_size = freenect_depth_compress_bound(depth_mode.width, depth_mode.height);
+	unsigned char *compressed_buff = (unsigned char *) malloc(compressed_size);
+
+	if(_depth_mirrored){	//MIRROR DEPTH DATA
+		for(x = 0; x < depth_mode.width; x++){
+			for(y = 0; y < depth_mode.height; y++){
+				i = x + (y  * depth_mode.width);
+				j = (depth_mode.width - x - 1) + (y  * depth_mode.width);
+				tmp_depth[i] = depth[j];
+			}
+		}
+		depth = tmp_depth;
+	}
+
+	int len = freenect_depth_compress(depth, depth_mode.width, depth_mode.height, compressed_buff, compressed_size);
+	int n = len < 0 ? len : freenect_network_sendMessage(0, 3, compressed_buff, len);
+	if (n < 0)
+	{
+		printf("Error sending compressed raw depth\n");
+		client_connected = 0;
+	}
+	free(compressed_buff);
+	free(tmp_depth);
+}
+
 //send video ARGB to client
 void sendVideo(){
 	int n;
@@ -316,6 +349,9 @@ void *connection_handler(void *arg) {
 							case 8: //Video compression
 								_video_compression = value;
 							break;
+							case 9: //GET COMPRESSED RAW DEPTH
+								sendCompressedRawDepth();
+							break;
 						}
 					break;
 					case 1: //MOTOR
@@ -31,21 +31,75 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#ifdef _MSC_VER
+#include <windows.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 #include "libfreenect_registration.h"
 #include "libfreenect_sync.h"
 
+/* Frames are exchanged through a triple buffer. The producer (the runloop)
+   owns the back slot that libfreenect fills, the consumer owns the front slot
+   it last returned, and the middle slot is handed between them with a single
+   atomic exchange of the state word. The producer never takes a lock. */
+#define SLOT_MASK 0x3
+#define FRESH_FRAME 0x4 // Set in the state word if the middle slot is unread
+
 typedef struct buffer_ring {
-	pthread_mutex_t lock;
+	pthread_mutex_t lock; // Serializes consumers and format changes, never taken by the producer
+	pthread_mutex_t wait_lock;
 	pthread_cond_t cb_cond;
 	void *bufs[3];
-	uint32_t timestamp;
-	int valid; // True if middle buffer is valid
+	uint32_t timestamps[3];
+	int back;  // Slot being filled, owned by the producer
+	int front; // Slot last returned, owned by the consumer
+	volatile int state; // Index of the middle slot | FRESH_FRAME
+	int front_valid; // True once the front slot holds a returned frame
+	volatile int cond_waiters;
+	volatile int futex_waiters;
 	int fmt;
 	int res;
+	// Every frame buffer allocated for this ring, and the spares lent frames
+	// are replaced with. Both are protected by lend_lock.
+	int frame_size;
+	void **frames;
+	int num_frames;
+	void **pool;
+	int pool_size;
+	int pool_free;
 } buffer_ring_t;
 
+/* Each frame buffer is preceded by a header, so a lent frame can find its
+   way back to its pool when released. */
+typedef struct frame_header {
+	buffer_ring_t *ring; // NULL once the ring has been freed, the frame is freed on release
+	int lent;
+} frame_header_t;
+
+#define FRAME_HEADER_SIZE 16 // Keeps the frame data 16 byte aligned
+#define FRAME_HEADER(frame) ((frame_header_t *)((char *)(frame) - FRAME_HEADER_SIZE))
+
+/* A context and the thread that runs its events. There is one shared by all
+   devices, or one per device in FREENECT_SYNC_THREAD_PER_DEVICE mode. */
+typedef struct sync_runloop {
+	freenect_context *ctx;
+	int running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int pending_tasks;
+	pthread_mutex_t pending_tasks_lock;
+	pthread_cond_t pending_tasks_cond;
+} sync_runloop_t;
+
 typedef struct sync_kinect {
 	freenect_device *dev;
+	sync_runloop_t *runloop;
 	buffer_ring_t video;
 	buffer_ring_t depth;
 } sync_kinect_t;
@@ -54,13 +108,17 @@ typedef int (*set_buffer_t)(freenect_device *dev, void *buf);
 
 #define MAX_KINECTS 64
 static sync_kinect_t *kinects[MAX_KINECTS] = { 0 };
-static freenect_context *ctx;
-static int thread_running = 0;
-static pthread_t thread;
-static pthread_mutex_t runloop_lock = PTHREAD_MUTEX_INITIALIZER;
-static int pending_runloop_tasks = 0;
-static pthread_mutex_t pending_runloop_tasks_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t pending_runloop_tasks_cond = PTHREAD_COND_INITIALIZER;
+static sync_runloop_t shared_runloop;
+static sync_runloop_t device_runloops[MAX_KINECTS];
+static pthread_once_t runloops_once = PTHREAD_ONCE_INIT;
+static int thread_mode = FREENECT_SYNC_THREAD_SHARED;
+static freenect_thread_params thread_params;
+static int thread_params_set = 0; // otherwise the library defaults apply
+static volatile int wait_mode = FREENECT_SYNC_WAIT_BLOCK;
+static pthread_mutex_t lend_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lend_cond = PTHREAD_COND_INITIALIZER;
+static int lend_pool_depth = 4;
+static int lend_policy = FREENECT_SYNC_POOL_DROP_NEWEST;
 
 /* Locking Convention
    Rules:
@@ -68,13 +126,120 @@ static pthread_cond_t pending_runloop_tasks_cond = PTHREAD_COND_INITIALIZER;
        - do not mix locks on different lines
        - if you need to change the lock rules, make sure you check everything and update this
    Lock Families:
-       - pending_runloop_tasks_lock
-       - runloop_lock, buffer_ring_t.lock (NOTE: You may only have one)
+       - sync_runloop_t.pending_tasks_lock
+       - sync_runloop_t.lock, buffer_ring_t.lock (NOTE: You may only have one)
+       - buffer_ring_t.wait_lock
+       - lend_lock (NOTE: may be taken while holding buffer_ring_t.lock)
 */
 
+#ifdef _MSC_VER
+static int atomic_exchange_int(volatile int *p, int v) { return InterlockedExchange((volatile LONG *)p, v); }
+static int atomic_load_int(volatile int *p) { return InterlockedCompareExchange((volatile LONG *)p, 0, 0); }
+static void atomic_add_int(volatile int *p, int v) { InterlockedExchangeAdd((volatile LONG *)p, v); }
+static void cpu_relax(void) { YieldProcessor(); }
+#else
+static int atomic_exchange_int(volatile int *p, int v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+static int atomic_load_int(volatile int *p) { return __atomic_load_n(p, __ATOMIC_SEQ_CST); }
+static void atomic_add_int(volatile int *p, int v) { __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); }
+#if defined(__i386__) || defined(__x86_64__)
+static void cpu_relax(void) { __builtin_ia32_pause(); }
+#else
+static void cpu_relax(void) { }
+#endif
+#endif
+
+static void get_time(struct timespec *ts)
+{
+#ifdef _WIN32
+	timespec_get(ts, TIME_UTC);
+#else
+	clock_gettime(CLOCK_REALTIME, ts);
+#endif
+}
+
+static void deadline_after(struct timespec *deadline, int timeout_ms)
+{
+	get_time(deadline);
+	deadline->tv_sec += timeout_ms / 1000;
+	deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+// Returns nonzero and the time remaining in left while the deadline is ahead
+static int time_left(const struct timespec *deadline, struct timespec *left)
+{
+	struct timespec now;
+	get_time(&now);
+	left->tv_sec = deadline->tv_sec - now.tv_sec;
+	left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+	if (left->tv_nsec < 0) {
+		left->tv_sec--;
+		left->tv_nsec += 1000000000L;
+	}
+	return left->tv_sec > 0 || (left->tv_sec == 0 && left->tv_nsec > 0);
+}
+
+#ifdef __linux__
+static void futex_wait(volatile int *addr, int val, const struct timespec *timeout)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void futex_wake(volatile int *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 0x7fffffff, NULL, NULL, 0);
+}
+#endif
+
+static void reset_buffer_slots(buffer_ring_t *buf)
+{
+	int i;
+	for (i = 0; i < 3; ++i)
+		buf->timestamps[i] = 0;
+	buf->front = 0;
+	buf->front_valid = 0;
+	buf->state = 1;
+	buf->back = 2;
+}
+
+// Call with lend_lock held, or before the ring is in use
+static void *alloc_frame(buffer_ring_t *buf)
+{
+	frame_header_t *hdr = (frame_header_t *)malloc(FRAME_HEADER_SIZE + buf->frame_size);
+	hdr->ring = buf;
+	hdr->lent = 0;
+	void *frame = (char *)hdr + FRAME_HEADER_SIZE;
+	buf->frames[buf->num_frames++] = frame;
+	return frame;
+}
+
+static void alloc_frames(buffer_ring_t *buf, int sz)
+{
+	int i;
+	buf->frame_size = sz;
+	buf->frames = (void **)malloc(3 * sizeof(void *));
+	buf->num_frames = 0;
+	for (i = 0; i < 3; ++i)
+		buf->bufs[i] = alloc_frame(buf);
+}
+
+// Allocated on first use, so rings that never lend cost nothing extra
+static void alloc_lend_pool(buffer_ring_t *buf)
+{
+	int i;
+	buf->frames = (void **)realloc(buf->frames, (buf->num_frames + lend_pool_depth) * sizeof(void *));
+	buf->pool = (void **)malloc(lend_pool_depth * sizeof(void *));
+	for (i = 0; i < lend_pool_depth; ++i)
+		buf->pool[i] = alloc_frame(buf);
+	buf->pool_size = buf->pool_free = lend_pool_depth;
+}
+
 static int alloc_buffer_ring_video(freenect_resolution res, freenect_video_format fmt, buffer_ring_t *buf)
 {
-	int sz, i;
+	int sz;
 	switch (fmt) {
 		case FREENECT_VIDEO_RGB:
 		case FREENECT_VIDEO_BAYER:
@@ -87,10 +252,8 @@ static int alloc_buffer_ring_video(freenect_resolution res, freenect_video_forma
 			printf("Invalid video format %d\n", fmt);
 			return -1;
 	}
-	for (i = 0; i < 3; ++i)
-		buf->bufs[i] = malloc(sz);
-	buf->timestamp = 0;
-	buf->valid = 0;
+	alloc_frames(buf, sz);
+	reset_buffer_slots(buf);
 	buf->fmt = fmt;
 	buf->res = res;
 	return 0;
@@ -98,7 +261,7 @@ static int alloc_buffer_ring_video(freenect_resolution res, freenect_video_forma
 
 static int alloc_buffer_ring_depth(freenect_resolution res, freenect_depth_format fmt, buffer_ring_t *buf)
 {
-	int sz, i;
+	int sz;
 	switch (fmt) {
 		case FREENECT_DEPTH_11BIT:
 		case FREENECT_DEPTH_10BIT:
@@ -112,10 +275,8 @@ static int alloc_buffer_ring_depth(freenect_resolution res, freenect_depth_forma
 			printf("Invalid depth format %d\n", fmt);
 			return -1;
 	}
-	for (i = 0; i < 3; ++i)
-		buf->bufs[i] = malloc(sz);
-	buf->timestamp = 0;
-	buf->valid = 0;
+	alloc_frames(buf, sz);
+	reset_buffer_slots(buf);
 	buf->fmt = fmt;
 	buf->res = res;
 	return 0;
@@ -124,28 +285,47 @@ static int alloc_buffer_ring_depth(freenect_resolution res, freenect_depth_forma
 static void free_buffer_ring(buffer_ring_t *buf)
 {
 	int i;
-	for (i = 0; i < 3; ++i) {
-		free(buf->bufs[i]);
-		buf->bufs[i] = NULL;
+	pthread_mutex_lock(&lend_lock);
+	for (i = 0; i < buf->num_frames; ++i) {
+		frame_header_t *hdr = FRAME_HEADER(buf->frames[i]);
+		// Frames still lent out stay valid until released
+		if (hdr->lent)
+			hdr->ring = NULL;
+		else
+			free(hdr);
 	}
-	buf->timestamp = 0;
-	buf->valid = 0;
+	free(buf->frames);
+	free(buf->pool);
+	buf->frames = buf->pool = NULL;
+	buf->num_frames = buf->pool_size = buf->pool_free = 0;
+	pthread_cond_broadcast(&lend_cond);
+	pthread_mutex_unlock(&lend_lock);
+	for (i = 0; i < 3; ++i)
+		buf->bufs[i] = NULL;
+	reset_buffer_slots(buf);
 	buf->fmt = -1;
 	buf->res = -1;
 }
 
 static void producer_cb_inner(freenect_device *dev, void *data, uint32_t timestamp, buffer_ring_t *buf, set_buffer_t set_buffer)
 {
-	pthread_mutex_lock(&buf->lock);
-	assert(data == buf->bufs[2]);
-	void *temp_buf = buf->bufs[1];
-	buf->bufs[1] = buf->bufs[2];
-	buf->bufs[2] = temp_buf;
-	set_buffer(dev, temp_buf);
-	buf->timestamp = timestamp;
-	buf->valid = 1;
-	pthread_cond_signal(&buf->cb_cond);
-	pthread_mutex_unlock(&buf->lock);
+	assert(data == buf->bufs[buf->back]);
+	buf->timestamps[buf->back] = timestamp;
+	// Publish the filled slot and take the old middle slot as the next back buffer
+	int state = atomic_exchange_int(&buf->state, buf->back | FRESH_FRAME);
+	buf->back = state & SLOT_MASK;
+	set_buffer(dev, buf->bufs[buf->back]);
+
+	// Only consumers that went to sleep need waking
+#ifdef __linux__
+	if (atomic_load_int(&buf->futex_waiters))
+		futex_wake(&buf->state);
+#endif
+	if (atomic_load_int(&buf->cond_waiters)) {
+		pthread_mutex_lock(&buf->wait_lock);
+		pthread_cond_broadcast(&buf->cb_cond);
+		pthread_mutex_unlock(&buf->wait_lock);
+	}
 }
 
 static void video_producer_cb(freenect_device *dev, void *data, uint32_t timestamp)
@@ -158,47 +338,75 @@ static void depth_producer_cb(freenect_device *dev, void *data, uint32_t timesta
 	producer_cb_inner(dev, data, timestamp, &((sync_kinect_t *)freenect_get_user(dev))->depth, freenect_set_depth_buffer);
 }
 
-/* You should only use these functions to manipulate the pending_runloop_tasks_lock*/
-static void pending_runloop_tasks_inc(void)
+static void init_runloop(sync_runloop_t *loop)
+{
+	loop->ctx = NULL;
+	loop->running = 0;
+	loop->pending_tasks = 0;
+	pthread_mutex_init(&loop->lock, NULL);
+	pthread_mutex_init(&loop->pending_tasks_lock, NULL);
+	pthread_cond_init(&loop->pending_tasks_cond, NULL);
+}
+
+static void init_runloops(void)
 {
-	pthread_mutex_lock(&pending_runloop_tasks_lock);
-	assert(pending_runloop_tasks >= 0);
-	++pending_runloop_tasks;
-	pthread_mutex_unlock(&pending_runloop_tasks_lock);
+	int i;
+	init_runloop(&shared_runloop);
+	for (i = 0; i < MAX_KINECTS; ++i)
+		init_runloop(&device_runloops[i]);
+}
+
+static sync_runloop_t *runloop_for(int index)
+{
+	pthread_once(&runloops_once, init_runloops);
+	if (thread_mode == FREENECT_SYNC_THREAD_PER_DEVICE)
+		return &device_runloops[index];
+	return &shared_runloop;
+}
+
+/* You should only use these functions to manipulate the pending_tasks_lock*/
+static void pending_runloop_tasks_inc(sync_runloop_t *loop)
+{
+	pthread_mutex_lock(&loop->pending_tasks_lock);
+	assert(loop->pending_tasks >= 0);
+	++loop->pending_tasks;
+	pthread_mutex_unlock(&loop->pending_tasks_lock);
 }
 
-static void pending_runloop_tasks_dec(void)
+static void pending_runloop_tasks_dec(sync_runloop_t *loop)
 {
-	pthread_mutex_lock(&pending_runloop_tasks_lock);
-	--pending_runloop_tasks;
-	assert(pending_runloop_tasks >= 0);
-	if (!pending_runloop_tasks)
-		pthread_cond_signal(&pending_runloop_tasks_cond);
-	pthread_mutex_unlock(&pending_runloop_tasks_lock);
+	pthread_mutex_lock(&loop->pending_tasks_lock);
+	--loop->pending_tasks;
+	assert(loop->pending_tasks >= 0);
+	if (!loop->pending_tasks)
+		pthread_cond_signal(&loop->pending_tasks_cond);
+	pthread_mutex_unlock(&loop->pending_tasks_lock);
 }
 
-static void pending_runloop_tasks_wait_zero(void)
+static void pending_runloop_tasks_wait_zero(sync_runloop_t *loop)
 {
-	pthread_mutex_lock(&pending_runloop_tasks_lock);
-	while (pending_runloop_tasks)
-		pthread_cond_wait(&pending_runloop_tasks_cond, &pending_runloop_tasks_lock);
-	pthread_mutex_unlock(&pending_runloop_tasks_lock);
+	pthread_mutex_lock(&loop->pending_tasks_lock);
+	while (loop->pending_tasks)
+		pthread_cond_wait(&loop->pending_tasks_cond, &loop->pending_tasks_lock);
+	pthread_mutex_unlock(&loop->pending_tasks_lock);
 }
 
-static void *init(void *unused)
+static void *init(void *arg)
 {
-	pending_runloop_tasks_wait_zero();
-	pthread_mutex_lock(&runloop_lock);
-	while (thread_running && freenect_process_events(ctx) >= 0) {
-		pthread_mutex_unlock(&runloop_lock);
+	sync_runloop_t *loop = (sync_runloop_t *)arg;
+	freenect_apply_event_thread_params(loop->ctx);
+	pending_runloop_tasks_wait_zero(loop);
+	pthread_mutex_lock(&loop->lock);
+	while (loop->running && freenect_process_events(loop->ctx) >= 0) {
+		pthread_mutex_unlock(&loop->lock);
 		// NOTE: This lets you run tasks while process_events isn't running
-		pending_runloop_tasks_wait_zero();
-		pthread_mutex_lock(&runloop_lock);
+		pending_runloop_tasks_wait_zero(loop);
+		pthread_mutex_lock(&loop->lock);
 	}
-	// Go through each device, call stop video, close device
+	// Go through each device of this runloop, call stop video, close device
 	int i;
 	for (i = 0; i < MAX_KINECTS; ++i) {
-		if (kinects[i]) {
+		if (kinects[i] && kinects[i]->runloop == loop) {
 			freenect_stop_video(kinects[i]->dev);
 			freenect_stop_depth(kinects[i]->dev);
 			freenect_set_user(kinects[i]->dev, NULL);
@@ -209,22 +417,30 @@ static void *init(void *unused)
 			kinects[i] = NULL;
 		}
 	}
-	freenect_shutdown(ctx);
-	pthread_mutex_unlock(&runloop_lock);
+	freenect_shutdown(loop->ctx);
+	loop->ctx = NULL;
+	pthread_mutex_unlock(&loop->lock);
 	return NULL;
 }
 
-static int init_thread(void)
+static int init_thread(sync_runloop_t *loop)
 {
-	thread_running = 1;
-	int ret = freenect_init(&ctx, 0);
+	int ret = freenect_init(&loop->ctx, 0);
 	if (ret != 0) return ret;
 	// We claim both the motor and the camera, because we can't know in advance
 	// which devices the caller will want, and the c_sync interface doesn't
 	// support audio, so there's no reason to claim the device needlessly.
-	freenect_select_subdevices(ctx, (freenect_device_flags)(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA));
-	ret = pthread_create(&thread, NULL, init, NULL);
-	if (ret != 0) return ret;
+	freenect_select_subdevices(loop->ctx, (freenect_device_flags)(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA));
+	if (thread_params_set)
+		freenect_set_event_thread_params(loop->ctx, &thread_params);
+	loop->running = 1;
+	ret = pthread_create(&loop->thread, NULL, init, loop);
+	if (ret != 0) {
+		loop->running = 0;
+		freenect_shutdown(loop->ctx);
+		loop->ctx = NULL;
+		return ret;
+	}
 	return 0;
 }
 
@@ -235,7 +451,7 @@ static int change_video_format(sync_kinect_t *kinect, freenect_resolution res, f
 	if (alloc_buffer_ring_video(res, fmt, &kinect->video))
 		return -1;
 	freenect_set_video_mode(kinect->dev, freenect_find_video_mode(res, fmt));
-	freenect_set_video_buffer(kinect->dev, kinect->video.bufs[2]);
+	freenect_set_video_buffer(kinect->dev, kinect->video.bufs[kinect->video.back]);
 	freenect_start_video(kinect->dev);
 	return 0;
 }
@@ -247,18 +463,19 @@ static int change_depth_format(sync_kinect_t *kinect, freenect_resolution res, f
 	if (alloc_buffer_ring_depth(res, fmt, &kinect->depth))
 		return -1;
 	freenect_set_depth_mode(kinect->dev, freenect_find_depth_mode(res, fmt));
-	freenect_set_depth_buffer(kinect->dev, kinect->depth.bufs[2]);
+	freenect_set_depth_buffer(kinect->dev, kinect->depth.bufs[kinect->depth.back]);
 	freenect_start_depth(kinect->dev);
 	return 0;
 }
 
-static sync_kinect_t *alloc_kinect(int index)
+static sync_kinect_t *alloc_kinect(sync_runloop_t *loop, int index)
 {
 	sync_kinect_t *kinect = (sync_kinect_t*)malloc(sizeof(sync_kinect_t));
-	if (freenect_open_device(ctx, &kinect->dev, index) < 0) {
+	if (freenect_open_device(loop->ctx, &kinect->dev, index) < 0) {
 		free(kinect);
 		return NULL;
 	}
+	kinect->runloop = loop;
 	int i;
 	for (i = 0; i < 3; ++i) {
 		kinect->video.bufs[i] = NULL;
@@ -268,10 +485,20 @@ static sync_kinect_t *alloc_kinect(int index)
 	kinect->video.res = -1;
 	kinect->depth.fmt = -1;
 	kinect->depth.res = -1;
+	kinect->video.frames = kinect->video.pool = NULL;
+	kinect->depth.frames = kinect->depth.pool = NULL;
+	kinect->video.num_frames = kinect->video.pool_size = kinect->video.pool_free = 0;
+	kinect->depth.num_frames = kinect->depth.pool_size = kinect->depth.pool_free = 0;
 	freenect_set_video_callback(kinect->dev, video_producer_cb);
 	freenect_set_depth_callback(kinect->dev, depth_producer_cb);
+	reset_buffer_slots(&kinect->video);
+	reset_buffer_slots(&kinect->depth);
+	kinect->video.cond_waiters = kinect->video.futex_waiters = 0;
+	kinect->depth.cond_waiters = kinect->depth.futex_waiters = 0;
 	pthread_mutex_init(&kinect->video.lock, NULL);
 	pthread_mutex_init(&kinect->depth.lock, NULL);
+	pthread_mutex_init(&kinect->video.wait_lock, NULL);
+	pthread_mutex_init(&kinect->depth.wait_lock, NULL);
 	pthread_cond_init(&kinect->video.cb_cond, NULL);
 	pthread_cond_init(&kinect->depth.cb_cond, NULL);
 	return kinect;
@@ -279,31 +506,32 @@ static sync_kinect_t *alloc_kinect(int index)
 
 static int setup_kinect(int index, int res, int fmt, int is_depth)
 {
-	pending_runloop_tasks_inc();
-	pthread_mutex_lock(&runloop_lock);
-	int thread_running_prev = thread_running;
-	if (!thread_running) {
-		int ret = init_thread();
+	sync_runloop_t *loop = runloop_for(index);
+	pending_runloop_tasks_inc(loop);
+	pthread_mutex_lock(&loop->lock);
+	int thread_running_prev = loop->running;
+	if (!loop->running) {
+		int ret = init_thread(loop);
 		if (ret != 0) {
-			pthread_mutex_unlock(&runloop_lock);
-			pending_runloop_tasks_dec();
+			pthread_mutex_unlock(&loop->lock);
+			pending_runloop_tasks_dec(loop);
 			return ret;
 		}
 	}
 	if (!kinects[index]) {
-		kinects[index] = alloc_kinect(index);
+		kinects[index] = alloc_kinect(loop, index);
 	}
 	if (!kinects[index]) {
 		printf("Error: Invalid index [%d]\n", index);
 		// If we started the thread, we need to bring it back
 		if (!thread_running_prev) {
-			thread_running = 0;
-			pthread_mutex_unlock(&runloop_lock);
-			pending_runloop_tasks_dec();
-			pthread_join(thread, NULL);
+			loop->running = 0;
+			pthread_mutex_unlock(&loop->lock);
+			pending_runloop_tasks_dec(loop);
+			pthread_join(loop->thread, NULL);
 		} else {
-			pthread_mutex_unlock(&runloop_lock);
-			pending_runloop_tasks_dec();
+			pthread_mutex_unlock(&loop->lock);
+			pending_runloop_tasks_dec(loop);
 		}
 		return -1;
 	}
@@ -322,33 +550,134 @@ static int setup_kinect(int index, int res, int fmt, int is_depth)
 			change_video_format(kinects[index], (freenect_resolution)res, (freenect_video_format)fmt);
 	}
 	pthread_mutex_unlock(&buf->lock);
-	pthread_mutex_unlock(&runloop_lock);
-	pending_runloop_tasks_dec();
+	pthread_mutex_unlock(&loop->lock);
+	pending_runloop_tasks_dec(loop);
 	return 0;
 }
 
-static int sync_get(void **data, uint32_t *timestamp, buffer_ring_t *buf)
+static int frame_ready(buffer_ring_t *buf)
 {
-	pthread_mutex_lock(&buf->lock);
-	// If there isn't a frame ready for us
-	while (!buf->valid)
-		pthread_cond_wait(&buf->cb_cond, &buf->lock);
-	void *temp_buf = buf->bufs[0];
-	*data = buf->bufs[0] = buf->bufs[1];
-	buf->bufs[1] = temp_buf;
-	buf->valid = 0;
-	*timestamp = buf->timestamp;
-	pthread_mutex_unlock(&buf->lock);
+	return atomic_load_int(&buf->state) & FRESH_FRAME;
+}
+
+/* Wait until the middle slot holds an unread frame, or until deadline if it
+   isn't NULL. Returns 0 if a frame is ready, FREENECT_SYNC_TIMEOUT otherwise. */
+static int wait_frame(buffer_ring_t *buf, const struct timespec *deadline)
+{
+	struct timespec left;
+	int ret = 0;
+	switch (wait_mode) {
+		case FREENECT_SYNC_WAIT_SPIN:
+			while (!frame_ready(buf)) {
+				if (deadline && !time_left(deadline, &left))
+					return FREENECT_SYNC_TIMEOUT;
+				cpu_relax();
+			}
+			return 0;
+#ifdef __linux__
+		case FREENECT_SYNC_WAIT_FUTEX:
+			atomic_add_int(&buf->futex_waiters, 1);
+			int state;
+			while (!((state = atomic_load_int(&buf->state)) & FRESH_FRAME)) {
+				if (deadline && !time_left(deadline, &left)) {
+					ret = FREENECT_SYNC_TIMEOUT;
+					break;
+				}
+				futex_wait(&buf->state, state, deadline ? &left : NULL);
+			}
+			atomic_add_int(&buf->futex_waiters, -1);
+			return ret;
+#endif
+		default:
+			pthread_mutex_lock(&buf->wait_lock);
+			atomic_add_int(&buf->cond_waiters, 1);
+			while (!frame_ready(buf)) {
+				if (!deadline) {
+					pthread_cond_wait(&buf->cb_cond, &buf->wait_lock);
+				} else if (pthread_cond_timedwait(&buf->cb_cond, &buf->wait_lock, deadline) == ETIMEDOUT) {
+					if (!frame_ready(buf))
+						ret = FREENECT_SYNC_TIMEOUT;
+					break;
+				}
+			}
+			atomic_add_int(&buf->cond_waiters, -1);
+			pthread_mutex_unlock(&buf->wait_lock);
+			return ret;
+	}
+}
+
+// True if timestamp a is later than b, allowing for wraparound
+static int timestamp_after(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) > 0;
+}
+
+/* Lend out the frame in the front slot, putting a spare from the pool in its
+   place. Call with buf->lock held. */
+static int lend_front(buffer_ring_t *buf)
+{
+	void *frame = buf->bufs[buf->front];
+	pthread_mutex_lock(&lend_lock);
+	if (!buf->pool_size)
+		alloc_lend_pool(buf);
+	if (!buf->pool_free) {
+		pthread_mutex_unlock(&lend_lock);
+		return FREENECT_SYNC_POOL_EXHAUSTED;
+	}
+	buf->bufs[buf->front] = buf->pool[--buf->pool_free];
+	FRAME_HEADER(frame)->lent = 1;
+	pthread_mutex_unlock(&lend_lock);
+	// The front slot no longer holds the frame
+	buf->front_valid = 0;
 	return 0;
 }
 
+/* Returns the next unread frame. With newer_than set, the frame already
+   returned is acceptable too, as long as it is newer than *newer_than.
+   timeout_ms < 0 waits forever. With lend set the frame is taken out of the
+   ring, and it is dropped if the lend pool is exhausted. */
+static int sync_get(void **data, uint32_t *timestamp, buffer_ring_t *buf, int timeout_ms, const uint32_t *newer_than, int lend)
+{
+	struct timespec deadline;
+	if (timeout_ms >= 0)
+		deadline_after(&deadline, timeout_ms);
+
+	// Wait without holding buf->lock, so that a format change from another
+	// thread can't stall the runloop behind us. Another consumer may take the
+	// frame first, in which case we wait for the next one.
+	for (;;) {
+		pthread_mutex_lock(&buf->lock);
+		int have_frame = 0;
+		if (frame_ready(buf)) {
+			int state = atomic_exchange_int(&buf->state, buf->front);
+			buf->front = state & SLOT_MASK;
+			buf->front_valid = 1;
+			have_frame = 1;
+		} else if (newer_than) {
+			have_frame = buf->front_valid;
+		}
+		if (have_frame && (!newer_than || timestamp_after(buf->timestamps[buf->front], *newer_than))) {
+			*data = buf->bufs[buf->front];
+			*timestamp = buf->timestamps[buf->front];
+			int ret = lend ? lend_front(buf) : 0;
+			pthread_mutex_unlock(&buf->lock);
+			if (ret)
+				*data = NULL;
+			return ret;
+		}
+		pthread_mutex_unlock(&buf->lock);
+		if (wait_frame(buf, timeout_ms >= 0 ? &deadline : NULL))
+			return FREENECT_SYNC_TIMEOUT;
+	}
+}
+
 
 /*
   Use this to make sure the runloop is locked and no one is in it. Then you can
   call arbitrary functions from libfreenect.h in a safe way. If the kinect with
   this index has not been initialized yet, then it will try to set it up. If
   this function is successful, then you can access kinects[index]. Don't forget
-  to unlock the runloop when you're done.
+  to unlock the runloop with runloop_exit(index) when you're done.
 
   Returns 0 if successful, nonzero if kinect[index] is unvailable
  */
@@ -358,33 +687,69 @@ static int runloop_enter(int index)
 		printf("Error: Invalid index [%d]\n", index);
 		return -1;
 	}
-	if (!thread_running || !kinects[index])
+	sync_runloop_t *loop = runloop_for(index);
+	if (!loop->running || !kinects[index])
 		if (setup_kinect(index, FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT, 1))
 			return -1;
 
-	pending_runloop_tasks_inc();
-	pthread_mutex_lock(&runloop_lock);
+	pending_runloop_tasks_inc(loop);
+	pthread_mutex_lock(&loop->lock);
 	return 0;
 }
 
-static void runloop_exit()
+static void runloop_exit(int index)
 {
-	pthread_mutex_unlock(&runloop_lock);
-	pending_runloop_tasks_dec();
+	sync_runloop_t *loop = kinects[index]->runloop;
+	pthread_mutex_unlock(&loop->lock);
+	pending_runloop_tasks_dec(loop);
 }
 
-int freenect_sync_get_video_with_res(void **video, uint32_t *timestamp, int index,
-        freenect_resolution res, freenect_video_format fmt)
+// With the blocking policy, wait until a lent frame of this ring is released
+static void wait_lend_pool(buffer_ring_t *buf)
+{
+	if (lend_policy != FREENECT_SYNC_POOL_BLOCK)
+		return;
+	pthread_mutex_lock(&lend_lock);
+	while (buf->pool_size && !buf->pool_free)
+		pthread_cond_wait(&lend_cond, &lend_lock);
+	pthread_mutex_unlock(&lend_lock);
+}
+
+static int sync_get_video(void **video, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_video_format fmt, int timeout_ms, const uint32_t *newer_than, int lend)
 {
 	if (index < 0 || index >= MAX_KINECTS) {
 		printf("Error: Invalid index [%d]\n", index);
 		return -1;
 	}
-	if (!thread_running || !kinects[index] || kinects[index]->video.fmt != fmt || kinects[index]->video.res != res)
+	if (!runloop_for(index)->running || !kinects[index] || kinects[index]->video.fmt != fmt || kinects[index]->video.res != res)
 		if (setup_kinect(index, res, fmt, 0))
 			return -1;
-	sync_get(video, timestamp, &kinects[index]->video);
-	return 0;
+	if (lend)
+		wait_lend_pool(&kinects[index]->video);
+	return sync_get(video, timestamp, &kinects[index]->video, timeout_ms, newer_than, lend);
+}
+
+static int sync_get_depth(void **depth, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_depth_format fmt, int timeout_ms, const uint32_t *newer_than, int lend)
+{
+	if (index < 0 || index >= MAX_KINECTS) {
+		printf("Error: Invalid index [%d]\n", index);
+		return -1;
+	}
+	if (!runloop_for(index)->running || !kinects[index] || kinects[index]->depth.fmt != fmt
+            || kinects[index]->depth.res != res)
+		if (setup_kinect(index, res, fmt, 1))
+			return -1;
+	if (lend)
+		wait_lend_pool(&kinects[index]->depth);
+	return sync_get(depth, timestamp, &kinects[index]->depth, timeout_ms, newer_than, lend);
+}
+
+int freenect_sync_get_video_with_res(void **video, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_video_format fmt)
+{
+	return sync_get_video(video, timestamp, index, res, fmt, -1, NULL, 0);
 }
 
 int freenect_sync_get_video(void **video, uint32_t *timestamp, int index, freenect_video_format fmt)
@@ -395,21 +760,109 @@ int freenect_sync_get_video(void **video, uint32_t *timestamp, int index, freene
 int freenect_sync_get_depth_with_res(void **depth, uint32_t *timestamp, int index,
         freenect_resolution res, freenect_depth_format fmt)
 {
-	if (index < 0 || index >= MAX_KINECTS) {
-		printf("Error: Invalid index [%d]\n", index);
+	return sync_get_depth(depth, timestamp, index, res, fmt, -1, NULL, 0);
+}
+
+int freenect_sync_get_depth(void **depth, uint32_t *timestamp, int index, freenect_depth_format fmt)
+{
+    return freenect_sync_get_depth_with_res(depth, timestamp, index, FREENECT_RESOLUTION_MEDIUM, fmt);
+}
+
+int freenect_sync_get_video_timeout(void **video, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_video_format fmt, int timeout_ms)
+{
+	return sync_get_video(video, timestamp, index, res, fmt, timeout_ms, NULL, 0);
+}
+
+int freenect_sync_try_get_video(void **video, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_video_format fmt)
+{
+	return sync_get_video(video, timestamp, index, res, fmt, 0, NULL, 0);
+}
+
+int freenect_sync_get_video_newer_than(void **video, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_video_format fmt, uint32_t newer_than, int timeout_ms)
+{
+	return sync_get_video(video, timestamp, index, res, fmt, timeout_ms, &newer_than, 0);
+}
+
+int freenect_sync_get_depth_timeout(void **depth, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_depth_format fmt, int timeout_ms)
+{
+	return sync_get_depth(depth, timestamp, index, res, fmt, timeout_ms, NULL, 0);
+}
+
+int freenect_sync_try_get_depth(void **depth, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_depth_format fmt)
+{
+	return sync_get_depth(depth, timestamp, index, res, fmt, 0, NULL, 0);
+}
+
+int freenect_sync_get_depth_newer_than(void **depth, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_depth_format fmt, uint32_t newer_than, int timeout_ms)
+{
+	return sync_get_depth(depth, timestamp, index, res, fmt, timeout_ms, &newer_than, 0);
+}
+
+int freenect_sync_lend_video(void **video, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_video_format fmt)
+{
+	return sync_get_video(video, timestamp, index, res, fmt, -1, NULL, 1);
+}
+
+int freenect_sync_lend_depth(void **depth, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_depth_format fmt)
+{
+	return sync_get_depth(depth, timestamp, index, res, fmt, -1, NULL, 1);
+}
+
+int freenect_sync_release(void *frame)
+{
+	if (!frame)
+		return -1;
+	frame_header_t *hdr = FRAME_HEADER(frame);
+	pthread_mutex_lock(&lend_lock);
+	if (!hdr->lent) {
+		pthread_mutex_unlock(&lend_lock);
+		printf("Error: Released a frame that was not lent\n");
 		return -1;
 	}
-	if (!thread_running || !kinects[index] || kinects[index]->depth.fmt != fmt
-            || kinects[index]->depth.res != res)
-		if (setup_kinect(index, res, fmt, 1))
-			return -1;
-	sync_get(depth, timestamp, &kinects[index]->depth);
+	hdr->lent = 0;
+	if (hdr->ring) {
+		buffer_ring_t *buf = hdr->ring;
+		buf->pool[buf->pool_free++] = frame;
+		pthread_cond_broadcast(&lend_cond);
+	} else {
+		free(hdr);
+	}
+	pthread_mutex_unlock(&lend_lock);
 	return 0;
 }
 
-int freenect_sync_get_depth(void **depth, uint32_t *timestamp, int index, freenect_depth_format fmt)
+void freenect_sync_set_lend_pool(int depth, freenect_sync_pool_policy policy)
 {
-    return freenect_sync_get_depth_with_res(depth, timestamp, index, FREENECT_RESOLUTION_MEDIUM, fmt);
+	pthread_mutex_lock(&lend_lock);
+	lend_pool_depth = depth > 0 ? depth : 1;
+	lend_policy = policy;
+	pthread_mutex_unlock(&lend_lock);
+}
+
+int freenect_sync_get_rgbd(void **video, uint32_t *video_timestamp, void **depth, uint32_t *depth_timestamp,
+        int index, freenect_video_format video_fmt, freenect_depth_format depth_fmt)
+{
+	if (sync_get_depth(depth, depth_timestamp, index, FREENECT_RESOLUTION_MEDIUM, depth_fmt, -1, NULL, 0))
+		return -1;
+	if (sync_get_video(video, video_timestamp, index, FREENECT_RESOLUTION_MEDIUM, video_fmt, -1, NULL, 0))
+		return -1;
+	// While we waited on one stream the other may have moved on. Both run at
+	// the same rate, so taking its newest frame as well gives the closest pair.
+	// Both frames sit in slots owned by the consumer, so the pair stays
+	// coherent until the next call.
+	if (timestamp_after(*video_timestamp, *depth_timestamp))
+		sync_get(depth, depth_timestamp, &kinects[index]->depth, 0, NULL, 0);
+	else
+		sync_get(video, video_timestamp, &kinects[index]->video, 0, NULL, 0);
+	return 0;
 }
 
 int freenect_sync_get_tilt_state(freenect_raw_tilt_state **state, int index)
@@ -417,35 +870,89 @@ int freenect_sync_get_tilt_state(freenect_raw_tilt_state **state, int index)
 	if (runloop_enter(index)) return -1;
 	freenect_update_tilt_state(kinects[index]->dev);
 	*state = freenect_get_tilt_state(kinects[index]->dev);
-	runloop_exit();
+	runloop_exit(index);
 	return 0;
 }
 
 int freenect_sync_set_tilt_degs(int angle, int index) {
 	if (runloop_enter(index)) return -1;
 	freenect_set_tilt_degs(kinects[index]->dev, angle);
-	runloop_exit();
+	runloop_exit(index);
 	return 0;
 }
 
 int freenect_sync_set_led(freenect_led_options led, int index) {
 	if (runloop_enter(index)) return -1;
 	freenect_set_led(kinects[index]->dev, led);
-	runloop_exit();
+	runloop_exit(index);
 	return 0;
 }
 
 int freenect_sync_camera_to_world(int cx, int cy, int wz, double* wx, double* wy, int index) {
 	if (runloop_enter(index)) return -1;
 	freenect_camera_to_world(kinects[index]->dev, cx, cy, wz, wx, wy);
-	runloop_exit();
+	runloop_exit(index);
 	return 0;
 }
 
-void freenect_sync_stop(void)
+void freenect_sync_set_wait_mode(freenect_sync_wait_mode mode)
+{
+	wait_mode = mode;
+}
+
+static void stop_runloop(sync_runloop_t *loop)
+{
+	if (loop->running) {
+		loop->running = 0;
+		pthread_join(loop->thread, NULL);
+	}
+}
+
+static int any_runloop_running(void)
+{
+	int i;
+	if (shared_runloop.running)
+		return 1;
+	for (i = 0; i < MAX_KINECTS; ++i)
+		if (device_runloops[i].running)
+			return 1;
+	return 0;
+}
+
+int freenect_sync_set_thread_mode(freenect_sync_thread_mode mode)
+{
+	pthread_once(&runloops_once, init_runloops);
+	if (mode == thread_mode)
+		return 0;
+	if (any_runloop_running()) {
+		printf("Error: Call freenect_sync_stop() before changing the thread mode\n");
+		return -1;
+	}
+	thread_mode = mode;
+	return 0;
+}
+
+int freenect_sync_set_thread_params(const freenect_thread_params *params)
 {
-	if (thread_running) {
-		thread_running = 0;
-		pthread_join(thread, NULL);
+	pthread_once(&runloops_once, init_runloops);
+	if (any_runloop_running()) {
+		printf("Error: Call freenect_sync_stop() before changing the thread scheduling\n");
+		return -1;
+	}
+	if (params) {
+		thread_params = *params;
+		thread_params_set = 1;
+	} else {
+		thread_params_set = 0;
 	}
+	return 0;
+}
+
+void freenect_sync_stop(void)
+{
+	int i;
+	pthread_once(&runloops_once, init_runloops);
+	stop_runloop(&shared_runloop);
+	for (i = 0; i < MAX_KINECTS; ++i)
+		stop_runloop(&device_runloops[i]);
 }
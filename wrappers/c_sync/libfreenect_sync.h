@@ -47,6 +47,30 @@
 extern "C" {
 #endif
 
+/// How the get functions wait for the next frame
+typedef enum {
+	FREENECT_SYNC_WAIT_BLOCK = 0, /**< Sleep on a condition variable (default) */
+	FREENECT_SYNC_WAIT_SPIN  = 1, /**< Busy-wait; lowest latency, burns a core */
+	FREENECT_SYNC_WAIT_FUTEX = 2, /**< Sleep on a futex (Linux only, otherwise same as BLOCK) */
+} freenect_sync_wait_mode;
+
+/// How devices are mapped onto event threads
+typedef enum {
+	FREENECT_SYNC_THREAD_SHARED     = 0, /**< One context and event thread for all devices (default) */
+	FREENECT_SYNC_THREAD_PER_DEVICE = 1, /**< A context and event thread for each device */
+} freenect_sync_thread_mode;
+
+/// What the lend functions do when every pooled frame is lent out
+typedef enum {
+	FREENECT_SYNC_POOL_DROP_NEWEST = 0, /**< Drop the new frame and return FREENECT_SYNC_POOL_EXHAUSTED (default) */
+	FREENECT_SYNC_POOL_BLOCK       = 1, /**< Wait until a frame is released */
+} freenect_sync_pool_policy;
+
+/// Returned by the timeout, try and newer_than functions when no suitable frame arrived in time
+#define FREENECT_SYNC_TIMEOUT 1
+/// Returned by the lend functions when a frame was dropped because the pool is exhausted
+#define FREENECT_SYNC_POOL_EXHAUSTED 2
+
 FREENECTAPI_SYNC int freenect_sync_get_video_with_res(void **video, uint32_t *timestamp, int index,
         freenect_resolution res, freenect_video_format fmt);
 /*  Synchronous video function, starts the runloop if it isn't running
@@ -95,6 +119,106 @@ FREENECTAPI_SYNC int freenect_sync_get_depth(void **depth, uint32_t *timestamp,
 
 */
 
+FREENECTAPI_SYNC int freenect_sync_get_video_timeout(void **video, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_video_format fmt, int timeout_ms);
+/*  Same as freenect_sync_get_video_with_res, but gives up after timeout_ms
+    milliseconds. A negative timeout waits forever.
+
+    Returns:
+        0 on success, FREENECT_SYNC_TIMEOUT if no frame arrived in time, other
+        nonzero values on error.
+*/
+
+FREENECTAPI_SYNC int freenect_sync_try_get_video(void **video, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_video_format fmt);
+/*  Returns a new video frame if one is ready and FREENECT_SYNC_TIMEOUT
+    without waiting otherwise. Lets one thread poll several devices.
+*/
+
+FREENECTAPI_SYNC int freenect_sync_get_video_newer_than(void **video, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_video_format fmt, uint32_t newer_than, int timeout_ms);
+/*  Returns the latest video frame with a timestamp after newer_than, waiting
+    up to timeout_ms milliseconds (forever if negative) for one to arrive.
+    Unlike the other get functions this may return the same frame again.
+*/
+
+FREENECTAPI_SYNC int freenect_sync_get_depth_timeout(void **depth, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_depth_format fmt, int timeout_ms);
+/*  Same as freenect_sync_get_depth_with_res, but gives up after timeout_ms
+    milliseconds. A negative timeout waits forever.
+
+    Returns:
+        0 on success, FREENECT_SYNC_TIMEOUT if no frame arrived in time, other
+        nonzero values on error.
+*/
+
+FREENECTAPI_SYNC int freenect_sync_try_get_depth(void **depth, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_depth_format fmt);
+/*  Returns a new depth frame if one is ready and FREENECT_SYNC_TIMEOUT
+    without waiting otherwise.
+*/
+
+FREENECTAPI_SYNC int freenect_sync_get_depth_newer_than(void **depth, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_depth_format fmt, uint32_t newer_than, int timeout_ms);
+/*  Returns the latest depth frame with a timestamp after newer_than, waiting
+    up to timeout_ms milliseconds (forever if negative) for one to arrive.
+    Unlike the other get functions this may return the same frame again.
+*/
+
+FREENECTAPI_SYNC int freenect_sync_lend_video(void **video, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_video_format fmt);
+/*  Like freenect_sync_get_video_with_res, but the frame is taken out of the
+    buffer ring and stays valid until passed to freenect_sync_release, so it
+    can be handed to another thread without copying. Its place in the ring is
+    taken by a spare from a per-stream pool (see freenect_sync_set_lend_pool).
+
+    Returns:
+        0 on success, FREENECT_SYNC_POOL_EXHAUSTED if the frame was dropped
+        because all pooled frames are lent out, other nonzero values on error.
+*/
+
+FREENECTAPI_SYNC int freenect_sync_lend_depth(void **depth, uint32_t *timestamp, int index,
+        freenect_resolution res, freenect_depth_format fmt);
+/*  Depth counterpart of freenect_sync_lend_video.
+*/
+
+FREENECTAPI_SYNC int freenect_sync_release(void *frame);
+/*  Return a frame from freenect_sync_lend_video or freenect_sync_lend_depth
+    to its pool. May be called from any thread.
+
+    Returns:
+        Nonzero on error.
+*/
+
+FREENECTAPI_SYNC void freenect_sync_set_lend_pool(int depth, freenect_sync_pool_policy policy);
+/*  Configure lending. depth is the number of frames per stream that can be
+    lent out at once (default 4); it applies to pools created afterwards,
+    which happens the first time a stream lends a frame after a format change.
+    The policy takes effect immediately.
+*/
+
+FREENECTAPI_SYNC int freenect_sync_get_rgbd(void **video, uint32_t *video_timestamp, void **depth, uint32_t *depth_timestamp,
+        int index, freenect_video_format video_fmt, freenect_depth_format depth_fmt);
+/*  Synchronous paired fetch, starts the runloop if it isn't running
+
+    Returns the newest video and depth frames, both new since the last call,
+    so that their timestamps are as close as the streams allow. The buffers
+    are the same ones freenect_sync_get_video and freenect_sync_get_depth
+    return, with the same lifetime, and no data is copied.
+
+    Args:
+        video: Populated with a pointer to a video buffer with a size of the requested type
+        video_timestamp: Populated with the timestamp of the video frame
+        depth: Populated with a pointer to a depth buffer with a size of the requested type
+        depth_timestamp: Populated with the timestamp of the depth frame
+        index: Device index (0 is the first)
+        video_fmt: Valid video format
+        depth_fmt: Valid depth format
+
+    Returns:
+        Nonzero on error.
+*/
+
 FREENECTAPI_SYNC int freenect_sync_set_tilt_degs(int angle, int index);
 /*  Tilt function, starts the runloop if it isn't running
 
@@ -134,6 +258,42 @@ FREENECTAPI_SYNC int freenect_sync_camera_to_world(int cx, int cy, int wz, doubl
     Wraps libfreenect_registration.h function of same name.
 */
 
+FREENECTAPI_SYNC void freenect_sync_set_wait_mode(freenect_sync_wait_mode mode);
+/*  Select how the get functions wait for a frame. Frames are handed over
+    without locking the runloop, so the choice only affects the caller.
+
+    Args:
+        mode: One of freenect_sync_wait_mode
+*/
+
+FREENECTAPI_SYNC int freenect_sync_set_thread_mode(freenect_sync_thread_mode mode);
+/*  Select whether all devices share one context and event thread, or each
+    device gets its own. With a thread per device, streaming and control
+    calls on one Kinect never wait for another, and event handling spreads
+    over the available cores. Can only be changed while no runloop is
+    running, i.e. before the first call or after freenect_sync_stop().
+
+    Args:
+        mode: One of freenect_sync_thread_mode
+
+    Returns:
+        Nonzero on error.
+*/
+
+FREENECTAPI_SYNC int freenect_sync_set_thread_params(const freenect_thread_params *params);
+/*  Set how the event threads are scheduled: CPU affinity, SCHED_FIFO
+    priority and memory locking (see freenect_set_event_thread_params). In
+    per device mode every thread gets the same settings. Without a call,
+    the LIBFREENECT_EVENT_* environment variables apply. Can only be changed
+    while no runloop is running.
+
+    Args:
+        params: Scheduling settings, or NULL for the library defaults
+
+    Returns:
+        Nonzero on error.
+*/
+
 FREENECTAPI_SYNC void freenect_sync_stop(void);
 #ifdef __cplusplus
 }
@@ -25,6 +25,7 @@
  */
 
 #include "libfreenect.hpp"
+#include "libfreenect_colorize.h"
 #include <stdio.h>
 #include <iostream>
 #include <string.h>
@@ -74,13 +75,9 @@ private:
 class MyFreenectDevice : public Freenect::FreenectDevice {
 public:
 	MyFreenectDevice(freenect_context *_ctx, int _index)
-		: Freenect::FreenectDevice(_ctx, _index), m_buffer_depth(freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB).bytes),m_buffer_video(freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB).bytes), m_gamma(2048), m_new_rgb_frame(false), m_new_depth_frame(false)
+		: Freenect::FreenectDevice(_ctx, _index), m_buffer_depth(freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB).bytes),m_buffer_video(freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB).bytes), m_new_rgb_frame(false), m_new_depth_frame(false)
 	{
-		for( unsigned int i = 0 ; i < 2048 ; i++) {
-			float v = i/2048.0;
-			v = std::pow(v, 3)* 6;
-			m_gamma[i] = v*6*256;
-		}
+		freenect_depth_palette_gamma(&m_palette);
 	}
 	//~MyFreenectDevice(){}
 	// Do not call directly even in child
@@ -93,48 +90,7 @@ public:
 	// Do not call directly even in child
 	void DepthCallback(void* _depth, uint32_t timestamp) {
 		Mutex::ScopedLock lock(m_depth_mutex);
-		uint16_t* depth = static_cast<uint16_t*>(_depth);
-		for( unsigned int i = 0 ; i < 640*480 ; i++) {
-			int pval = m_gamma[depth[i]];
-			int lb = pval & 0xff;
-			switch (pval>>8) {
-			case 0:
-				m_buffer_depth[3*i+0] = 255;
-				m_buffer_depth[3*i+1] = 255-lb;
-				m_buffer_depth[3*i+2] = 255-lb;
-				break;
-			case 1:
-				m_buffer_depth[3*i+0] = 255;
-				m_buffer_depth[3*i+1] = lb;
-				m_buffer_depth[3*i+2] = 0;
-				break;
-			case 2:
-				m_buffer_depth[3*i+0] = 255-lb;
-				m_buffer_depth[3*i+1] = 255;
-				m_buffer_depth[3*i+2] = 0;
-				break;
-			case 3:
-				m_buffer_depth[3*i+0] = 0;
-				m_buffer_depth[3*i+1] = 255;
-				m_buffer_depth[3*i+2] = lb;
-				break;
-			case 4:
-				m_buffer_depth[3*i+0] = 0;
-				m_buffer_depth[3*i+1] = 255-lb;
-				m_buffer_depth[3*i+2] = 255;
-				break;
-			case 5:
-				m_buffer_depth[3*i+0] = 0;
-				m_buffer_depth[3*i+1] = 0;
-				m_buffer_depth[3*i+2] = 255-lb;
-				break;
-			default:
-				m_buffer_depth[3*i+0] = 0;
-				m_buffer_depth[3*i+1] = 0;
-				m_buffer_depth[3*i+2] = 0;
-				break;
-			}
-		}
+		freenect_colorize_depth(&m_palette, _depth, FREENECT_DEPTH_11BIT, 640, 480, &m_buffer_depth[0], 3);
 		m_new_depth_frame = true;
 	}
 	bool getRGB(std::vector<uint8_t> &buffer) {
@@ -158,7 +114,7 @@ public:
 private:
 	std::vector<uint8_t> m_buffer_depth;
 	std::vector<uint8_t> m_buffer_video;
-	std::vector<uint16_t> m_gamma;
+	freenect_depth_palette m_palette;
 	Mutex m_rgb_mutex;
 	Mutex m_depth_mutex;
 	bool m_new_rgb_frame;
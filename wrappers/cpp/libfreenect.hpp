@@ -194,11 +194,14 @@ namespace Freenect {
 	  private:
 		typedef std::map<int, FreenectDevice*> DeviceMap;
 	  public:
-		Freenect() : m_stop(false) {
+		// params sets how the event thread is scheduled; by default the
+		// LIBFREENECT_EVENT_* environment variables apply
+		explicit Freenect(const freenect_thread_params *params = NULL) : m_stop(false) {
 			if(freenect_init(&m_ctx, NULL) < 0) throw std::runtime_error("Cannot initialize freenect library");
 			// We claim both the motor and camera devices, since this class exposes both.
 			// It does not support audio, so we do not claim it.
 			freenect_select_subdevices(m_ctx, static_cast<freenect_device_flags>(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA));
+			if (params) freenect_set_event_thread_params(m_ctx, params);
 			if(pthread_create(&m_thread, NULL, pthread_callback, (void*)this) != 0) throw std::runtime_error("Cannot initialize freenect thread");
 		}
 		~Freenect() {
@@ -248,6 +251,7 @@ namespace Freenect {
 		}
 		static void *pthread_callback(void *user_data) {
 			Freenect* freenect = static_cast<Freenect*>(user_data);
+			freenect_apply_event_thread_params(freenect->m_ctx);
 			(*freenect)();
 			return NULL;
 		}
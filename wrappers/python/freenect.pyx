@@ -63,6 +63,7 @@ cdef extern from "libfreenect.h":
         FREENECT_RESOLUTION_LOW
         FREENECT_RESOLUTION_MEDIUM
         FREENECT_RESOLUTION_HIGH
+        FREENECT_RESOLUTION_QUARTER
 
     ctypedef enum freenect_device_flags:
         FREENECT_DEVICE_MOTOR
@@ -133,8 +134,12 @@ cdef extern from "libfreenect.h":
 
 
 cdef extern from "libfreenect_sync.h":
+    enum:
+        FREENECT_SYNC_TIMEOUT
     int freenect_sync_get_video(void **video, uint32_t *timestamp, int index, freenect_video_format fmt) nogil
     int freenect_sync_get_depth(void **depth, uint32_t *timestamp, int index, freenect_depth_format fmt) nogil
+    int freenect_sync_get_video_timeout(void **video, uint32_t *timestamp, int index, freenect_resolution res, freenect_video_format fmt, int timeout_ms) nogil
+    int freenect_sync_get_depth_timeout(void **depth, uint32_t *timestamp, int index, freenect_resolution res, freenect_depth_format fmt, int timeout_ms) nogil
     void freenect_sync_stop()
 
 
@@ -160,6 +165,7 @@ LED_BLINK_RED_YELLOW = FREENECT_LED_BLINK_RED_YELLOW
 RESOLUTION_LOW = FREENECT_RESOLUTION_LOW
 RESOLUTION_MEDIUM = FREENECT_RESOLUTION_MEDIUM
 RESOLUTION_HIGH = FREENECT_RESOLUTION_HIGH
+RESOLUTION_QUARTER = FREENECT_RESOLUTION_QUARTER
 DEVICE_MOTOR = FREENECT_DEVICE_MOTOR
 DEVICE_CAMERA = FREENECT_DEVICE_CAMERA
 DEVICE_AUDIO = FREENECT_DEVICE_AUDIO
@@ -481,15 +487,16 @@ cdef _video_cb_np(void *data, freenect_frame_mode *mode):
     else:
         return (<char *>data)[:mode.bytes]
 
-def sync_get_depth(index=0, format=DEPTH_11BIT):
+def sync_get_depth(index=0, format=DEPTH_11BIT, timeout=None):
     """Get the next available depth frame from the kinect, as a numpy array.
 
     Args:
         index: Kinect device index (default: 0)
         format: Depth format (default: DEPTH_11BIT)
+        timeout: Seconds to wait for a frame, None waits forever (default: None)
 
     Returns:
-        (depth, timestamp) or None on error
+        (depth, timestamp) or None on error or timeout
         depth: A numpy array, shape:(480,640) dtype:np.uint16
         timestamp: int representing the time
     """
@@ -499,8 +506,11 @@ def sync_get_depth(index=0, format=DEPTH_11BIT):
     cdef int out
     cdef int _index = index
     cdef freenect_depth_format _format = format
+    cdef int _timeout_ms = -1 if timeout is None else int(timeout * 1000)
     with nogil:
-        out = freenect_sync_get_depth(&data, &timestamp, _index, _format)
+        out = freenect_sync_get_depth_timeout(&data, &timestamp, _index, FREENECT_RESOLUTION_MEDIUM, _format, _timeout_ms)
+    if out == FREENECT_SYNC_TIMEOUT:
+        return
     if out:
         error_open_device()
         return
@@ -511,15 +521,16 @@ def sync_get_depth(index=0, format=DEPTH_11BIT):
         raise TypeError('Conversion not implemented for type [%d]' % (format))
 
 
-def sync_get_video(index=0, format=VIDEO_RGB):
+def sync_get_video(index=0, format=VIDEO_RGB, timeout=None):
     """Get the next available rgb frame from the kinect, as a numpy array.
 
     Args:
         index: Kinect device index (default: 0)
         format: Depth format (default: VIDEO_RGB)
+        timeout: Seconds to wait for a frame, None waits forever (default: None)
 
     Returns:
-        (depth, timestamp) or None on error
+        (depth, timestamp) or None on error or timeout
         depth: A numpy array, shape:(480, 640, 3) dtype:np.uint8
         timestamp: int representing the time
     """
@@ -529,8 +540,11 @@ def sync_get_video(index=0, format=VIDEO_RGB):
     cdef int out
     cdef int _index = index
     cdef freenect_video_format _format = format
+    cdef int _timeout_ms = -1 if timeout is None else int(timeout * 1000)
     with nogil:
-        out = freenect_sync_get_video(&data, &timestamp, _index, _format)
+        out = freenect_sync_get_video_timeout(&data, &timestamp, _index, FREENECT_RESOLUTION_MEDIUM, _format, _timeout_ms)
+    if out == FREENECT_SYNC_TIMEOUT:
+        return
     if out:
         error_open_device()
         return
@@ -77,10 +77,12 @@ module FFI::Freenect
   RESOLUTION_LOW = 0
   RESOLUTION_MEDIUM = 1
   RESOLUTION_HIGH = 2
+  RESOLUTION_QUARTER = 3
   
   RESOLUTIONS = enum( :low, RESOLUTION_LOW,
                       :medium, RESOLUTION_MEDIUM,
-                      :high, RESOLUTION_HIGH)
+                      :high, RESOLUTION_HIGH,
+                      :quarter, RESOLUTION_QUARTER)
  
 	DEPTH_11BIT = 0
 	DEPTH_10BIT = 1